@@ -2,10 +2,15 @@
 #include <random>
 #include <type_traits>
 #include <algorithm>
+#include <cstdlib>
 
 #include "kcp_interface.h"
 #include "logging.h"
 
+// kcp_stream [fec_data_shards fec_parity_shards]
+static int fec_data_shards = 0;
+static int fec_parity_shards = 0;
+
 template<size_t N = 8 * 1024>
 union TimestampBuf {
     struct {
@@ -29,6 +34,8 @@ public:
         config.nodelay = true;
         config.resend = 2;
         config.rcvwnd = 64;
+        config.fec_data_shards = fec_data_shards;
+        config.fec_parity_shards = fec_parity_shards;
 
         stream_->Open(config, this);
     }
@@ -116,7 +123,12 @@ void Test() {
     }
 }
 
-int main() {
+int main(int argc, char *argv[]) {
+    if (argc > 2) {
+        fec_data_shards = std::atoi(argv[1]);
+        fec_parity_shards = std::atoi(argv[2]);
+    }
+
     auto ctx = kcp::KCPContextInterface::Create(8);
     ctx->Start();
 
@@ -0,0 +1,170 @@
+#include <iostream>
+#include <algorithm>
+#include <iomanip>
+#include <random>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <cstdlib>
+
+#include "timer_wheel.h"
+
+// timer_bench [rounds]
+// the executor's task queue as a multimap keyed by deadline against the
+// timing wheel, with sessions updated every 1..20ms as kcp streams are
+static int rounds = 5;
+
+class BenchTask : public kcp::TaskInterface {
+public:
+    uint32_t OnRun(uint32_t) override { return kNotContinue; }
+    void OnCancel() override {}
+};
+
+using Clock = std::chrono::steady_clock;
+
+double NsPerOp(Clock::time_point start, size_t ops) {
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        Clock::now() - start).count();
+    return ops ? static_cast<double>(ns) / ops : 0;
+}
+
+struct Result {
+    double schedule = 0;
+    double run = 0;
+    double cancel = 0;
+    size_t fired = 0;
+};
+
+// deadlines and intervals in microseconds, time advances 1ms a step
+template<typename Queue>
+Result Bench(size_t n, Queue& queue) {
+    std::vector<BenchTask> tasks(n);
+    std::default_random_engine e(1);
+    std::uniform_int_distribution<uint32_t> interval(1000, 20000);
+
+    uint64_t now = 1000000;
+    queue.Start(now);
+
+    Result result;
+    auto start = Clock::now();
+    for (size_t i = 0; i < n; ++i) {
+        queue.Schedule(&tasks[i], &tasks[i], now + interval(e));
+    }
+    result.schedule = NsPerOp(start, n);
+
+    start = Clock::now();
+    for (int step = 0; step < 1000; ++step) {
+        now += 1000;
+        while (kcp::TaskInterface *task = queue.PopExpired(now)) {
+            queue.Reschedule(task, now + interval(e));
+            ++result.fired;
+        }
+    }
+    result.run = NsPerOp(start, result.fired);
+
+    // a sample, the map scans all of it for every key
+    size_t cancels = (std::min)(n, size_t(100));
+    start = Clock::now();
+    for (size_t i = 0; i < cancels; ++i) {
+        queue.Cancel(&tasks[i * (n / cancels)]);
+    }
+    result.cancel = NsPerOp(start, cancels);
+
+    return result;
+}
+
+class MapQueue {
+public:
+    void Start(uint64_t) {}
+
+    void Schedule(void *key, kcp::TaskInterface *task, uint64_t deadline) {
+        tasks_.emplace(deadline, std::make_pair(key, task));
+    }
+
+    void Reschedule(kcp::TaskInterface *task, uint64_t deadline) {
+        tasks_.emplace(deadline, std::make_pair(static_cast<void *>(task), task));
+    }
+
+    kcp::TaskInterface *PopExpired(uint64_t now) {
+        if (tasks_.empty() || tasks_.begin()->first > now) {
+            return nullptr;
+        }
+
+        auto task = tasks_.begin()->second.second;
+        tasks_.erase(tasks_.begin());
+        return task;
+    }
+
+    // by key, the way the executor cancelled before the wheel
+    void Cancel(kcp::TaskInterface *task) {
+        auto it = tasks_.begin();
+        while (tasks_.end() != it) {
+            if (it->second.first == task) {
+                it = tasks_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+private:
+    std::multimap<uint64_t, std::pair<void *, kcp::TaskInterface *>> tasks_;
+};
+
+class WheelQueue {
+public:
+    void Start(uint64_t now) {
+        wheel_.PopExpired(now);
+    }
+
+    void Schedule(void *key, kcp::TaskInterface *task, uint64_t deadline) {
+        wheel_.Schedule(key, task, deadline);
+    }
+
+    void Reschedule(kcp::TaskInterface *task, uint64_t deadline) {
+        wheel_.Reschedule(task, deadline);
+    }
+
+    kcp::TaskInterface *PopExpired(uint64_t now) {
+        return wheel_.PopExpired(now);
+    }
+
+    void Cancel(kcp::TaskInterface *task) {
+        wheel_.Cancel(task);
+    }
+private:
+    kcp::TimerWheel wheel_;
+};
+
+template<typename Queue>
+Result Best(size_t n) {
+    Result best;
+    for (int i = 0; i < rounds; ++i) {
+        Queue queue;
+        Result r = Bench(n, queue);
+        if (0 == i || r.run < best.run) {
+            best = r;
+        }
+    }
+
+    return best;
+}
+
+void Print(const char *name, size_t n, const Result& r) {
+    std::cout << std::setw(8) << name << std::setw(8) << n
+        << std::fixed << std::setprecision(1)
+        << "  schedule=" << r.schedule << "ns"
+        << "  run=" << r.run << "ns"
+        << "  cancel=" << r.cancel << "ns"
+        << "  fired=" << r.fired << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1) {
+        rounds = std::atoi(argv[1]);
+    }
+
+    for (size_t n : { 1000, 10000, 100000 }) {
+        Print("multimap", n, Best<MapQueue>(n));
+        Print("wheel", n, Best<WheelQueue>(n));
+    }
+}
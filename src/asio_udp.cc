@@ -1,12 +1,16 @@
 #include "asio_udp.h"
 
+#include <algorithm>
+#include <functional>
+#include <future>
 #include <iostream>
+#if defined(__linux__)
+#include <sys/socket.h>
+#endif
 
 using namespace kcp;
 
 namespace {
-constexpr uint32_t kWaitForPrecision = 4;
-
 bool Address2Endpoint(const IP4Address& from,
                       boost::asio::ip::udp::endpoint *to) {
     KCP_ASSERT(to);
@@ -50,8 +54,8 @@ private:
 
 //static
 std::shared_ptr<IOContextInterface>
-IOContextInterface::Create(size_t thread_num) {
-    return AsioIOContext::Create(thread_num);
+IOContextInterface::Create(size_t thread_num, const ExecutorConfig& config) {
+    return AsioIOContext::Create(thread_num, config);
 }
 
 void IOContextThread::Start() {
@@ -79,16 +83,12 @@ bool IOContextThread::CanNowExecuted() const {
     return stopped() || thread_.get_id() == std::this_thread::get_id();
 }
 
-bool IOContextThread::DispatchTask(void *key, TaskInterface *task) {
+TaskHandle IOContextThread::DispatchTask(void *key, TaskInterface *task) {
     boost::asio::dispatch(*this, [key, task, this]{
-        uint32_t now = Now32();
-        uint32_t delay = task->OnRun(now);
-        if (TaskInterface::kNotContinue != delay) {
-            tasks_.emplace(now + delay, std::make_pair(key, task));
-        }
+        RunTask(key, task);
     });
 
-    return true;
+    return TaskHandle{ task };
 }
 
 void IOContextThread::CancelTask(void *key) {
@@ -96,64 +96,197 @@ void IOContextThread::CancelTask(void *key) {
         *this,
 
         boost::asio::use_future([key, this] {
-            auto it = tasks_.begin();
-            while (tasks_.end() != it) {
-                if (it->second.first == key) {
-                    it->second.second->OnCancel();
-                    it = tasks_.erase(it);
-                } else {
-                    ++it;
-                }
+            std::vector<TaskInterface *> tasks;
+            wheel_.Take(key, &tasks);
+            for (auto task : tasks) {
+                task->OnCancel();
             }
         })
     ).wait();
 }
 
-uint32_t IOContextThread::RunTasks() {
-    uint32_t now = Now32();
+void IOContextThread::CancelTask(const TaskHandle& handle) {
+    TaskInterface *task = handle.task;
+    if (!task) {
+        return;
+    }
+
+    // inline on this thread, queued behind its dispatch otherwise. the
+    // wheel links the task itself, OnCancel is where it may be freed
+    boost::asio::dispatch(*this, [task, this] {
+        wheel_.Cancel(task);
+        task->OnCancel();
+    });
+}
+
+AllocatorInterface *IOContextThread::allocator() {
+    return &segment_pool_;
+}
+
+ExecutorStats IOContextThread::stats() const {
+    ExecutorStats stats = stats_;
+    stats.packets = packets_.load(std::memory_order_relaxed);
+    stats.busy_us = busy_us_.load(std::memory_order_relaxed);
+    return stats;
+}
+
+bool IOContextThread::RunTask(void *key, TaskInterface *task) {
+    uint64_t now = NowUs64();
+    uint32_t delay = task->OnRun(static_cast<uint32_t>(now));
+    if (TaskInterface::kNotContinue == delay) {
+        return false;
+    }
+
+    wheel_.Schedule(key, task, now + delay);
+    if (now + delay < timer_deadline_) {
+        ArmTimer(now, delay);
+    }
+
+    return true;
+}
+
+bool IOContextThread::UnlinkTask(TaskInterface *task) {
+    return wheel_.Cancel(task);
+}
+
+void IOContextThread::AddLoad(uint64_t packets, uint64_t busy_us) {
+    packets_.fetch_add(packets, std::memory_order_relaxed);
+    busy_us_.fetch_add(busy_us, std::memory_order_relaxed);
+}
+
+uint64_t IOContextThread::busy_us() const {
+    return busy_us_.load(std::memory_order_relaxed);
+}
+
+bool IOContextThread::QueueFrame(AsioUDP *udp, const IP4Address& to,
+                                 const boost::asio::ip::udp::endpoint& peer,
+                                 const UDPDatagram *datagrams, size_t count) {
+    if (!in_frame_) {
+        return false;
+    }
+
+    if (frame_udps_.empty() || frame_udps_.back().get() != udp) {
+        frame_udps_.push_back(udp->shared_from_this());
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        frame_datagrams_.push_back({ udp, to, peer, frame_buf_.size(), datagrams[i].len });
+        frame_buf_.insert(frame_buf_.end(), datagrams[i].buf, datagrams[i].buf + datagrams[i].len);
+    }
+
+    return true;
+}
 
-    while (!tasks_.empty()) {
-        auto task_pair = tasks_.begin()->second;
+void IOContextThread::FlushFrame() {
+    if (frame_datagrams_.empty()) {
+        return;
+    }
 
-        int32_t diff = TimeDiff(tasks_.begin()->first, now);
-        if (diff > 0) {
-            return diff;
+    // grouped per socket, in the order queued on each
+    std::stable_sort(frame_datagrams_.begin(), frame_datagrams_.end(),
+                     [](const FrameDatagram& a, const FrameDatagram& b) {
+                         return std::less<AsioUDP *>()(a.udp, b.udp);
+                     });
+
+    size_t count = frame_datagrams_.size();
+    for (size_t i = 0; i < count;) {
+        size_t n = 1;
+        while (i + n < count && frame_datagrams_[i + n].udp == frame_datagrams_[i].udp) {
+            ++n;
         }
 
-        tasks_.erase(tasks_.begin());
+        frame_datagrams_[i].udp->SendFrame(&frame_datagrams_[i], n, frame_buf_.data());
+        i += n;
+    }
+
+    frame_datagrams_.clear();
+    frame_buf_.clear();
+    frame_udps_.clear();
+}
 
-        uint32_t delay = task_pair.second->OnRun(now);
+uint64_t IOContextThread::RunTasks(uint64_t now) {
+    bool ran = false;
+    in_frame_ = 0 != config_.frame_interval;
+    while (TaskInterface *task = wheel_.PopExpired(now)) {
+        ++stats_.runs;
+        ran = true;
+        uint32_t delay = task->OnRun(static_cast<uint32_t>(now));
         if (TaskInterface::kNotContinue != delay) {
-            tasks_.emplace(now + delay, std::move(task_pair));
+            wheel_.Reschedule(task, now + delay);
         }
     }
+    in_frame_ = false;
+    FlushFrame();
 
-    return 0;
+    if (ran) {
+        AddLoad(0, NowUs64() - now);
+    }
+
+    return wheel_.NextDelay(now);
 }
 
 void IOContextThread::CancelAllTasks() {
-    for (auto && task : tasks_) {
-        task.second.second->OnCancel();
+    std::vector<TaskInterface *> tasks;
+    wheel_.TakeAll(&tasks);
+    for (auto task : tasks) {
+        task->OnCancel();
     }
-
-    tasks_.clear();
 }
 
 void IOContextThread::StartTimer() {
-    uint32_t delay = RunTasks();
-    if (delay <= kWaitForPrecision) {
-        boost::asio::post(*this, [this] { StartTimer(); });
+    uint64_t now = NowUs64();
+    ArmTimer(now, RunTasks(now));
+}
+
+void IOContextThread::OnTimer() {
+    uint64_t now = NowUs64();
+
+    ++stats_.wakeups;
+    if (wheel_.NextDelay(now) > 0) {
+        ++stats_.spurious_wakeups;
+    }
+
+    ArmTimer(now, RunTasks(now));
+}
+
+void IOContextThread::ArmTimer(uint64_t now, uint64_t delay) {
+    uint64_t gen = ++timer_gen_;
+
+    if (TimerWheel::kNever == delay) {
+        // idle until a task is dispatched
+        timer_deadline_ = TimerWheel::kNever;
+        timer_.cancel();
         return;
     }
 
-    timer_.expires_from_now(std::chrono::milliseconds(delay));
+    // input is taken in as it arrives, output waits for the frame
+    if (config_.frame_interval) {
+        uint64_t frame = config_.frame_interval;
+        delay = (now + delay + frame - 1) / frame * frame - now;
+    }
 
-    timer_.async_wait([this](const boost::system::error_code& ec) {
-        if (ec) {
+    timer_deadline_ = now + delay;
+
+    // io handlers still run between the polls
+    if (delay <= config_.spin_threshold) {
+        ++stats_.spins;
+        timer_.cancel();
+        boost::asio::post(*this, [this, gen] {
+            if (gen == timer_gen_) {
+                StartTimer();
+            }
+        });
+        return;
+    }
+
+    timer_.expires_after(std::chrono::microseconds(delay));
+
+    timer_.async_wait([this, gen](const boost::system::error_code& ec) {
+        if (ec || gen != timer_gen_) {
             return;
         }
 
-        StartTimer();
+        OnTimer();
     });
 }
 
@@ -161,10 +294,164 @@ void IOContextThread::StopTimer() {
     timer_.cancel();
 }
 
+SocketExecutor::SocketExecutor(std::shared_ptr<IOContextThread> thread)
+    : thread_(thread.get())
+    , threads_{ thread }
+    , allocator_(this) {
+}
+
+bool SocketExecutor::CanNowExecuted() const {
+    return thread()->CanNowExecuted();
+}
+
+TaskHandle SocketExecutor::DispatchTask(void *key, TaskInterface *task) {
+    Dispatch([this, key, task](IOContextThread *thread) {
+        if (thread->RunTask(key, task) && key) {
+            tasks_[task] = key;
+        }
+    });
+
+    return TaskHandle{ task };
+}
+
+void SocketExecutor::CancelTask(void *key) {
+    auto cancel = [this, key](IOContextThread *thread) {
+        auto it = tasks_.begin();
+        while (tasks_.end() != it) {
+            TaskInterface *task = it->first;
+            if (it->second != key) {
+                ++it;
+                continue;
+            }
+
+            it = tasks_.erase(it);
+            if (thread->UnlinkTask(task)) {
+                task->OnCancel();
+            }
+        }
+
+        for (size_t i = 0; i < moving_.size();) {
+            if (moving_[i].second != key) {
+                ++i;
+                continue;
+            }
+
+            TaskInterface *task = moving_[i].first;
+            moving_.erase(moving_.begin() + i);
+            task->OnCancel();
+        }
+    };
+
+    if (CanNowExecuted()) {
+        cancel(thread());
+        return;
+    }
+
+    std::promise<void> done;
+    Dispatch([&cancel, &done](IOContextThread *thread) {
+        cancel(thread);
+        done.set_value();
+    });
+    done.get_future().wait();
+}
+
+void SocketExecutor::CancelTask(const TaskHandle& handle) {
+    TaskInterface *task = handle.task;
+    if (!task) {
+        return;
+    }
+
+    Dispatch([this, task](IOContextThread *thread) {
+        tasks_.erase(task);
+        if (!thread->UnlinkTask(task)) {
+            CancelMoving(task);
+        }
+
+        task->OnCancel();
+    });
+}
+
+AllocatorInterface *SocketExecutor::allocator() {
+    return &allocator_;
+}
+
+ExecutorStats SocketExecutor::stats() const {
+    return thread()->stats();
+}
+
+IOContextThread *SocketExecutor::thread() const {
+    return thread_.load(std::memory_order_acquire);
+}
+
+void SocketExecutor::MoveTo(std::shared_ptr<IOContextThread> to) {
+    IOContextThread *thread = this->thread();
+
+    // tasks that ended by themselves are dropped
+    for (auto&& [task, key] : tasks_) {
+        if (thread->UnlinkTask(task)) {
+            moving_.emplace_back(task, key);
+        }
+    }
+    tasks_.clear();
+
+    if (threads_.end() == std::find(threads_.begin(), threads_.end(), to)) {
+        threads_.push_back(to);
+    }
+
+    thread_.store(to.get(), std::memory_order_release);
+}
+
+void SocketExecutor::Adopt() {
+    IOContextThread *thread = this->thread();
+
+    for (size_t size : allocator_.reserved_) {
+        thread->allocator()->Reserve(size);
+    }
+
+    auto moving = std::move(moving_);
+    moving_.clear();
+    for (auto&& [task, key] : moving) {
+        if (thread->RunTask(key, task)) {
+            tasks_[task] = key;
+        }
+    }
+}
+
+bool SocketExecutor::CancelMoving(TaskInterface *task) {
+    for (size_t i = 0; i < moving_.size(); ++i) {
+        if (moving_[i].first == task) {
+            moving_.erase(moving_.begin() + i);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void *SocketExecutor::Allocator::Allocate(size_t size) {
+    return executor_->thread()->allocator()->Allocate(size);
+}
+
+void SocketExecutor::Allocator::Deallocate(void *p) {
+    executor_->thread()->allocator()->Deallocate(p);
+}
+
+void SocketExecutor::Allocator::Reserve(size_t size) {
+    if (reserved_.end() == std::find(reserved_.begin(), reserved_.end(), size)) {
+        reserved_.push_back(size);
+    }
+
+    executor_->thread()->allocator()->Reserve(size);
+}
+
+AllocatorStats SocketExecutor::Allocator::stats() const {
+    return executor_->thread()->allocator()->stats();
+}
+
 AsioUDP::AsioUDP(std::shared_ptr<IOContextThread> io_ctx)
     : socket_(*io_ctx, boost::asio::ip::udp::v4())
     , recv_buf_()
-    , io_ctx_(io_ctx) {
+    , executor_(std::make_shared<SocketExecutor>(io_ctx)) {
 }
 
 bool AsioUDP::Bind(const IP4Address& addr) {
@@ -179,6 +466,12 @@ bool AsioUDP::Bind(const IP4Address& addr) {
         return false;
     }
 
+    // synchronous sends and reads behind an async one must not block
+    socket_.non_blocking(true, ec);
+    if (ec) {
+        return false;
+    }
+
     address_ = addr;
     return true;
 }
@@ -188,27 +481,44 @@ bool AsioUDP::Open(UDPCallback *cb) {
         return false;
     }
 
-    cb_ = cb;
-    closed_ = false;
+    {
+        std::lock_guard<std::recursive_mutex> lock(cb_mutex_);
+        cb_ = cb;
+        closed_ = false;
+    }
 
     StartRead();
     return true;
 }
 
 void AsioUDP::Close() {
-    if (socket_.is_open()) {
-        socket_.shutdown(boost::asio::socket_base::shutdown_send);
-        socket_.close();
+    // the callback is gone once this returns, a running one is waited for
+    {
+        std::lock_guard<std::recursive_mutex> lock(cb_mutex_);
+        closed_ = true;
+        cb_ = nullptr;
     }
 
-    if (closed_) {
+    // the socket may be moving between threads, it is only touched on the
+    // one it is on
+    if (executor_->CanNowExecuted()) {
+        CloseSocket();
         return;
     }
 
+    executor_->Forward([sp = shared_from_this()](IOContextThread *) {
+        sp->CloseSocket();
+    });
+}
+
+void AsioUDP::CloseSocket() {
+    if (socket_.is_open()) {
+        socket_.shutdown(boost::asio::socket_base::shutdown_send);
+        socket_.close();
+    }
+
     closed_ = true;
     cb_ = nullptr;
-
-    io_ctx_->CancelTask(this);
 }
 
 void AsioUDP::SetRecvBufSize(size_t recv_size) {
@@ -217,27 +527,168 @@ void AsioUDP::SetRecvBufSize(size_t recv_size) {
     }
 }
 
+bool AsioUDP::SetDontFragment(bool enable) {
+    auto fd = socket_.native_handle();
+#if defined(_WIN32)
+    DWORD value = enable ? TRUE : FALSE;
+    return 0 == setsockopt(fd, IPPROTO_IP, IP_DONTFRAGMENT,
+                           reinterpret_cast<const char *>(&value), sizeof(value));
+#elif defined(IP_MTU_DISCOVER)
+    // PROBE sets DF without capping sends at the kernel's path mtu guess
+    int value = enable ? IP_PMTUDISC_PROBE : IP_PMTUDISC_WANT;
+    return 0 == setsockopt(fd, IPPROTO_IP, IP_MTU_DISCOVER, &value, sizeof(value));
+#elif defined(IP_DONTFRAG)
+    int value = enable ? 1 : 0;
+    return 0 == setsockopt(fd, IPPROTO_IP, IP_DONTFRAG, &value, sizeof(value));
+#else
+    return !enable;
+#endif
+}
+
 bool AsioUDP::Send(const IP4Address& to, const char *buf, size_t len) {
     if (closed_) {
         return false;
     }
 
+    UDPDatagram datagram{ buf, len };
+    boost::asio::ip::udp::endpoint peer;
+    if (!in_writing_ && !migrating_ && Address2Endpoint(to, &peer) &&
+        thread()->QueueFrame(this, to, peer, &datagram, 1)) {
+        AddLoad(1, 0);
+        return true;
+    }
+
     write_bufs_.PutBuf(to, Buffer::New(len, buf));
     TryStartWrite();
+    AddLoad(1, 0);
+
+    return true;
+}
+
+bool AsioUDP::SendBatch(const IP4Address& to, const UDPDatagram *datagrams, size_t count) {
+    if (closed_) {
+        return false;
+    }
+
+    // nothing queued: send in place until the socket would block, only
+    // the rest is copied and waits for the async write
+    size_t i = 0;
+    boost::asio::ip::udp::endpoint peer;
+    if (!in_writing_ && !migrating_ && Address2Endpoint(to, &peer)) {
+        // in frame mode it goes out with the rest of the frame
+        if (thread()->QueueFrame(this, to, peer, datagrams, count)) {
+            AddLoad(count, 0);
+            return true;
+        }
+
+        for (; i < count; ++i) {
+            boost::system::error_code ec;
+            socket_.send_to(boost::asio::buffer(datagrams[i].buf, datagrams[i].len), peer, 0, ec);
+            // over the path mtu with DF set, lost like any probe
+            if (boost::asio::error::message_size == ec) {
+                continue;
+            }
+            if (ec) {
+                break;
+            }
+        }
+    }
+
+    for (; i < count; ++i) {
+        write_bufs_.PutBuf(to, Buffer::New(datagrams[i].len, datagrams[i].buf));
+    }
 
+    TryStartWrite();
+    AddLoad(count, 0);
     return true;
 }
 
+void AsioUDP::SendFrame(const IOContextThread::FrameDatagram *datagrams,
+                        size_t count, const char *buf) {
+    if (closed_) {
+        return;
+    }
+
+    size_t i = 0;
+    if (!in_writing_ && !migrating_) {
+#if defined(__linux__)
+        constexpr size_t kSendBatch = 64;
+        std::array<mmsghdr, kSendBatch> msgs;
+        std::array<iovec, kSendBatch> iovs;
+        while (i < count) {
+            size_t n = (std::min)(count - i, kSendBatch);
+            for (size_t k = 0; k < n; ++k) {
+                const auto& datagram = datagrams[i + k];
+                iovs[k].iov_base = const_cast<char *>(buf + datagram.offset);
+                iovs[k].iov_len = datagram.len;
+                msgs[k] = mmsghdr();
+                msgs[k].msg_hdr.msg_name = const_cast<sockaddr *>(datagram.peer.data());
+                msgs[k].msg_hdr.msg_namelen = static_cast<socklen_t>(datagram.peer.size());
+                msgs[k].msg_hdr.msg_iov = &iovs[k];
+                msgs[k].msg_hdr.msg_iovlen = 1;
+            }
+
+            int sent = ::sendmmsg(socket_.native_handle(), msgs.data(),
+                                  static_cast<unsigned int>(n), 0);
+            if (sent > 0) {
+                i += static_cast<size_t>(sent);
+            } else if (sent < 0 && EMSGSIZE == errno) {
+                // over the path mtu with DF set, lost like any probe
+                ++i;
+            } else if (sent < 0 && EINTR == errno) {
+                continue;
+            } else {
+                break;
+            }
+        }
+#else
+        for (; i < count; ++i) {
+            boost::system::error_code ec;
+            socket_.send_to(boost::asio::buffer(buf + datagrams[i].offset, datagrams[i].len),
+                            datagrams[i].peer, 0, ec);
+            if (boost::asio::error::message_size == ec) {
+                continue;
+            }
+            if (ec) {
+                break;
+            }
+        }
+#endif
+    }
+
+    // the socket would block, the rest waits for the async write
+    for (; i < count; ++i) {
+        write_bufs_.PutBuf(datagrams[i].to, Buffer::New(datagrams[i].len, buf + datagrams[i].offset));
+    }
+
+    TryStartWrite();
+}
+
 const IP4Address& AsioUDP::local_address() const {
     return address_;
 }
 
 ExecutorInterface *AsioUDP::executor() {
-    return io_ctx_.get();
+    return executor_.get();
+}
+
+void AsioUDP::MigrateTo(std::shared_ptr<IOContextThread> to) {
+    executor_->Forward([sp = shared_from_this(), to](IOContextThread *) {
+        sp->StartMigration(to);
+    });
+}
+
+uint64_t AsioUDP::packets() const {
+    return packets_.load(std::memory_order_relaxed);
+}
+
+IOContextThread *AsioUDP::thread() const {
+    return executor_->thread();
 }
 
 void AsioUDP::TryStartWrite() {
-    if (in_writing_) {
+    // queued writes go out after the move
+    if (in_writing_ || migrating_ || migrate_to_) {
         return;
     }
 
@@ -258,17 +709,28 @@ void AsioUDP::TryStartWrite() {
         return;
     }
 
+    // one datagram per send, a buffer sequence is gathered into one
     socket_.async_send_to(
-        in_writing_buf_,
+        *in_writing_buf_.begin(),
         in_writing_peer_,
 
         [sp = shared_from_this()]
         (const boost::system::error_code& ec, std::size_t bytes_transferred) mutable {
-            if (ec && sp->ErrorCallback(ec)) {
-                return;
+            if (sp->migrate_to_ && boost::asio::error::operation_aborted == ec) {
+                // kept, it is sent again from the new thread
+                sp->in_writing_ = false;
+            } else {
+                // over the path mtu with DF set, dropped like a lost probe
+                if (ec && boost::asio::error::message_size != ec && sp->ErrorCallback(ec)) {
+                    return;
+                }
+
+                sp->WriteCallback(bytes_transferred);
             }
 
-            sp->WriteCallback(bytes_transferred);
+            if (sp->migrate_to_) {
+                sp->TryMigrate();
+            }
         }
     );
 
@@ -276,6 +738,10 @@ void AsioUDP::TryStartWrite() {
 }
 
 void AsioUDP::StartRead() {
+    if (migrate_to_) {
+        return;
+    }
+
     // TODO :
     // fix bug : changing recv buf size will lost data
     if (recv_buf_.size() < recv_buf_size_) {
@@ -284,39 +750,91 @@ void AsioUDP::StartRead() {
 
     socket_.async_receive_from(
         boost::asio::buffer(recv_buf_),
-        peer_,
+        recv_peers_[0],
 
         [sp = shared_from_this()]
         (const boost::system::error_code& ec, std::size_t bytes_transferred) {
-            if (ec && sp->ErrorCallback(ec)) {
-                return;
+            sp->in_reading_ = false;
+
+            if (!sp->migrate_to_ || boost::asio::error::operation_aborted != ec) {
+                if (ec && sp->ErrorCallback(ec)) {
+                    return;
+                }
+
+                if (bytes_transferred > 0) {
+                    sp->ReadCallback(bytes_transferred);
+                }
             }
 
-            if (bytes_transferred > 0) {
-                sp->ReadCallback(bytes_transferred);
+            if (sp->migrate_to_) {
+                sp->TryMigrate();
             }
         }
     );
+
+    in_reading_ = true;
 }
 
-void AsioUDP::WriteCallback(std::size_t bytes_transferred) {
-    in_writing_buf_.Cut(bytes_transferred);
+void AsioUDP::WriteCallback(std::size_t) {
+    // sent or dropped as a whole
+    in_writing_buf_.Pop();
     in_writing_ = false;
     TryStartWrite();
 }
 
 void AsioUDP::ReadCallback(std::size_t bytes_transferred) {
-    if (cb_) {
+    uint64_t start = NowUs64();
+
+    recv_batch_[0] = { recv_buf_.data(), bytes_transferred };
+    size_t count = 1;
+    size_t used = bytes_transferred;
+
+    // available() is at least the size of the next datagram, stop when
+    // it may not fit the rest of the buffer
+    while (count < kRecvBatch) {
+        boost::system::error_code ec;
+        size_t next = socket_.available(ec);
+        if (ec || 0 == next || next > recv_buf_.size() - used) {
+            break;
+        }
+
+        size_t len = socket_.receive_from(
+            boost::asio::buffer(recv_buf_.data() + used, recv_buf_.size() - used),
+            recv_peers_[count], 0, ec);
+        if (ec) {
+            break;
+        }
+
+        recv_batch_[count++] = { recv_buf_.data() + used, len };
+        used += len;
+    }
+
+    std::unique_lock<std::recursive_mutex> lock(cb_mutex_);
+    for (size_t i = 0; i < count && cb_;) {
+        size_t n = 1;
+        while (i + n < count && recv_peers_[i + n] == recv_peers_[i]) {
+            ++n;
+        }
+
         IP4Address from;
-        Endpoint2Address(peer_, &from);
+        Endpoint2Address(recv_peers_[i], &from);
 
-        cb_->OnRecvUDP(from, recv_buf_.data(), bytes_transferred);
+        if (1 == n) {
+            cb_->OnRecvUDP(from, recv_batch_[i].buf, recv_batch_[i].len);
+        } else {
+            cb_->OnRecvUDPBatch(from, &recv_batch_[i], n);
+        }
+
+        i += n;
     }
+    lock.unlock();
 
+    AddLoad(count, NowUs64() - start);
     StartRead();
 }
 
 bool AsioUDP::ErrorCallback(const boost::system::error_code& ec) {
+    std::lock_guard<std::recursive_mutex> lock(cb_mutex_);
     if (closed_ || !cb_) {
         return true;
     }
@@ -324,26 +842,112 @@ bool AsioUDP::ErrorCallback(const boost::system::error_code& ec) {
     return cb_->OnError({ ec.value(), BoostErrorCategory(ec.category()) });
 }
 
+void AsioUDP::AddLoad(uint64_t packets, uint64_t busy_us) {
+    packets_.fetch_add(packets, std::memory_order_relaxed);
+    executor_->thread()->AddLoad(packets, busy_us);
+}
+
+void AsioUDP::StartMigration(std::shared_ptr<IOContextThread> to) {
+    if (closed_ || migrate_to_ || migrating_ || to.get() == thread()) {
+        return;
+    }
+
+    migrate_to_ = std::move(to);
+    if (!in_reading_ && !in_writing_) {
+        TryMigrate();
+        return;
+    }
+
+    // the handlers see operation_aborted and hand the socket over
+    boost::system::error_code ec;
+    socket_.cancel(ec);
+    if (ec) {
+        migrate_to_.reset();
+    }
+}
+
+void AsioUDP::TryMigrate() {
+    if (in_reading_ || in_writing_) {
+        return;
+    }
+
+    auto to = std::move(migrate_to_);
+    migrate_to_.reset();
+    if (closed_) {
+        return;
+    }
+
+    // the descriptor changes hands, datagrams wait in the kernel buffer
+    boost::system::error_code ec;
+    auto fd = socket_.release(ec);
+    if (ec) {
+        // not supported before windows 8.1, the socket stays
+        StartRead();
+        TryStartWrite();
+        return;
+    }
+
+    migrating_ = true;
+    executor_->MoveTo(to);
+    executor_->Forward([sp = shared_from_this(), fd](IOContextThread *thread) {
+        sp->Adopt(fd, thread);
+    });
+}
+
+void AsioUDP::Adopt(boost::asio::ip::udp::socket::native_handle_type fd,
+                    IOContextThread *to) {
+    boost::system::error_code ec;
+    socket_ = boost::asio::ip::udp::socket(*to);
+    socket_.assign(boost::asio::ip::udp::v4(), fd, ec);
+    if (!ec) {
+        socket_.non_blocking(true, ec);
+    }
+
+    migrating_ = false;
+    executor_->Adopt();
+
+    // closed while moving
+    if (closed_) {
+        socket_.close(ec);
+        return;
+    }
+
+    if (ec) {
+        ErrorCallback(ec);
+        return;
+    }
+
+    StartRead();
+    TryStartWrite();
+}
+
 // static
 std::shared_ptr<AsioIOContext>
-AsioIOContext::Create(size_t thread_num) {
-    return { new AsioIOContext(thread_num), [](auto *p) { delete p; } };
+AsioIOContext::Create(size_t thread_num, const ExecutorConfig& config) {
+    return { new AsioIOContext(thread_num, config), [](auto *p) { delete p; } };
 }
 
-AsioIOContext::AsioIOContext(size_t thread_num) {
+AsioIOContext::AsioIOContext(size_t thread_num, const ExecutorConfig& config)
+    : rebalance_interval_(config.rebalance_interval) {
     if (0 == thread_num) {
         thread_num = std::thread::hardware_concurrency();
     }
 
     for (size_t i = 0; i < thread_num; ++i) {
-        threads_.push_back(std::make_shared<IOContextThread>());
+        threads_.push_back(std::make_shared<IOContextThread>(config));
     }
+
+    balanced_busy_.resize(threads_.size());
 }
 
 void AsioIOContext::Start() {
     for (auto&& thread : threads_) {
         thread->Start();
     }
+
+    if (rebalance_interval_ && threads_.size() > 1) {
+        threads_[0]->DispatchTask(this, this);
+    }
 }
 
 void AsioIOContext::Stop() {
@@ -363,6 +967,15 @@ AsioIOContext::CreateUDP(const IP4Address& addr) {
         return nullptr;
     }
 
+    std::lock_guard<std::mutex> lock(mutex_);
+    // closed sockets are dropped whenever the list would grow
+    if (udps_.size() == udps_.capacity()) {
+        udps_.erase(std::remove_if(udps_.begin(), udps_.end(),
+                                   [](auto&& udp) { return udp.expired(); }),
+                    udps_.end());
+    }
+    udps_.push_back(udp);
+
     return udp;
 }
 
@@ -370,6 +983,95 @@ ExecutorInterface *AsioIOContext::executor() {
     return SelectIOThread().get();
 }
 
+void AsioIOContext::Rebalance() {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    uint64_t now = NowUs64();
+    uint64_t elapsed = now - balanced_time_;
+    balanced_time_ = now;
+
+    size_t thread_num = threads_.size();
+    std::vector<uint64_t> busy(thread_num);
+    for (size_t i = 0; i < thread_num; ++i) {
+        uint64_t total = threads_[i]->busy_us();
+        busy[i] = total - balanced_busy_[i];
+        balanced_busy_[i] = total;
+    }
+
+    // packets since the last pass, per socket and per thread
+    struct Socket {
+        std::shared_ptr<AsioUDP> udp;
+        size_t thread;
+        uint64_t packets;
+    };
+    std::vector<Socket> sockets;
+    std::vector<uint64_t> packets(thread_num);
+
+    for (size_t i = 0; i < udps_.size();) {
+        auto udp = udps_[i].lock();
+        if (!udp) {
+            udps_[i] = std::move(udps_.back());
+            udps_.pop_back();
+            continue;
+        }
+        ++i;
+
+        auto it = std::find_if(threads_.begin(), threads_.end(),
+                               [&udp](auto&& thread) { return thread.get() == udp->thread(); });
+        if (threads_.end() == it) {
+            continue;
+        }
+
+        uint64_t total = udp->packets();
+        size_t index = it - threads_.begin();
+        packets[index] += total - udp->balanced_packets_;
+        sockets.push_back({ udp, index, total - udp->balanced_packets_ });
+        udp->balanced_packets_ = total;
+    }
+
+    if (thread_num < 2) {
+        return;
+    }
+
+    size_t hot = std::max_element(busy.begin(), busy.end()) - busy.begin();
+    size_t cold = std::min_element(busy.begin(), busy.end()) - busy.begin();
+    uint64_t gap = busy[hot] - busy[cold];
+
+    // a thread under a tenth busy, or loads within a quarter of each other
+    if (busy[hot] * 10 < elapsed || gap * 4 < busy[hot] || 0 == packets[hot]) {
+        return;
+    }
+
+    // a socket's busy time is taken as its share of the thread's packets.
+    // the largest one up to half the gap moves, a larger one would only
+    // turn the imbalance around
+    AsioUDP *best = nullptr;
+    uint64_t best_load = 0;
+    for (auto&& socket : sockets) {
+        if (hot != socket.thread || 0 == socket.packets) {
+            continue;
+        }
+
+        uint64_t load = busy[hot] * socket.packets / packets[hot];
+        if (load <= gap / 2 && load > best_load) {
+            best = socket.udp.get();
+            best_load = load;
+        }
+    }
+
+    if (best) {
+        best->MigrateTo(threads_[cold]);
+    }
+}
+
+uint32_t AsioIOContext::OnRun(uint32_t) {
+    Rebalance();
+    return rebalance_interval_;
+}
+
+void AsioIOContext::OnCancel() {
+}
+
 const std::shared_ptr<IOContextThread>&
 AsioIOContext::SelectIOThread() {
     return threads_[select_thread_index_++ % threads_.size()];
@@ -1,21 +1,39 @@
 #ifndef _ASIO_UDP_H_INCLUDED
 #define _ASIO_UDP_H_INCLUDED
 
+#include <array>
 #include <memory>
+#include <mutex>
 #include <queue>
 #include <vector>
 #include <thread>
 #include <atomic>
+#include <unordered_map>
 #include "boost/asio.hpp"
 
 #include "udp_interface.h"
 #include "asio_buf.h"
+#include "segment_pool.h"
+#include "timer_wheel.h"
 
 namespace kcp {
+class AsioUDP;
+
 class IOContextThread : public boost::asio::io_context
                       , public ExecutorInterface {
 public:
-    IOContextThread() : thread_(), work_(*this), timer_(*this) {}
+    // a datagram held for the end of the frame, len bytes at offset in
+    // the frame buffer
+    struct FrameDatagram {
+        AsioUDP *udp;
+        IP4Address to;
+        boost::asio::ip::udp::endpoint peer;
+        size_t offset;
+        size_t len;
+    };
+
+    explicit IOContextThread(const ExecutorConfig& config)
+        : thread_(), timer_(*this), work_(*this), config_(config) {}
     ~IOContextThread() { Stop(); }
 
     void Start();
@@ -23,21 +41,159 @@ public:
 
     // executor interface
     bool CanNowExecuted() const override;
-    bool DispatchTask(void *key, TaskInterface *task) override;
+    TaskHandle DispatchTask(void *key, TaskInterface *task) override;
     void CancelTask(void *key) override;
+    void CancelTask(const TaskHandle& handle) override;
+    AllocatorInterface *allocator() override;
+    ExecutorStats stats() const override;
+
+    // on this thread. runs the task and schedules it if it continues,
+    // false if it does not
+    bool RunTask(void *key, TaskInterface *task);
+    // on this thread. takes the task off the wheel without OnCancel
+    bool UnlinkTask(TaskInterface *task);
+
+    // on this thread. while a frame runs the due sessions, the datagrams
+    // they flush are copied here and sent per socket once all of them
+    // ran. false outside a frame
+    bool QueueFrame(AsioUDP *udp, const IP4Address& to,
+                    const boost::asio::ip::udp::endpoint& peer,
+                    const UDPDatagram *datagrams, size_t count);
+
+    // any thread
+    void AddLoad(uint64_t packets, uint64_t busy_us);
+    uint64_t busy_us() const;
 private:
-    uint32_t RunTasks();
+    // the delay to the next task, TimerWheel::kNever if none
+    uint64_t RunTasks(uint64_t now);
     void CancelAllTasks();
     void StartTimer();
+    void OnTimer();
+    // sleeps on the timer, or polls under the spin threshold
+    void ArmTimer(uint64_t now, uint64_t delay);
     void StopTimer();
+    void FlushFrame();
 
     std::thread thread_;
-    boost::asio::high_resolution_timer timer_;
+    // on linux the reactor's CLOCK_MONOTONIC timerfd
+    boost::asio::steady_timer timer_;
     boost::asio::io_context::work work_;
+    const ExecutorConfig config_;
+    ExecutorStats stats_;
+    // NowUs64 the thread wakes at, a sooner task arms it again
+    uint64_t timer_deadline_ = TimerWheel::kNever;
+    // waits armed before the last are stale
+    uint64_t timer_gen_ = 0;
+    // read by the rebalancer
+    std::atomic<uint64_t> packets_{ 0 };
+    std::atomic<uint64_t> busy_us_{ 0 };
+
+    // NowUs64 deadlines
+    TimerWheel wheel_;
+    SegmentPool segment_pool_;
+
+    // the send batch of the frame running, shared by all its sessions
+    bool in_frame_ = false;
+    std::vector<FrameDatagram> frame_datagrams_;
+    std::vector<char> frame_buf_;
+    // the sockets queued on, kept until the frame is sent
+    std::vector<std::shared_ptr<AsioUDP>> frame_udps_;
+};
+
+// the executor of one socket and the sessions on it, forwarding to the
+// io thread the socket is on. when the socket moves, work queued on the
+// old thread is passed on and keyed tasks are scheduled again on the new
+class SocketExecutor : public ExecutorInterface
+                     , public std::enable_shared_from_this<SocketExecutor> {
+public:
+    explicit SocketExecutor(std::shared_ptr<IOContextThread> thread);
+
+    // executor interface
+    bool CanNowExecuted() const override;
+    TaskHandle DispatchTask(void *key, TaskInterface *task) override;
+    void CancelTask(void *key) override;
+    void CancelTask(const TaskHandle& handle) override;
+    AllocatorInterface *allocator() override;
+    ExecutorStats stats() const override;
+
+    IOContextThread *thread() const;
+    // queued behind the work on the thread the socket is on, follows it
+    template<typename Fn>
+    void Forward(Fn&& fn);
+
+    // on the current thread. takes the keyed tasks off its wheel, from
+    // then on everything is forwarded to 'to'
+    void MoveTo(std::shared_ptr<IOContextThread> to);
+    // on the new thread. schedules the moved tasks again
+    void Adopt();
+private:
+    // blocks are freed on the thread they are moved to, the pools give
+    // foreign blocks back to their owners
+    class Allocator : public AllocatorInterface {
+    public:
+        explicit Allocator(SocketExecutor *executor) : executor_(executor) {}
 
-    std::multimap<uint32_t, std::pair<void *, TaskInterface *>> tasks_;
+        void *Allocate(size_t size) override;
+        void Deallocate(void *p) override;
+        void Reserve(size_t size) override;
+        AllocatorStats stats() const override;
+    private:
+        friend class SocketExecutor;
+
+        SocketExecutor *executor_;
+        // reserved again in the pool of the thread the socket moves to
+        std::vector<size_t> reserved_;
+    };
+
+    template<typename Fn>
+    void Dispatch(Fn&& fn);
+    bool CancelMoving(TaskInterface *task);
+
+    std::atomic<IOContextThread *> thread_;
+    // every thread the socket has been on, the socket may still be closed
+    // on the current one after the context released it
+    std::vector<std::shared_ptr<IOContextThread>> threads_;
+    Allocator allocator_;
+
+    // keyed tasks scheduled through this executor, on the current thread
+    std::unordered_map<TaskInterface *, void *> tasks_;
+    // taken off the old wheel, not yet scheduled on the new one
+    std::vector<std::pair<TaskInterface *, void *>> moving_;
 };
 
+template<typename Fn>
+void SocketExecutor::Forward(Fn&& fn) {
+    IOContextThread *thread = this->thread();
+    auto forward = [self = shared_from_this(), thread,
+                    fn = std::forward<Fn>(fn)]() mutable {
+        if (self->thread() != thread) {
+            self->Forward(std::move(fn));
+            return;
+        }
+
+        fn(thread);
+    };
+
+    boost::asio::post(*thread, std::move(forward));
+}
+
+template<typename Fn>
+void SocketExecutor::Dispatch(Fn&& fn) {
+    IOContextThread *thread = this->thread();
+    auto dispatch = [self = shared_from_this(), thread,
+                     fn = std::forward<Fn>(fn)]() mutable {
+        // the socket moved while this was queued
+        if (self->thread() != thread) {
+            self->Dispatch(std::move(fn));
+            return;
+        }
+
+        fn(thread);
+    };
+
+    boost::asio::dispatch(*thread, std::move(dispatch));
+}
+
 class AsioUDP : public UDPInterface
               , public std::enable_shared_from_this<AsioUDP> {
 public:
@@ -45,55 +201,104 @@ public:
     bool Open(UDPCallback *cb) override;
     void Close() override;
     void SetRecvBufSize(size_t recv_size) override;
+    bool SetDontFragment(bool enable) override;
     bool Send(const IP4Address& to, const char *buf, size_t len) override;
+    bool SendBatch(const IP4Address& to, const UDPDatagram *datagrams, size_t count) override;
     const IP4Address& local_address() const override;
     ExecutorInterface *executor() override;
+
+    // any thread. moves the socket once its pending reads and writes are
+    // done, data still in the kernel buffer is read on the new thread
+    void MigrateTo(std::shared_ptr<IOContextThread> to);
+    // datagrams sent and received
+    uint64_t packets() const;
+    IOContextThread *thread() const;
+    // on the socket's thread. the datagrams of one frame queued on this
+    // socket, in one system call where the platform has one
+    void SendFrame(const IOContextThread::FrameDatagram *datagrams,
+                   size_t count, const char *buf);
 private:
     friend class AsioIOContext;
 
     explicit AsioUDP(std::shared_ptr<IOContextThread> io_ctx);
-    ~AsioUDP() { Close(); }
+    ~AsioUDP() { CloseSocket(); }
 
     bool Bind(const IP4Address& addr);
+    // on the socket's thread
+    void CloseSocket();
     void TryStartWrite();
     void StartRead();
     void WriteCallback(std::size_t bytes_transferred);
     void ReadCallback(std::size_t bytes_transferred);
     bool ErrorCallback(const boost::system::error_code& ec);
+    void AddLoad(uint64_t packets, uint64_t busy_us);
+    void StartMigration(std::shared_ptr<IOContextThread> to);
+    // hands the socket over once nothing is pending on it
+    void TryMigrate();
+    void Adopt(boost::asio::ip::udp::socket::native_handle_type fd,
+               IOContextThread *to);
 
     mutable boost::asio::ip::udp::socket socket_;
     WriteBuffers write_bufs_;
     BufferList in_writing_buf_;
     boost::asio::ip::udp::endpoint in_writing_peer_;
 
+    // datagrams already queued are read behind the first one
+    static constexpr size_t kRecvBatch = 32;
+
     std::vector<char> recv_buf_;
-    boost::asio::ip::udp::endpoint peer_;
+    std::array<boost::asio::ip::udp::endpoint, kRecvBatch> recv_peers_;
+    std::array<UDPDatagram, kRecvBatch> recv_batch_;
     size_t recv_buf_size_ = kDefaultRecvSize;
 
-    std::shared_ptr<IOContextThread> io_ctx_;
+    std::shared_ptr<SocketExecutor> executor_;
+    // the thread the socket moves to once reads and writes are cancelled
+    std::shared_ptr<IOContextThread> migrate_to_;
+    std::atomic<uint64_t> packets_{ 0 };
+    // packets() at the last rebalance, owned by the rebalancer
+    uint64_t balanced_packets_ = 0;
 
     IP4Address address_;
+    // Close detaches the callback from any thread without a round trip
+    std::recursive_mutex cb_mutex_;
     UDPCallback *cb_ = nullptr;
+    bool in_reading_ = false;
     bool in_writing_ = false;
-    bool closed_ = true;
+    // released from the old thread, not yet adopted by the new one
+    bool migrating_ = false;
+    std::atomic<bool> closed_{ true };
 };
 
-class AsioIOContext : public IOContextInterface {
+class AsioIOContext : public IOContextInterface
+                    , public TaskInterface {
 public:
-    static std::shared_ptr<AsioIOContext> Create(size_t thread_num);
+    static std::shared_ptr<AsioIOContext> Create(size_t thread_num,
+                                                 const ExecutorConfig& config);
 
     void Start() override;
     void Stop() override;
     std::shared_ptr<UDPInterface> CreateUDP(const IP4Address& addr) override;
     ExecutorInterface *executor() override;
+    void Rebalance() override;
+
+    // task interface, the periodic rebalance
+    uint32_t OnRun(uint32_t now) override;
+    void OnCancel() override;
 private:
-    explicit AsioIOContext(size_t thread_num);
+    AsioIOContext(size_t thread_num, const ExecutorConfig& config);
     ~AsioIOContext() { Stop(); }
 
     const std::shared_ptr<IOContextThread>& SelectIOThread();
 
     std::vector<std::shared_ptr<IOContextThread>> threads_;
     std::atomic_size_t select_thread_index_ = 0;
+    const uint32_t rebalance_interval_;
+
+    std::mutex mutex_;
+    std::vector<std::weak_ptr<AsioUDP>> udps_;
+    // busy_us() of the threads and NowUs64 at the last rebalance
+    std::vector<uint64_t> balanced_busy_;
+    uint64_t balanced_time_ = 0;
 };
 }
 
@@ -41,6 +41,12 @@ uint32_t Now32() noexcept {
     return static_cast<uint32_t>(Now64());
 }
 
+uint64_t NowUs64() noexcept {
+    using namespace std::chrono;
+    return duration_cast<microseconds>(
+        steady_clock::now().time_since_epoch()).count();
+}
+
 int32_t TimeDiff(uint32_t later, uint32_t earlier) noexcept {
     return later - earlier;
 }
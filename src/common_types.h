@@ -2,7 +2,10 @@
 #define _COMMON_TYPES_H_INCLUDED
 
 #include <cstdint>
+#include <cstring>
+#include <functional>
 #include <string>
+#include <vector>
 #include <limits>
 #include <memory>
 #include <tuple>
@@ -22,17 +25,218 @@ constexpr size_t kIPHeaderSize = 20;
 constexpr size_t kUDPHeadSize = 8;
 constexpr size_t kKCPHeadSize = 24;
 constexpr size_t kKCPMTUDefault = kEthMTU - kIPHeaderSize - kUDPHeadSize - kKCPHeadSize;
+// every ipv6 link carries 1280, tunnels rarely go below it
+constexpr size_t kMinPathMTU = 1280;
+constexpr size_t kKCPMTUMin = kMinPathMTU - kIPHeaderSize - kUDPHeadSize - kKCPHeadSize;
 constexpr size_t kDefaultRecvSize = 1024 * 64;
 
+enum class Congestion {
+    kReno,
+    // model based, holds throughput on lossy links
+    kBBR,
+};
+
+// a per-datagram stage on a session's output and input paths, e.g.
+// compression or a checksum. both ends need the same stages
+class DatagramTransform {
+public:
+    virtual ~DatagramTransform() = default;
+
+    // bytes Encode may add to a datagram
+    virtual size_t overhead() const = 0;
+    // rewrite the len bytes of buf (cap bytes large) in place, keeping
+    // the conv in the first 4 bytes. returns the new length, 0 drops it
+    virtual size_t Encode(char *buf, size_t len, size_t cap) = 0;
+    // undo Encode in place, 0 for a malformed datagram
+    virtual size_t Decode(char *buf, size_t len, size_t cap) = 0;
+};
+
+// called once per session
+using DatagramTransformFactory = std::function<std::unique_ptr<DatagramTransform>()>;
+
 struct KCPConfig {
     int mtu = kKCPMTUDefault;
     int interval = 10;
     int resend = 2;
+    // time based loss detection in place of counting resend skips
+    bool rack = false;
+    // resend the last segment after 2*srtt without acks, not a full rto
+    bool tail_loss_probe = false;
     int min_rto = 10;
     int sndwnd = 32;
     int rcvwnd = 32;
+    // grow sndwnd/rcvwnd with the measured bandwidth-delay product up to
+    // this many bytes in flight each way, 0 keeps them fixed
+    size_t wnd_max_bytes = 0;
     bool nodelay = true;
     bool nocwnd = false;
+    // selective ack, used only if the peer enables it too
+    bool sack = false;
+    // hold in-order acks up to ack_delay ms or ack_max acks, 0 disables
+    int ack_delay = 0;
+    int ack_max = 0;
+    // messages over 255 fragments, used only if the peer enables it too.
+    // WriteShared sends them from the caller's buffer without a copy
+    bool large_message = false;
+    // a message waiting for its last fragment past this many bytes fails
+    // the stream, 0 for no limit
+    size_t max_message_size = 64 * 1024 * 1024;
+    // hand large messages over in parts as their fragments arrive, see
+    // KCPMessage::more. memory then follows rcvwnd, not the message size.
+    // parts only go to OnRecvKCPMessage, declining the first turns it off
+    bool partial_message = false;
+    // pack writes into mss sized segments, OnRecvKCP then delivers a
+    // byte stream without message boundaries
+    bool stream = false;
+    Congestion congestion = Congestion::kReno;
+    // spread sends over the rtt instead of bursting the window
+    bool pacing = false;
+    // microsecond timestamps and timers for sub-millisecond rtts, the
+    // *_us fields then replace interval and min_rto when nonzero
+    bool microsecond_clock = false;
+    int interval_us = 0;
+    int min_rto_us = 0;
+    // reed-solomon parity over groups of fec_data_shards datagrams, 0
+    // disables. both ends must enable it, mtu then includes its overhead
+    int fec_data_shards = 0;
+    int fec_parity_shards = 0;
+    // parity follows the loss the peer reports, up to fec_parity_shards
+    bool fec_adaptive = false;
+    // ms a partial group waits for more datagrams before its parity is
+    // sent, 0 closes it at every flush
+    int fec_max_delay = 20;
+    // probe the path for an mtu up to max_mtu and raise it at runtime,
+    // used only if the peer enables it too. 0 keeps mtu fixed
+    int max_mtu = 0;
+    // while probing, segments over mtu that keep getting lost lower it
+    // down to min_mtu, as on tunneled paths. 0 never goes below mtu
+    int min_mtu = kKCPMTUMin;
+    // lz compression of every datagram, skipped while it does not pay
+    // off. both ends must enable it, mtu then includes its overhead
+    bool compress = false;
+    // more stages after compression, in output order. mtu includes
+    // their overhead too
+    std::vector<DatagramTransformFactory> transforms;
+};
+
+struct KCPStats {
+    // milliseconds
+    int32_t srtt = 0;
+    int32_t rto = 0;
+    // microseconds, finer with KCPConfig::microsecond_clock
+    int32_t srtt_us = 0;
+    int32_t rto_us = 0;
+    uint32_t cwnd = 0;
+    uint32_t snd_wnd = 0;
+    uint32_t rcv_wnd = 0;
+    uint32_t retransmits = 0;
+    uint32_t ack_suppressed = 0;
+    // tail loss probes sent, ones that repaired a loss and ones the
+    // original made unnecessary. the rest went unclassified
+    uint32_t tlp_sent = 0;
+    uint32_t tlp_needed = 0;
+    uint32_t tlp_spurious = 0;
+    // datagrams rebuilt from parity, loss of the peer's datagrams seen
+    // before recovery in percent
+    uint32_t fec_recovered = 0;
+    uint32_t fec_loss = 0;
+    // in use, above KCPConfig::mtu once max_mtu probes got through or
+    // down to min_mtu on a path that does not carry mtu
+    uint32_t mtu = 0;
+};
+
+// read-only payload kept alive by owner, passed on without copying
+struct SharedBuffer {
+    std::shared_ptr<const void> owner;
+    const char *data = nullptr;
+    size_t len = 0;
+
+    SharedBuffer() = default;
+
+    SharedBuffer(std::shared_ptr<const void> owner, const char *data, size_t len)
+        : owner(std::move(owner))
+        , data(data)
+        , len(len) {}
+
+    // takes over a std::string or std::vector<char>
+    template<typename Container>
+    static SharedBuffer From(Container&& c) {
+        auto p = std::make_shared<std::decay_t<Container>>(std::forward<Container>(c));
+        return { p, p->data(), p->size() };
+    }
+};
+
+// one received message as the payloads of its kcp segments, handed out
+// without reassembly. the segments are freed on release or destruction
+class KCPMessage {
+public:
+    struct Slice {
+        const char *data;
+        size_t len;
+    };
+
+    // gives the segments back to the thread that allocated them
+    class ReleaserInterface {
+    public:
+        virtual ~ReleaserInterface() = default;
+        virtual void Release(void *segments) = 0;
+    };
+
+    KCPMessage() = default;
+
+    KCPMessage(KCPMessage&& rhs) noexcept {
+        *this = std::move(rhs);
+    }
+
+    KCPMessage& operator =(KCPMessage&& rhs) noexcept {
+        if (this != &rhs) {
+            Release();
+            slices_ = std::move(rhs.slices_);
+            size_ = rhs.size_;
+            more_ = rhs.more_;
+            segments_ = rhs.segments_;
+            releaser_ = std::move(rhs.releaser_);
+            rhs.size_ = 0;
+            rhs.more_ = false;
+            rhs.segments_ = nullptr;
+        }
+
+        return *this;
+    }
+
+    ~KCPMessage() { Release(); }
+
+    const std::vector<Slice>& slices() const { return slices_; }
+    size_t size() const { return size_; }
+    // set on every part of a message but the last with partial_message
+    bool more() const { return more_; }
+
+    // buf must hold size() bytes
+    void CopyTo(char *buf) const {
+        for (auto&& slice : slices_) {
+            std::memcpy(buf, slice.data, slice.len);
+            buf += slice.len;
+        }
+    }
+
+    void Release() {
+        if (segments_) {
+            releaser_->Release(segments_);
+            segments_ = nullptr;
+        }
+
+        slices_.clear();
+        size_ = 0;
+        more_ = false;
+    }
+private:
+    friend class KCPStream;
+
+    std::vector<Slice> slices_;
+    size_t size_ = 0;
+    bool more_ = false;
+    void *segments_ = nullptr;
+    std::shared_ptr<ReleaserInterface> releaser_;
 };
 
 union IP4Address {
@@ -70,15 +274,44 @@ union IP4Address {
 
 uint32_t Now32() noexcept;
 
+// monotonic, the time base of the executors
+uint64_t NowUs64() noexcept;
+
 int32_t TimeDiff(uint32_t later, uint32_t earlier) noexcept;
 
+class TaskInterface;
+
+// links a scheduled task into a timer wheel slot, owned by the task
+struct TaskNode {
+    TaskNode *prev = nullptr;
+    TaskNode *next = nullptr;
+    void *key = nullptr;
+    TaskInterface *task = nullptr;
+    // deadline in wheel ticks
+    uint64_t tick = 0;
+    uint32_t slot = 0;
+};
+
 class TaskInterface {
 protected:
     virtual ~TaskInterface() = default;
 public:
     static constexpr uint32_t kNotContinue = (std::numeric_limits<uint32_t>::max)();
+    // now and the returned delay are in microseconds
     virtual uint32_t OnRun(uint32_t now) = 0;
     virtual void OnCancel() = 0;
+private:
+    friend class TimerWheel;
+
+    TaskNode task_node_;
+};
+
+// a dispatched task, valid while the task object lives. a task deleting
+// itself once it has run can not be cancelled through it
+struct TaskHandle {
+    TaskInterface *task = nullptr;
+
+    explicit operator bool() const noexcept { return nullptr != task; }
 };
 
 template<typename Sig>
@@ -113,14 +346,73 @@ auto NewTask(Fn&& fn, Args&& ... args) {
          std::forward<Fn>(fn), std::forward<Args>(args)...);
 }
 
+struct AllocatorStats {
+    // served from a free list
+    uint64_t hits = 0;
+    // had to go to the heap
+    uint64_t misses = 0;
+    uint64_t in_use = 0;
+};
+
+class AllocatorInterface {
+protected:
+    virtual ~AllocatorInterface() = default;
+public:
+    virtual void *Allocate(size_t size) = 0;
+    virtual void Deallocate(void *p) = 0;
+    // blocks of up to size are asked for often, on the owner thread
+    virtual void Reserve(size_t size) = 0;
+    // only consistent on the owner thread
+    virtual AllocatorStats stats() const = 0;
+};
+
+struct ExecutorConfig {
+    // microseconds. a task due sooner is polled for instead of slept on,
+    // for latency at the cost of a busy thread. 0 always sleeps
+    uint32_t spin_threshold = 0;
+    // microseconds. non-zero wakes the thread only on this fixed cadence,
+    // every session due by a frame is updated and flushed in one pass and
+    // their datagrams go out together, per socket, once all of them ran.
+    // acks wait for a frame too, min_rto should cover a couple of them
+    uint32_t frame_interval = 0;
+    // microseconds. non-zero moves a socket, with its sessions, off the
+    // busiest thread at this period when the load is uneven. 0 leaves
+    // sockets where they were created, IOContextInterface::Rebalance
+    // still moves them on demand
+    uint32_t rebalance_interval = 0;
+};
+
+struct ExecutorStats {
+    // timer expirations
+    uint64_t wakeups = 0;
+    // expirations with nothing due yet
+    uint64_t spurious_wakeups = 0;
+    // waits polled under the spin threshold
+    uint64_t spins = 0;
+    // OnRun calls, per wakeup they show how well updates batch
+    uint64_t runs = 0;
+    // datagrams sent and received by the sockets on the thread
+    uint64_t packets = 0;
+    // microseconds spent running tasks and socket handlers
+    uint64_t busy_us = 0;
+};
+
 class ExecutorInterface {
 protected:
     virtual ~ExecutorInterface() = default;
 public:
     virtual bool CanNowExecuted() const = 0;
-    virtual bool DispatchTask(void *key, TaskInterface *task) = 0;
-    // block util being completed
+    virtual TaskHandle DispatchTask(void *key, TaskInterface *task) = 0;
+    // block util being completed, scans all tasks for the key
     virtual void CancelTask(void *key) = 0;
+    // O(1) and never blocks. OnCancel runs once the task is off the
+    // executor, inline on the executor thread and queued there otherwise.
+    // the task must live until then, OnCancel may free it
+    virtual void CancelTask(const TaskHandle& handle) = 0;
+    // allocator bound to the executor thread, nullptr for heap
+    virtual AllocatorInterface *allocator() = 0;
+    // only consistent on the executor thread
+    virtual ExecutorStats stats() const = 0;
 
     template<typename Fn, typename ... Args>
     void Post(Fn&& fn, Args&& ... args) {
@@ -28,19 +28,42 @@ const IUINT32 IKCP_CMD_PUSH = 81;		// cmd: push data
 const IUINT32 IKCP_CMD_ACK  = 82;		// cmd: ack
 const IUINT32 IKCP_CMD_WASK = 83;		// cmd: window probe (ask)
 const IUINT32 IKCP_CMD_WINS = 84;		// cmd: window size (tell)
+const IUINT32 IKCP_CMD_SACK = 85;		// cmd: selective ack bitmap from una
+const IUINT32 IKCP_CMD_PMTU = 86;		// cmd: padded mtu probe, or its echo
+const IUINT32 IKCP_CMD_PART = 87;		// cmd: piece of a push over the mtu
 const IUINT32 IKCP_ASK_SEND = 1;		// need to send IKCP_CMD_WASK
 const IUINT32 IKCP_ASK_TELL = 2;		// need to send IKCP_CMD_WINS
+const IUINT32 IKCP_ASK_PMTU = 4;		// need to echo IKCP_CMD_PMTU
 const IUINT32 IKCP_WND_SND = 32;
 const IUINT32 IKCP_WND_RCV = 32;
 const IUINT32 IKCP_MTU_DEF = 1400;
 const IUINT32 IKCP_ACK_FAST	= 3;
 const IUINT32 IKCP_INTERVAL	= 100;
+const IUINT32 IKCP_INTERVAL_MIN = 10;
+const IUINT32 IKCP_INTERVAL_MIN_US = 100;	// microsecond clock allows less
 const IUINT32 IKCP_OVERHEAD = 24;
 const IUINT32 IKCP_DEADLINK = 10;
 const IUINT32 IKCP_THRESH_INIT = 2;
 const IUINT32 IKCP_THRESH_MIN = 2;
 const IUINT32 IKCP_PROBE_INIT = 7000;		// 7 secs to probe window size
 const IUINT32 IKCP_PROBE_LIMIT = 120000;	// up to 120 secs to probe window
+const IUINT32 IKCP_CAPS_TELL = 3;		// times to advertise caps unasked
+const IUINT32 IKCP_PMTU_TRIES = 3;		// lost probes before a size fails
+const IUINT32 IKCP_PMTU_STEP = 32;		// then the top of the range is probed
+const IUINT32 IKCP_PMTU_RAISE = 600000;	// 10 mins to search up again
+const IUINT32 IKCP_PMTU_BLACKHOLE = 3;	// timeouts of one segment to fall back
+const IUINT32 IKCP_PART_HEAD = 9;		// offset, segment len and frg of a piece
+const IUINT32 IKCP_PART_MAX = 0x10000;	// largest segment taken in pieces
+const IUINT32 IKCP_WND_MAX = 0xffff;		// 'wnd' is 16 bits on the wire
+const IUINT32 IKCP_WND_IDLE = 1000;		// rcv_wnd shrinks below a window a sec
+const IUINT32 IKCP_WND_BY_SND = 1;		// snd_wnd held data back
+const IUINT32 IKCP_WND_BY_RMT = 2;		// rmt_wnd held data back
+const IUINT32 IKCP_RACK_PERSIST = 16;	// loss rounds a wider reo window lasts
+const IUINT32 IKCP_TLP_OUT = 1;			// probe unanswered, no other one
+const IUINT32 IKCP_TLP_REARMED = 2;		// unanswered, but an rto passed since
+const IUINT32 IKCP_WND_RTT_WIN = 10000;	// min rtt sample kept 10 secs
+
+#define IKCP_BATCH_MAX 64	// packets per una/fastack/cc update
 
 
 //---------------------------------------------------------------------
@@ -166,16 +189,34 @@ void ikcp_allocator(void* (*new_malloc)(size_t), void (*new_free)(void*))
 	ikcp_free_hook = new_free;
 }
 
+// redefine segment allocator of a kcp object
+void ikcp_segment_allocator(ikcpcb *kcp,
+	void* (*seg_malloc)(size_t size, ikcpcb *kcp, void *user),
+	void (*seg_free)(void *ptr, ikcpcb *kcp, void *user))
+{
+	kcp->seg_malloc = seg_malloc;
+	kcp->seg_free = seg_free;
+}
+
 // allocate a new kcp segment
 static IKCPSEG* ikcp_segment_new(ikcpcb *kcp, int size)
 {
+	if (kcp->seg_malloc)
+		return (IKCPSEG*)kcp->seg_malloc(sizeof(IKCPSEG) + size, kcp, kcp->user);
 	return (IKCPSEG*)ikcp_malloc(sizeof(IKCPSEG) + size);
 }
 
 // delete a segment
 static void ikcp_segment_delete(ikcpcb *kcp, IKCPSEG *seg)
 {
-	ikcp_free(seg);
+	if (seg->ref) {
+		kcp->ref_release(seg->ref, kcp, kcp->user);
+	}
+	if (kcp->seg_free) {
+		kcp->seg_free(seg, kcp, kcp->user);
+	}	else {
+		ikcp_free(seg);
+	}
 }
 
 // write log
@@ -209,6 +250,153 @@ static int ikcp_output(ikcpcb *kcp, const void *data, int size)
 	return kcp->output((const char*)data, size, kcp, kcp->user);
 }
 
+// where the next datagram is encoded
+static char *ikcp_obuf(const ikcpcb *kcp)
+{
+	return (kcp->vec_size > 0)? kcp->vec_bufs[kcp->nvec] : kcp->buffer;
+}
+
+// 'size' bytes at ikcp_obuf are a complete datagram, returns the next
+static char *ikcp_output_buf(ikcpcb *kcp, int size)
+{
+	int i;
+	if (kcp->vec_size == 0) {
+		ikcp_output(kcp, kcp->buffer, size);
+		return kcp->buffer;
+	}
+	if (size > 0) {
+		kcp->vec_lens[kcp->nvec++] = size;
+		if (ikcp_canlog(kcp, IKCP_LOG_OUTPUT)) {
+			ikcp_log(kcp, IKCP_LOG_OUTPUT, "[RO] %ld bytes vec", (long)size);
+		}
+	}
+	if (kcp->nvec == kcp->vec_size) {
+		for (i = 0; i < kcp->nvec; i++) {
+			kcp->output(kcp->vec_bufs[i], kcp->vec_lens[i], kcp, kcp->user);
+		}
+		kcp->nvec = 0;
+	}
+	return kcp->vec_bufs[kcp->nvec];
+}
+
+//---------------------------------------------------------------------
+// sn indexed rings for snd_buf/rcv_buf
+//---------------------------------------------------------------------
+#define IKCP_RING_SLOT(ring, size, sn) ((ring)[(sn) & ((size) - 1)])
+#define IKCP_SND_SLOT(kcp, sn) IKCP_RING_SLOT((kcp)->snd_buf, (kcp)->snd_buf_size, sn)
+#define IKCP_RCV_SLOT(kcp, sn) IKCP_RING_SLOT((kcp)->rcv_buf, (kcp)->rcv_buf_size, sn)
+
+// grow ring to hold at least 'need' consecutive sn, entries are rehashed
+static int ikcp_ring_reserve(IKCPSEG ***ring, IUINT32 *size, IUINT32 need)
+{
+	IKCPSEG **newring;
+	IUINT32 newsize, i;
+
+	if (*ring != NULL && need <= *size) return 0;
+
+	for (newsize = 8; newsize < need; newsize <<= 1);
+	newring = (IKCPSEG**)ikcp_malloc(newsize * sizeof(IKCPSEG*));
+	if (newring == NULL) return -1;
+	memset(newring, 0, newsize * sizeof(IKCPSEG*));
+
+	if (*ring != NULL) {
+		for (i = 0; i < *size; i++) {
+			IKCPSEG *seg = (*ring)[i];
+			if (seg) IKCP_RING_SLOT(newring, newsize, seg->sn) = seg;
+		}
+		ikcp_free(*ring);
+	}
+
+	*ring = newring;
+	*size = newsize;
+	return 0;
+}
+
+// the timer heap grows with snd_buf, flush keeps in flight segments
+// below both sizes
+static int ikcp_snd_reserve(ikcpcb *kcp, IUINT32 need)
+{
+	IKCPSEG **heap;
+
+	if (ikcp_ring_reserve(&kcp->snd_buf, &kcp->snd_buf_size, need)) return -1;
+	if (kcp->rto_heap != NULL && kcp->rto_heap_size >= kcp->snd_buf_size) return 0;
+
+	heap = (IKCPSEG**)ikcp_malloc(kcp->snd_buf_size * sizeof(IKCPSEG*));
+	if (heap == NULL) return -1;
+
+	if (kcp->rto_heap != NULL) {
+		memcpy(heap, kcp->rto_heap, kcp->rto_heap_len * sizeof(IKCPSEG*));
+		ikcp_free(kcp->rto_heap);
+	}
+
+	kcp->rto_heap = heap;
+	kcp->rto_heap_size = kcp->snd_buf_size;
+	return 0;
+}
+
+
+//---------------------------------------------------------------------
+// retransmission timer heap, ordered by resendts
+//---------------------------------------------------------------------
+#define IKCP_HEAP_BEFORE(a, b) (_itimediff((a)->resendts, (b)->resendts) < 0)
+
+static void ikcp_heap_place(ikcpcb *kcp, IKCPSEG *seg, IUINT32 i)
+{
+	kcp->rto_heap[i] = seg;
+	seg->heap = i;
+}
+
+static void ikcp_heap_up(ikcpcb *kcp, IKCPSEG *seg)
+{
+	IUINT32 i = seg->heap;
+	while (i > 0) {
+		IKCPSEG *parent = kcp->rto_heap[(i - 1) / 2];
+		if (!IKCP_HEAP_BEFORE(seg, parent)) break;
+		ikcp_heap_place(kcp, parent, i);
+		i = (i - 1) / 2;
+	}
+	ikcp_heap_place(kcp, seg, i);
+}
+
+static void ikcp_heap_down(ikcpcb *kcp, IKCPSEG *seg)
+{
+	IUINT32 i = seg->heap;
+	for (;;) {
+		IUINT32 child = 2 * i + 1;
+		if (child >= kcp->rto_heap_len) break;
+		if (child + 1 < kcp->rto_heap_len && 
+			IKCP_HEAP_BEFORE(kcp->rto_heap[child + 1], kcp->rto_heap[child]))
+			child++;
+		if (!IKCP_HEAP_BEFORE(kcp->rto_heap[child], seg)) break;
+		ikcp_heap_place(kcp, kcp->rto_heap[child], i);
+		i = child;
+	}
+	ikcp_heap_place(kcp, seg, i);
+}
+
+static void ikcp_heap_push(ikcpcb *kcp, IKCPSEG *seg)
+{
+	ikcp_heap_place(kcp, seg, kcp->rto_heap_len++);
+	ikcp_heap_up(kcp, seg);
+}
+
+static void ikcp_heap_remove(ikcpcb *kcp, IKCPSEG *seg)
+{
+	IKCPSEG *last = kcp->rto_heap[--kcp->rto_heap_len];
+	if (last != seg) {
+		ikcp_heap_place(kcp, last, seg->heap);
+		ikcp_heap_up(kcp, last);
+		ikcp_heap_down(kcp, last);
+	}
+}
+
+// resendts of a queued segment has changed
+static void ikcp_heap_update(ikcpcb *kcp, IKCPSEG *seg)
+{
+	ikcp_heap_up(kcp, seg);
+	ikcp_heap_down(kcp, seg);
+}
+
 //---------------------------------------------------------------------
 // create a new kcpcb
 //---------------------------------------------------------------------
@@ -240,10 +428,31 @@ ikcpcb* ikcp_create(IUINT32 conv, void *user)
 		return NULL;
 	}
 
+	kcp->vec_bufs = NULL;
+	kcp->vec_lens = NULL;
+	kcp->vec_size = 0;
+	kcp->nvec = 0;
+
+	kcp->snd_buf = NULL;
+	kcp->rcv_buf = NULL;
+	kcp->snd_buf_size = 0;
+	kcp->rcv_buf_size = 0;
+	kcp->rto_heap = NULL;
+	kcp->rto_heap_len = 0;
+	kcp->rto_heap_size = 0;
+	kcp->snd_fresh = 0;
+	if (ikcp_snd_reserve(kcp, kcp->snd_wnd) ||
+		ikcp_ring_reserve(&kcp->rcv_buf, &kcp->rcv_buf_size, kcp->rcv_wnd)) {
+		if (kcp->snd_buf) ikcp_free(kcp->snd_buf);
+		if (kcp->rto_heap) ikcp_free(kcp->rto_heap);
+		ikcp_free(kcp->buffer);
+		ikcp_free(kcp);
+		return NULL;
+	}
+
 	iqueue_init(&kcp->snd_queue);
 	iqueue_init(&kcp->rcv_queue);
-	iqueue_init(&kcp->snd_buf);
-	iqueue_init(&kcp->rcv_buf);
+	iqueue_init(&kcp->fast_queue);
 	kcp->nrcv_buf = 0;
 	kcp->nsnd_buf = 0;
 	kcp->nrcv_que = 0;
@@ -252,6 +461,65 @@ ikcpcb* ikcp_create(IUINT32 conv, void *user)
 	kcp->acklist = NULL;
 	kcp->ackblock = 0;
 	kcp->ackcount = 0;
+	kcp->caps = 0;
+	kcp->rmt_caps = 0;
+	kcp->caps_tell = 0;
+	kcp->rmt_caps_seen = 0;
+	kcp->snd_dropped = 0;
+	kcp->ackdelay = 0;
+	kcp->ackmax = 0;
+	kcp->ts_ack = 0;
+	kcp->ack_suppressed = 0;
+	kcp->pacing = 0;
+	kcp->pacing_rate = 0;
+	kcp->ts_pacing = 0;
+	kcp->paced = 0;
+	kcp->ts_paced = 0;
+	kcp->pacing_credit = 0;
+	kcp->pmtu_base = kcp->mtu;
+	kcp->pmtu_min = 0;
+	kcp->pmtu_max = 0;
+	kcp->pmtu_lo = kcp->mtu;
+	kcp->pmtu_hi = kcp->mtu;
+	kcp->pmtu_probe = 0;
+	kcp->pmtu_tries = 0;
+	kcp->ts_pmtu = 0;
+	kcp->pmtu_echo = 0;
+	kcp->pmtu_lost = 0;
+	kcp->rcv_part = NULL;
+	kcp->rcv_part_len = 0;
+	kcp->wnd_max = 0;
+	kcp->snd_wnd_min = kcp->snd_wnd;
+	kcp->rcv_wnd_min = kcp->rcv_wnd;
+	kcp->ts_snd_tune = 0;
+	kcp->snd_delivered = 0;
+	kcp->snd_bdp = 0;
+	kcp->snd_limited = 0;
+	kcp->rtt_min = 0;
+	kcp->ts_rtt_min = 0;
+	kcp->ts_rcv_tune = 0;
+	kcp->rcv_tune_sn = 0;
+	kcp->rcv_count = 0;
+	kcp->rcv_asked = 0;
+	kcp->rcv_shrink = 0;
+	kcp->rcv_edge = 0;
+	kcp->rack = 0;
+	kcp->rack_ts = 0;
+	kcp->rack_sn = 0;
+	kcp->rack_rtt = 0;
+	kcp->rack_seen = 0;
+	kcp->rack_wait = 0;
+	kcp->ts_rack = 0;
+	kcp->rack_reo = 1;
+	kcp->rack_persist = 0;
+	kcp->tlp = 0;
+	kcp->ts_tlp = 0;
+	kcp->tlp_out = 0;
+	kcp->tlp_sn = 0;
+	kcp->tlp_ts = 0;
+	kcp->tlp_sent = 0;
+	kcp->tlp_needed = 0;
+	kcp->tlp_spurious = 0;
 	kcp->rx_srtt = 0;
 	kcp->rx_rttval = 0;
 	kcp->rx_rto = IKCP_RTO_DEF;
@@ -259,16 +527,25 @@ ikcpcb* ikcp_create(IUINT32 conv, void *user)
 	kcp->current = 0;
 	kcp->interval = IKCP_INTERVAL;
 	kcp->ts_flush = IKCP_INTERVAL;
+	kcp->tick = 1;
 	kcp->nodelay = 0;
 	kcp->updated = 0;
 	kcp->logmask = 0;
 	kcp->ssthresh = IKCP_THRESH_INIT;
 	kcp->fastresend = 0;
 	kcp->nocwnd = 0;
+	kcp->stream = 0;
+	kcp->stream_cap = 0;
 	kcp->xmit = 0;
     kcp->dead_link = IKCP_DEADLINK;
 	kcp->output = NULL;
 	kcp->writelog = NULL;
+	kcp->seg_malloc = NULL;
+	kcp->seg_free = NULL;
+	kcp->ref_retain = NULL;
+	kcp->ref_release = NULL;
+	kcp->cc = &ikcp_cc_reno;
+	kcp->cc_state = NULL;
 
 	return kcp;
 }
@@ -282,15 +559,12 @@ void ikcp_release(ikcpcb *kcp)
 	assert(kcp);
 	if (kcp) {
 		IKCPSEG *seg;
-		while (!iqueue_is_empty(&kcp->snd_buf)) {
-			seg = iqueue_entry(kcp->snd_buf.next, IKCPSEG, node);
-			iqueue_del(&seg->node);
-			ikcp_segment_delete(kcp, seg);
+		IUINT32 i;
+		for (i = 0; i < kcp->snd_buf_size; i++) {
+			if (kcp->snd_buf[i]) ikcp_segment_delete(kcp, kcp->snd_buf[i]);
 		}
-		while (!iqueue_is_empty(&kcp->rcv_buf)) {
-			seg = iqueue_entry(kcp->rcv_buf.next, IKCPSEG, node);
-			iqueue_del(&seg->node);
-			ikcp_segment_delete(kcp, seg);
+		for (i = 0; i < kcp->rcv_buf_size; i++) {
+			if (kcp->rcv_buf[i]) ikcp_segment_delete(kcp, kcp->rcv_buf[i]);
 		}
 		while (!iqueue_is_empty(&kcp->snd_queue)) {
 			seg = iqueue_entry(kcp->snd_queue.next, IKCPSEG, node);
@@ -302,12 +576,21 @@ void ikcp_release(ikcpcb *kcp)
 			iqueue_del(&seg->node);
 			ikcp_segment_delete(kcp, seg);
 		}
+		if (kcp->rcv_part) {
+			ikcp_segment_delete(kcp, kcp->rcv_part);
+		}
 		if (kcp->buffer) {
 			ikcp_free(kcp->buffer);
 		}
 		if (kcp->acklist) {
 			ikcp_free(kcp->acklist);
 		}
+		ikcp_free(kcp->snd_buf);
+		ikcp_free(kcp->rcv_buf);
+		ikcp_free(kcp->rto_heap);
+		if (kcp->cc->release) {
+			kcp->cc->release(kcp);
+		}
 
 		kcp->nrcv_buf = 0;
 		kcp->nsnd_buf = 0;
@@ -316,10 +599,31 @@ void ikcp_release(ikcpcb *kcp)
 		kcp->ackcount = 0;
 		kcp->buffer = NULL;
 		kcp->acklist = NULL;
+		kcp->snd_buf = NULL;
+		kcp->rcv_buf = NULL;
+		kcp->rto_heap = NULL;
 		ikcp_free(kcp);
 	}
 }
 
+//---------------------------------------------------------------------
+// move in-order segments from rcv_buf to rcv_queue
+//---------------------------------------------------------------------
+static void ikcp_move_rcv_buf(ikcpcb *kcp)
+{
+	while (kcp->nrcv_buf > 0 && kcp->nrcv_que < kcp->rcv_wnd) {
+		IKCPSEG *seg = IKCP_RCV_SLOT(kcp, kcp->rcv_nxt);
+		if (seg == NULL) break;
+		assert(seg->sn == kcp->rcv_nxt);
+		IKCP_RCV_SLOT(kcp, kcp->rcv_nxt) = NULL;
+		kcp->nrcv_buf--;
+		iqueue_add_tail(&seg->node, &kcp->rcv_queue);
+		kcp->nrcv_que++;
+		kcp->rcv_nxt++;
+	}
+}
+
+
 //---------------------------------------------------------------------
 // user/upper level recv: returns size, returns below zero for EAGAIN
 //---------------------------------------------------------------------
@@ -355,7 +659,7 @@ int ikcp_recv(ikcpcb *kcp, char *buffer, int len)
 		p = p->next;
 
 		if (buffer) {
-			memcpy(buffer, seg->data, seg->len);
+			memcpy(buffer, IKCP_SEG_DATA(seg), seg->len);
 			buffer += seg->len;
 		}
 
@@ -379,18 +683,7 @@ int ikcp_recv(ikcpcb *kcp, char *buffer, int len)
 	assert(len == peeksize);
 
 	// move available data from rcv_buf -> rcv_queue
-	while (! iqueue_is_empty(&kcp->rcv_buf)) {
-		IKCPSEG *seg = iqueue_entry(kcp->rcv_buf.next, IKCPSEG, node);
-		if (seg->sn == kcp->rcv_nxt && kcp->nrcv_que < kcp->rcv_wnd) {
-			iqueue_del(&seg->node);
-			kcp->nrcv_buf--;
-			iqueue_add_tail(&seg->node, &kcp->rcv_queue);
-			kcp->nrcv_que++;
-			kcp->rcv_nxt++;
-		}	else {
-			break;
-		}
-	}
+	ikcp_move_rcv_buf(kcp);
 
 	// fast recover
 	if (kcp->nrcv_que < kcp->rcv_wnd && recover) {
@@ -403,6 +696,109 @@ int ikcp_recv(ikcpcb *kcp, char *buffer, int len)
 }
 
 
+//---------------------------------------------------------------------
+// detach the next message without copying: its segments are moved to
+// list in order, returns size, returns below zero for EAGAIN
+//---------------------------------------------------------------------
+int ikcp_recv_segments(ikcpcb *kcp, struct IQUEUEHEAD *list)
+{
+	int peeksize;
+	int recover = 0;
+	IKCPSEG *seg;
+	assert(kcp);
+
+	iqueue_init(list);
+
+	peeksize = ikcp_peeksize(kcp);
+
+	if (peeksize < 0)
+		return -1;
+
+	if (kcp->nrcv_que >= kcp->rcv_wnd)
+		recover = 1;
+
+	do {
+		seg = iqueue_entry(kcp->rcv_queue.next, IKCPSEG, node);
+		iqueue_del(&seg->node);
+		iqueue_add_tail(&seg->node, list);
+		kcp->nrcv_que--;
+
+		if (ikcp_canlog(kcp, IKCP_LOG_RECV)) {
+			ikcp_log(kcp, IKCP_LOG_RECV, "recv sn=%lu", seg->sn);
+		}
+	}	while (seg->frg != 0);
+
+	ikcp_move_rcv_buf(kcp);
+
+	if (kcp->nrcv_que < kcp->rcv_wnd && recover) {
+		kcp->probe |= IKCP_ASK_TELL;
+	}
+
+	return peeksize;
+}
+
+
+//---------------------------------------------------------------------
+// drain fragments of the next message as they arrive, so a message
+// larger than rcv_wnd can not stall the receive window
+//---------------------------------------------------------------------
+int ikcp_recv_fragments(ikcpcb *kcp, struct IQUEUEHEAD *list, int *more)
+{
+	int len = 0;
+	int recover = 0;
+	IKCPSEG *seg = NULL;
+	assert(kcp && more);
+
+	if (iqueue_is_empty(&kcp->rcv_queue))
+		return -1;
+
+	if (kcp->nrcv_que >= kcp->rcv_wnd)
+		recover = 1;
+
+	while (1) {
+		if (iqueue_is_empty(&kcp->rcv_queue)) {
+			ikcp_move_rcv_buf(kcp);
+			if (iqueue_is_empty(&kcp->rcv_queue)) break;
+		}
+
+		seg = iqueue_entry(kcp->rcv_queue.next, IKCPSEG, node);
+		iqueue_del(&seg->node);
+		iqueue_add_tail(&seg->node, list);
+		kcp->nrcv_que--;
+		len += seg->len;
+
+		if (ikcp_canlog(kcp, IKCP_LOG_RECV)) {
+			ikcp_log(kcp, IKCP_LOG_RECV, "recv sn=%lu", seg->sn);
+		}
+
+		if (seg->frg == 0) break;
+	}
+
+	*more = (seg->frg != 0)? 1 : 0;
+
+	ikcp_move_rcv_buf(kcp);
+
+	if (kcp->nrcv_que < kcp->rcv_wnd && recover) {
+		kcp->probe |= IKCP_ASK_TELL;
+	}
+
+	return len;
+}
+
+
+//---------------------------------------------------------------------
+// release segments taken by ikcp_recv_segments/ikcp_recv_fragments
+//---------------------------------------------------------------------
+void ikcp_free_segments(ikcpcb *kcp, struct IQUEUEHEAD *list)
+{
+	while (!iqueue_is_empty(list)) {
+		IKCPSEG *seg = iqueue_entry(list->next, IKCPSEG, node);
+		iqueue_del(&seg->node);
+		ikcp_segment_delete(kcp, seg);
+	}
+}
+
+
 //---------------------------------------------------------------------
 // peek data size
 //---------------------------------------------------------------------
@@ -427,6 +823,9 @@ int ikcp_peeksize(const ikcpcb *kcp)
 		if (seg->frg == 0) break;
 	}
 
+	// saturated 'frg' only bounds the count, the last one may be missing
+	if (seg->frg != 0) return -1;
+
 	return length;
 }
 
@@ -434,7 +833,7 @@ int ikcp_peeksize(const ikcpcb *kcp)
 //---------------------------------------------------------------------
 // user/upper level send, returns below zero for error
 //---------------------------------------------------------------------
-int ikcp_send(ikcpcb *kcp, const char *buffer, int len)
+static int ikcp_send_segments(ikcpcb *kcp, const char *buffer, int len, void *ref)
 {
 	IKCPSEG *seg;
 	int count, i;
@@ -442,29 +841,83 @@ int ikcp_send(ikcpcb *kcp, const char *buffer, int len)
 	assert(kcp->mss > 0);
 	if (len < 0) return -1;
 
+	// append to the tail segment still waiting in snd_queue
+	if (kcp->stream != 0) {
+		if (ref == NULL && !iqueue_is_empty(&kcp->snd_queue)) {
+			IKCPSEG *old = iqueue_entry(kcp->snd_queue.prev, IKCPSEG, node);
+			int extend = kcp->stream_cap - (int)old->len;
+			if (extend > len) extend = len;
+			if (extend > 0) {
+				if (buffer) {
+					memcpy(old->data + old->len, buffer, extend);
+					buffer += extend;
+				}
+				old->len += extend;
+				len -= extend;
+			}
+		}
+		if (len <= 0) return 0;
+	}
+
 	if (len <= (int)kcp->mss) count = 1;
 	else count = (len + kcp->mss - 1) / kcp->mss;
 
-	if (count > 255) return -2;
+	// longer messages need the remote to understand saturated 'frg'
+	if (count > 255 && kcp->stream == 0) {
+		if ((kcp->caps & IKCP_CAP_XFRAG) == 0) return -2;
+		if (kcp->rmt_caps_seen && (kcp->rmt_caps & IKCP_CAP_XFRAG) == 0)
+			return -2;
+	}
 
 	if (count == 0) count = 1;
 
+	// a referenced buffer stays one segment, ikcp_flush cuts it
+	if (ref && count > 1) {
+		seg = ikcp_segment_new(kcp, 0);
+		assert(seg);
+		if (seg == NULL) {
+			return -2;
+		}
+		kcp->ref_retain(ref, kcp, kcp->user);
+		seg->ref = ref;
+		seg->ext = buffer;
+		seg->len = len;
+		seg->cut = kcp->mss;
+		seg->frg = (kcp->stream == 0)? count - 1 : 0;
+		iqueue_init(&seg->node);
+		iqueue_add_tail(&seg->node, &kcp->snd_queue);
+		kcp->nsnd_que += count;
+		kcp->stream_cap = 0;
+		return 0;
+	}
+
 	// fragment
 	for (i = 0; i < count; i++) {
 		int size = len > (int)kcp->mss ? (int)kcp->mss : len;
-		seg = ikcp_segment_new(kcp, size);
+		int cap = (kcp->stream != 0)? (int)kcp->mss : size;
+		seg = ikcp_segment_new(kcp, ref ? 0 : cap);
 		assert(seg);
 		if (seg == NULL) {
 			return -2;
 		}
-		if (buffer && len > 0) {
-			memcpy(seg->data, buffer, size);
+		if (ref) {
+			kcp->ref_retain(ref, kcp, kcp->user);
+			seg->ref = ref;
+			seg->ext = buffer;
+		}	else {
+			seg->ref = NULL;
+			seg->ext = NULL;
+			if (buffer && len > 0) {
+				memcpy(seg->data, buffer, size);
+			}
 		}
 		seg->len = size;
-		seg->frg = count - i - 1;
+		seg->cut = 0;
+		seg->frg = (kcp->stream == 0)? count - i - 1 : 0;
 		iqueue_init(&seg->node);
 		iqueue_add_tail(&seg->node, &kcp->snd_queue);
 		kcp->nsnd_que++;
+		kcp->stream_cap = (kcp->stream != 0 && ref == NULL)? cap : 0;
 		if (buffer) {
 			buffer += size;
 		}
@@ -474,6 +927,18 @@ int ikcp_send(ikcpcb *kcp, const char *buffer, int len)
 	return 0;
 }
 
+int ikcp_send(ikcpcb *kcp, const char *buffer, int len)
+{
+	return ikcp_send_segments(kcp, buffer, len, NULL);
+}
+
+int ikcp_send_ref(ikcpcb *kcp, const char *buffer, int len, void *ref)
+{
+	assert(kcp->ref_retain && kcp->ref_release);
+	if (ref == NULL || buffer == NULL) return -1;
+	return ikcp_send_segments(kcp, buffer, len, ref);
+}
+
 
 //---------------------------------------------------------------------
 // parse ack
@@ -514,57 +979,165 @@ static void ikcp_update_ack(ikcpcb *kcp, IINT32 rtt)
 		if (kcp->rx_srtt < 1) kcp->rx_srtt = 1;
 	}
 	rto = kcp->rx_srtt + _imax_(1, 4 * kcp->rx_rttval);
-	kcp->rx_rto = _ibound_(kcp->rx_minrto, rto, IKCP_RTO_MAX);
+	kcp->rx_rto = _ibound_(kcp->rx_minrto, rto, IKCP_RTO_MAX * kcp->tick);
 }
 
 static void ikcp_shrink_buf(ikcpcb *kcp)
 {
-	struct IQUEUEHEAD *p = kcp->snd_buf.next;
-	if (p != &kcp->snd_buf) {
-		IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
-		kcp->snd_una = seg->sn;
-	} else {
-		kcp->snd_una = kcp->snd_nxt;
+	// acked slots are empty, snd_una is the first one still in flight
+	while (kcp->snd_una != kcp->snd_nxt && IKCP_SND_SLOT(kcp, kcp->snd_una) == NULL) {
+		kcp->snd_una++;
+		kcp->pmtu_lost = 0;
 	}
 }
 
+// drop an acked segment from snd_buf and its timers
+static void ikcp_snd_remove(ikcpcb *kcp, IKCPSEG *seg)
+{
+	IKCP_SND_SLOT(kcp, seg->sn) = NULL;
+	if (seg->xmit > 0) ikcp_heap_remove(kcp, seg);
+	iqueue_del(&seg->node);
+	ikcp_segment_delete(kcp, seg);
+	kcp->nsnd_buf--;
+}
+
 static void ikcp_parse_ack(ikcpcb *kcp, IUINT32 sn)
 {
-	struct IQUEUEHEAD *p, *next;
+	IKCPSEG *seg;
 
 	if (_itimediff(sn, kcp->snd_una) < 0 || _itimediff(sn, kcp->snd_nxt) >= 0)
 		return;
 
-	for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = next) {
-		IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
-		next = p->next;
-		if (sn == seg->sn) {
-			iqueue_del(p);
-			ikcp_segment_delete(kcp, seg);
-			kcp->nsnd_buf--;
-			break;
-		} else {
-			seg->fastack++;
+	seg = IKCP_SND_SLOT(kcp, sn);
+	if (seg != NULL) {
+		assert(seg->sn == sn);
+		ikcp_snd_remove(kcp, seg);
+	}
+}
+
+// segments sent before the highest acked sn of one input were skipped,
+// a batch bumps them once per packet in a single pass
+static void ikcp_parse_fastack(ikcpcb *kcp, const IUINT32 *maxack, int count)
+{
+	IUINT32 acks[IKCP_BATCH_MAX];
+	IUINT32 sn;
+	int n = 0, i, j;
+
+	for (i = 0; i < count; i++) {
+		if (_itimediff(maxack[i], kcp->snd_una) < 0 || 
+			_itimediff(maxack[i], kcp->snd_nxt) >= 0)
+			continue;
+		for (j = n++; j > 0 && _itimediff(acks[j - 1], maxack[i]) > 0; j--) {
+			acks[j] = acks[j - 1];
+		}
+		acks[j] = maxack[i];
+	}
+
+	if (n == 0) return;
+
+	for (sn = kcp->snd_una, i = 0; sn != acks[n - 1]; sn++) {
+		IKCPSEG *seg;
+		while (_itimediff(acks[i], sn) <= 0) i++;
+		seg = IKCP_SND_SLOT(kcp, sn);
+		if (seg == NULL) continue;
+		seg->fastack += n - i;
+		if (kcp->fastresend > 0 && seg->fastack >= (IUINT32)kcp->fastresend &&
+			seg->xmit > 0 && iqueue_is_empty(&seg->node)) {
+			iqueue_add_tail(&seg->node, &kcp->fast_queue);
+		}
+	}
+}
+
+// the ack of sn echoes the ts of the transmission that got through
+static void ikcp_rack_ack(ikcpcb *kcp, IUINT32 sn, IUINT32 ts)
+{
+	// an earlier transmission than a rack resend got through, it was
+	// only reordered
+	if (_itimediff(sn, kcp->snd_una) >= 0 && _itimediff(sn, kcp->snd_nxt) < 0) {
+		const IKCPSEG *seg = IKCP_SND_SLOT(kcp, sn);
+		if (seg != NULL && seg->fastack && _itimediff(ts, seg->ts) < 0) {
+			if (kcp->rack_reo < 4) kcp->rack_reo++;
+			kcp->rack_persist = IKCP_RACK_PERSIST;
+		}
+	}
+
+	if (kcp->rack_seen && (_itimediff(ts, kcp->rack_ts) < 0 ||
+		(ts == kcp->rack_ts && _itimediff(sn, kcp->rack_sn) <= 0)))
+		return;
+	kcp->rack_ts = ts;
+	kcp->rack_sn = sn;
+	kcp->rack_rtt = (IUINT32)_itimediff(kcp->current, ts);
+	kcp->rack_seen = 1;
+	kcp->rack_wait = 1;
+	kcp->ts_rack = kcp->current;
+}
+
+// queue the sent segments older than the newest acked one whose reorder
+// window has passed, arm ts_rack for the earliest one still inside
+static void ikcp_rack_detect(ikcpcb *kcp)
+{
+	IUINT32 current = kcp->current;
+	IUINT32 reo = _imin_(kcp->rtt_min / 4 * kcp->rack_reo, (IUINT32)kcp->rx_srtt);
+	IUINT32 wait = kcp->rack_rtt + _imax_(reo, 1);
+	IUINT32 sn;
+	int lost = 0;
+
+	kcp->rack_wait = 0;
+
+	if (_itimediff(kcp->snd_fresh, kcp->snd_una) <= 0) return;
+
+	for (sn = kcp->snd_una; sn != kcp->snd_fresh; sn++) {
+		IKCPSEG *seg = IKCP_SND_SLOT(kcp, sn);
+		IINT32 left;
+		if (seg == NULL || !iqueue_is_empty(&seg->node)) continue;
+		if (_itimediff(seg->ts, kcp->rack_ts) > 0 ||
+			(seg->ts == kcp->rack_ts && _itimediff(sn, kcp->rack_sn) >= 0))
+			continue;
+		left = _itimediff(seg->ts + wait, current);
+		if (left <= 0) {
+			iqueue_add_tail(&seg->node, &kcp->fast_queue);
+			lost = 1;
 		}
+		else if (kcp->rack_wait == 0 || 
+			_itimediff(seg->ts + wait, kcp->ts_rack) < 0) {
+			kcp->rack_wait = 1;
+			kcp->ts_rack = seg->ts + wait;
+		}
+	}
+
+	if (lost && kcp->rack_persist > 0 && --kcp->rack_persist == 0) {
+		kcp->rack_reo = 1;
+	}
+}
+
+// restart the probe timer, acks or new data are flowing
+static void ikcp_tlp_arm(ikcpcb *kcp)
+{
+	IUINT32 pto = (kcp->rx_srtt > 0)? 2 * (IUINT32)kcp->rx_srtt : (IUINT32)kcp->rx_rto;
+	kcp->ts_tlp = kcp->current + pto;
+}
+
+// the first ack of the probed sn tells which transmission got through
+static void ikcp_tlp_ack(ikcpcb *kcp, IUINT32 sn, IUINT32 ts)
+{
+	if (kcp->tlp_out == 0 || sn != kcp->tlp_sn) return;
+	if (ts == kcp->tlp_ts) {
+		kcp->tlp_needed++;
+	}	else {
+		kcp->tlp_spurious++;
 	}
+	kcp->tlp_out = 0;
 }
 
 static void ikcp_parse_una(ikcpcb *kcp, IUINT32 una)
 {
-#if 1
-	struct IQUEUEHEAD *p, *next;
-	for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = next) {
-		IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
-		next = p->next;
-		if (_itimediff(una, seg->sn) > 0) {
-			iqueue_del(p);
-			ikcp_segment_delete(kcp, seg);
-			kcp->nsnd_buf--;
-		}	else {
-			break;
+	IUINT32 sn;
+	for (sn = kcp->snd_una; sn != kcp->snd_nxt && _itimediff(una, sn) > 0; sn++) {
+		IKCPSEG *seg = IKCP_SND_SLOT(kcp, sn);
+		if (seg) {
+			ikcp_snd_remove(kcp, seg);
 		}
 	}
-#endif
 }
 
 
@@ -601,6 +1174,10 @@ static void ikcp_ack_push(ikcpcb *kcp, IUINT32 sn, IUINT32 ts)
 		kcp->ackblock = newblock;
 	}
 
+	if (kcp->ackcount == 0) {
+		kcp->ts_ack = kcp->current + kcp->ackdelay;
+	}
+
 	ptr = &kcp->acklist[kcp->ackcount * 2];
 	ptr[0] = sn;
 	ptr[1] = ts;
@@ -619,60 +1196,436 @@ static void ikcp_ack_get(const ikcpcb *kcp, int p, IUINT32 *sn, IUINT32 *ts)
 //---------------------------------------------------------------------
 void ikcp_parse_data(ikcpcb *kcp, IKCPSEG *newseg)
 {
-	struct IQUEUEHEAD *p, *prev;
 	IUINT32 sn = newseg->sn;
-	int repeat = 0;
 	
 	if (_itimediff(sn, kcp->rcv_nxt + kcp->rcv_wnd) >= 0 ||
-		_itimediff(sn, kcp->rcv_nxt) < 0) {
+		_itimediff(sn, kcp->rcv_nxt) < 0 ||
+		_itimediff(sn, kcp->rcv_nxt + kcp->rcv_buf_size) >= 0) {
 		ikcp_segment_delete(kcp, newseg);
 		return;
 	}
 
-	for (p = kcp->rcv_buf.prev; p != &kcp->rcv_buf; p = prev) {
-		IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
-		prev = p->prev;
-		if (seg->sn == sn) {
-			repeat = 1;
-			break;
-		}
-		if (_itimediff(sn, seg->sn) > 0) {
-			break;
-		}
-	}
-
-	if (repeat == 0) {
+	if (IKCP_RCV_SLOT(kcp, sn) == NULL) {
 		iqueue_init(&newseg->node);
-		iqueue_add(&newseg->node, p);
+		IKCP_RCV_SLOT(kcp, sn) = newseg;
 		kcp->nrcv_buf++;
 	}	else {
+		assert(IKCP_RCV_SLOT(kcp, sn)->sn == sn);
 		ikcp_segment_delete(kcp, newseg);
 	}
 
 	// move available data from rcv_buf -> rcv_queue
-	while (! iqueue_is_empty(&kcp->rcv_buf)) {
-		IKCPSEG *seg = iqueue_entry(kcp->rcv_buf.next, IKCPSEG, node);
-		if (seg->sn == kcp->rcv_nxt && kcp->nrcv_que < kcp->rcv_wnd) {
-			iqueue_del(&seg->node);
-			kcp->nrcv_buf--;
-			iqueue_add_tail(&seg->node, &kcp->rcv_queue);
-			kcp->nrcv_que++;
-			kcp->rcv_nxt++;
-		}	else {
-			break;
-		}
-	}
+	ikcp_move_rcv_buf(kcp);
 }
 
 
 //---------------------------------------------------------------------
-// input data
+// congestion control: reno
 //---------------------------------------------------------------------
-int ikcp_input(ikcpcb *kcp, const char *data, long size)
+static int ikcp_reno_init(ikcpcb *kcp)
 {
-	IUINT32 una = kcp->snd_una;
+	kcp->ssthresh = IKCP_THRESH_INIT;
+	kcp->incr = kcp->cwnd * kcp->mss;
+	return 0;
+}
 
-	if (ikcp_canlog(kcp, IKCP_LOG_INPUT)) {
+static void ikcp_reno_on_ack(ikcpcb *kcp, IUINT32 una_acked, 
+	IUINT32 delivered, IINT32 rtt)
+{
+	(void)delivered;
+	(void)rtt;
+	if (una_acked == 0) return;
+	if (kcp->cwnd < kcp->rmt_wnd) {
+		IUINT32 mss = kcp->mss;
+		if (kcp->cwnd < kcp->ssthresh) {
+			kcp->cwnd++;
+			kcp->incr += mss;
+		}	else {
+			if (kcp->incr < mss) kcp->incr = mss;
+			kcp->incr += (mss * mss) / kcp->incr + (mss / 16);
+			if ((kcp->cwnd + 1) * mss <= kcp->incr) {
+				kcp->cwnd++;
+			}
+		}
+		if (kcp->cwnd > kcp->rmt_wnd) {
+			kcp->cwnd = kcp->rmt_wnd;
+			kcp->incr = kcp->rmt_wnd * mss;
+		}
+	}
+}
+
+static void ikcp_reno_on_fastresend(ikcpcb *kcp, IUINT32 inflight,
+	IUINT32 resent)
+{
+	kcp->ssthresh = inflight / 2;
+	if (kcp->ssthresh < IKCP_THRESH_MIN)
+		kcp->ssthresh = IKCP_THRESH_MIN;
+	kcp->cwnd = kcp->ssthresh + resent;
+	kcp->incr = kcp->cwnd * kcp->mss;
+}
+
+static void ikcp_reno_on_timeout(ikcpcb *kcp, IUINT32 window)
+{
+	kcp->ssthresh = window / 2;
+	if (kcp->ssthresh < IKCP_THRESH_MIN)
+		kcp->ssthresh = IKCP_THRESH_MIN;
+	kcp->cwnd = 1;
+	kcp->incr = kcp->mss;
+}
+
+const struct IKCPCC ikcp_cc_reno = {
+	"reno",
+	ikcp_reno_init,
+	NULL,
+	ikcp_reno_on_ack,
+	ikcp_reno_on_fastresend,
+	ikcp_reno_on_timeout,
+	NULL,
+};
+
+
+//---------------------------------------------------------------------
+// congestion control: bbr-like model. bottleneck bandwidth is the max
+// per-round delivery rate over the last rounds, the window is a gain
+// times bandwidth * min rtt. losses are left to retransmission
+//---------------------------------------------------------------------
+#define IKCP_BBR_BW_SAMPLES		10		// bandwidth filter length, rounds
+
+const IUINT32 IKCP_BBR_STARTUP = 0;
+const IUINT32 IKCP_BBR_DRAIN = 1;
+const IUINT32 IKCP_BBR_PROBE_BW = 2;
+const IUINT32 IKCP_BBR_PROBE_RTT = 3;
+const IUINT32 IKCP_BBR_CWND_MIN = 4;
+const IUINT32 IKCP_BBR_RTT_EXPIRE = 10000;	// min rtt kept for 10s
+const IUINT32 IKCP_BBR_PROBE_RTT_TIME = 200;
+const IUINT32 IKCP_BBR_STARTUP_GAIN = 289;	// gains are in percent
+const IUINT32 IKCP_BBR_CWND_GAIN = 200;
+const IUINT32 IKCP_BBR_FULL_BW_ROUNDS = 3;
+
+// cwnd gain per min rtt in PROBE_BW: probe up, drain, then cruise
+static const IUINT32 ikcp_bbr_cycle[8] = {
+	250, 150, 200, 200, 200, 200, 200, 200,
+};
+
+// pacing gain per min rtt in PROBE_BW
+static const IUINT32 ikcp_bbr_pacing_cycle[8] = {
+	125, 75, 100, 100, 100, 100, 100, 100,
+};
+
+typedef struct IKCPBBR
+{
+	IUINT32 mode;
+	IUINT32 bw[IKCP_BBR_BW_SAMPLES];	// segments per second
+	IUINT32 bw_index;
+	IUINT32 round_start, round_end, round_delivered, app_limited;
+	IUINT32 min_rtt, ts_min_rtt, probe_min_rtt, ts_probe_rtt;
+	IUINT32 full_bw, full_bw_rounds;
+	IUINT32 cycle, ts_cycle;
+}	IKCPBBR;
+
+static IUINT32 ikcp_bbr_max_bw(const IKCPBBR *bbr)
+{
+	IUINT32 bw = 0, i;
+	for (i = 0; i < IKCP_BBR_BW_SAMPLES; i++) {
+		if (bbr->bw[i] > bw) bw = bbr->bw[i];
+	}
+	return bw;
+}
+
+static int ikcp_bbr_init(ikcpcb *kcp)
+{
+	IKCPBBR *bbr = (IKCPBBR*)ikcp_malloc(sizeof(IKCPBBR));
+	if (bbr == NULL) return -1;
+	memset(bbr, 0, sizeof(IKCPBBR));
+	bbr->mode = IKCP_BBR_STARTUP;
+	bbr->round_start = kcp->current;
+	bbr->round_end = kcp->snd_nxt;
+	bbr->min_rtt = 0xffffffff;
+	kcp->cc_state = bbr;
+	if (kcp->cwnd < IKCP_BBR_CWND_MIN) 
+		kcp->cwnd = IKCP_BBR_CWND_MIN;
+	return 0;
+}
+
+static void ikcp_bbr_release(ikcpcb *kcp)
+{
+	if (kcp->cc_state) {
+		ikcp_free(kcp->cc_state);
+		kcp->cc_state = NULL;
+	}
+}
+
+// a round ends once everything sent at its start has been acked
+static void ikcp_bbr_update_round(ikcpcb *kcp, IKCPBBR *bbr)
+{
+	IUINT32 elapsed, rate, bw;
+
+	if (_itimediff(kcp->snd_una, bbr->round_end) < 0) return;
+	elapsed = kcp->current - bbr->round_start;
+	if (elapsed == 0) return;
+
+	rate = (IUINT32)((IUINT64)bbr->round_delivered * 1000 * kcp->tick / elapsed);
+	bw = ikcp_bbr_max_bw(bbr);
+
+	// an idle sender says nothing about the path unless it got faster
+	if (bbr->app_limited == 0 || rate > bw) {
+		bbr->bw[bbr->bw_index++ % IKCP_BBR_BW_SAMPLES] = rate;
+		if (rate > bw) bw = rate;
+	}
+
+	if (bbr->mode == IKCP_BBR_STARTUP && bbr->app_limited == 0) {
+		if (bw >= bbr->full_bw + bbr->full_bw / 4) {
+			bbr->full_bw = bw;
+			bbr->full_bw_rounds = 0;
+		}
+		else if (++bbr->full_bw_rounds >= IKCP_BBR_FULL_BW_ROUNDS) {
+			bbr->mode = IKCP_BBR_DRAIN;
+		}
+	}
+
+	bbr->round_start = kcp->current;
+	bbr->round_end = kcp->snd_nxt;
+	bbr->round_delivered = 0;
+	bbr->app_limited = (kcp->nsnd_que == 0 &&
+		kcp->snd_nxt - kcp->snd_una < kcp->cwnd)? 1 : 0;
+}
+
+static void ikcp_bbr_on_ack(ikcpcb *kcp, IUINT32 una_acked,
+	IUINT32 delivered, IINT32 rtt)
+{
+	IKCPBBR *bbr = (IKCPBBR*)kcp->cc_state;
+	IUINT32 current = kcp->current;
+	IUINT32 inflight = kcp->snd_nxt - kcp->snd_una;
+	IUINT32 bdp, target;
+
+	(void)una_acked;
+
+	if (rtt >= 0) {
+		IUINT32 sample = (rtt > 0)? (IUINT32)rtt : 1;
+		if (sample <= bbr->min_rtt) {
+			bbr->min_rtt = sample;
+			bbr->ts_min_rtt = current;
+		}
+		if (sample < bbr->probe_min_rtt) 
+			bbr->probe_min_rtt = sample;
+	}
+
+	bbr->round_delivered += delivered;
+	ikcp_bbr_update_round(kcp, bbr);
+
+	// stale min rtt: shrink to the floor for a moment to measure again
+	if (bbr->mode != IKCP_BBR_PROBE_RTT && bbr->min_rtt != 0xffffffff &&
+		_itimediff(current, bbr->ts_min_rtt + IKCP_BBR_RTT_EXPIRE * kcp->tick) > 0) {
+		bbr->mode = IKCP_BBR_PROBE_RTT;
+		bbr->ts_probe_rtt = current + IKCP_BBR_PROBE_RTT_TIME * kcp->tick;
+		bbr->probe_min_rtt = 0xffffffff;
+	}
+
+	if (bbr->mode == IKCP_BBR_PROBE_RTT) {
+		kcp->cwnd = IKCP_BBR_CWND_MIN;
+		if (_itimediff(current, bbr->ts_probe_rtt) < 0) return;
+		if (bbr->probe_min_rtt != 0xffffffff)
+			bbr->min_rtt = bbr->probe_min_rtt;
+		bbr->ts_min_rtt = current;
+		bbr->mode = IKCP_BBR_PROBE_BW;
+		bbr->cycle = 2;
+		bbr->ts_cycle = current;
+	}
+
+	if (bbr->min_rtt == 0xffffffff || ikcp_bbr_max_bw(bbr) == 0) {
+		kcp->cwnd += delivered;
+		if (kcp->cwnd > kcp->snd_wnd) kcp->cwnd = kcp->snd_wnd;
+		return;
+	}
+
+	bdp = (IUINT32)((IUINT64)ikcp_bbr_max_bw(bbr) * bbr->min_rtt / 
+		(1000 * kcp->tick));
+
+	if (bbr->mode == IKCP_BBR_DRAIN && inflight <= bdp) {
+		bbr->mode = IKCP_BBR_PROBE_BW;
+		bbr->cycle = 2;
+		bbr->ts_cycle = current;
+	}
+
+	if (bbr->mode == IKCP_BBR_PROBE_BW &&
+		_itimediff(current, bbr->ts_cycle + bbr->min_rtt) >= 0) {
+		bbr->cycle = (bbr->cycle + 1) % 8;
+		bbr->ts_cycle = current;
+	}
+
+	if (bbr->mode == IKCP_BBR_STARTUP) {
+		target = bdp * IKCP_BBR_STARTUP_GAIN / 100;
+		kcp->cwnd = _imin_(kcp->cwnd + delivered, target);
+	}	
+	else if (bbr->mode == IKCP_BBR_DRAIN) {
+		target = bdp;
+		kcp->cwnd = target;
+	}	
+	else {
+		target = bdp * ikcp_bbr_cycle[bbr->cycle] / 100;
+		kcp->cwnd = _imin_(kcp->cwnd + delivered, target);
+	}
+
+	if (kcp->cwnd < IKCP_BBR_CWND_MIN) kcp->cwnd = IKCP_BBR_CWND_MIN;
+	if (kcp->cwnd > kcp->snd_wnd) kcp->cwnd = kcp->snd_wnd;
+}
+
+static IUINT32 ikcp_bbr_pacing_rate(ikcpcb *kcp)
+{
+	const IKCPBBR *bbr = (const IKCPBBR*)kcp->cc_state;
+	IUINT64 rate = (IUINT64)ikcp_bbr_max_bw(bbr) * (kcp->mss + IKCP_OVERHEAD);
+	IUINT32 gain = 100;
+	if (bbr->mode == IKCP_BBR_STARTUP) gain = IKCP_BBR_STARTUP_GAIN;
+	else if (bbr->mode == IKCP_BBR_DRAIN) gain = 10000 / IKCP_BBR_STARTUP_GAIN;
+	else if (bbr->mode == IKCP_BBR_PROBE_BW) gain = ikcp_bbr_pacing_cycle[bbr->cycle];
+	rate = rate * gain / 100;
+	return (rate > 0xffffffff)? 0xffffffff : (IUINT32)rate;
+}
+
+const struct IKCPCC ikcp_cc_bbr = {
+	"bbr",
+	ikcp_bbr_init,
+	ikcp_bbr_release,
+	ikcp_bbr_on_ack,
+	NULL,
+	NULL,
+	ikcp_bbr_pacing_rate,
+};
+
+
+//---------------------------------------------------------------------
+// path mtu discovery: binary search between the confirmed size and
+// pmtu_hi, the top of the range is probed once it is within a step
+//---------------------------------------------------------------------
+static void ikcp_pmtu_set(ikcpcb *kcp, IUINT32 mtu)
+{
+	kcp->mtu = mtu;
+	kcp->mss = kcp->mtu - IKCP_OVERHEAD;
+	kcp->pmtu_lost = 0;
+}
+
+// the probe of 'size' bytes came back
+static void ikcp_pmtu_ack(ikcpcb *kcp, IUINT32 size)
+{
+	kcp->pmtu_lo = size;
+	kcp->pmtu_probe = 0;
+	kcp->ts_pmtu = kcp->current;
+	if (size > kcp->mtu) {
+		ikcp_pmtu_set(kcp, size);
+	}
+}
+
+// the lowest mtu the search may settle on
+static IUINT32 ikcp_pmtu_floor(const ikcpcb *kcp)
+{
+	if (kcp->pmtu_min > 0 && kcp->pmtu_min < kcp->pmtu_base)
+		return kcp->pmtu_min;
+	return kcp->pmtu_base;
+}
+
+// acks and probes stay within the floor, a remote that sends no data
+// never sees its own packets lost when the path shrinks
+static IUINT32 ikcp_ctl_mtu(const ikcpcb *kcp)
+{
+	return _imin_(kcp->mtu, ikcp_pmtu_floor(kcp));
+}
+
+// the mtu stopped getting through, search below it from the floor
+static void ikcp_pmtu_fallback(ikcpcb *kcp)
+{
+	IUINT32 floor = ikcp_pmtu_floor(kcp);
+	kcp->pmtu_hi = kcp->mtu - 1;
+	ikcp_pmtu_set(kcp, floor);
+	kcp->pmtu_lo = floor;
+	kcp->pmtu_probe = 0;
+	kcp->ts_pmtu = kcp->current;
+}
+
+// a piece of a segment over the mtu the remote fell back to. pieces
+// are taken in order, a gap waits for the resend, and the segment is
+// acked once complete
+static void ikcp_parse_part(ikcpcb *kcp, const IKCPSEG *hdr, 
+	const char *data)
+{
+	IKCPSEG *seg = kcp->rcv_part;
+	IUINT32 offset, total, n = hdr->len - IKCP_PART_HEAD;
+	IUINT8 frg;
+
+	data = ikcp_decode32u(data, &offset);
+	data = ikcp_decode32u(data, &total);
+	data = ikcp_decode8u(data, &frg);
+
+	if (total > IKCP_PART_MAX || offset > total || n > total - offset) 
+		return;
+
+	if (seg != NULL && (seg->sn != hdr->sn || seg->len != total)) {
+		if (offset != 0) return;
+		ikcp_segment_delete(kcp, seg);
+		kcp->rcv_part = seg = NULL;
+	}
+
+	if (seg == NULL) {
+		if (offset != 0) return;
+		seg = ikcp_segment_new(kcp, total);
+		seg->conv = hdr->conv;
+		seg->cmd = IKCP_CMD_PUSH;
+		seg->frg = frg;
+		seg->wnd = hdr->wnd;
+		seg->ts = hdr->ts;
+		seg->sn = hdr->sn;
+		seg->una = hdr->una;
+		seg->len = total;
+		seg->ref = NULL;
+		seg->ext = NULL;
+		kcp->rcv_part = seg;
+		kcp->rcv_part_len = 0;
+	}
+
+	if (offset > kcp->rcv_part_len) return;
+
+	memcpy(seg->data + offset, data, n);
+	if (offset + n > kcp->rcv_part_len) {
+		kcp->rcv_part_len = offset + n;
+	}
+	if (kcp->rcv_part_len < total) return;
+
+	kcp->rcv_part = NULL;
+	ikcp_ack_push(kcp, seg->sn, hdr->ts);
+	if (_itimediff(seg->sn, kcp->rcv_nxt) >= 0) {
+		ikcp_parse_data(kcp, seg);
+	}	else {
+		ikcp_segment_delete(kcp, seg);
+	}
+}
+
+
+//---------------------------------------------------------------------
+// input data
+//---------------------------------------------------------------------
+// state shared by the packets of one batch
+struct IKCPINPUT
+{
+	IUINT32 una, nsnd_buf;
+	IINT32 rtt;
+	int nack;
+	IUINT32 maxack[IKCP_BATCH_MAX];
+};
+
+static void ikcp_input_begin(ikcpcb *kcp, struct IKCPINPUT *in)
+{
+	in->una = kcp->snd_una;
+	in->nsnd_buf = kcp->nsnd_buf;
+	in->rtt = -1;
+	in->nack = 0;
+}
+
+static int ikcp_input_packet(ikcpcb *kcp, const char *data, long size,
+	struct IKCPINPUT *in)
+{
+	IUINT32 maxack = 0;
+	int flag = 0;
+
+	if (ikcp_canlog(kcp, IKCP_LOG_INPUT)) {
 		ikcp_log(kcp, IKCP_LOG_INPUT, "[RI] %d bytes", size);
 	}
 
@@ -702,19 +1655,39 @@ int ikcp_input(ikcpcb *kcp, const char *data, long size)
 		if ((long)size < (long)len) return -2;
 
 		if (cmd != IKCP_CMD_PUSH && cmd != IKCP_CMD_ACK &&
-			cmd != IKCP_CMD_WASK && cmd != IKCP_CMD_WINS) 
+			cmd != IKCP_CMD_WASK && cmd != IKCP_CMD_WINS &&
+			cmd != IKCP_CMD_SACK && cmd != IKCP_CMD_PMTU &&
+			cmd != IKCP_CMD_PART) 
 			return -3;
 
+		// non-data segments carry the remote caps in 'frg'
+		if (cmd != IKCP_CMD_PUSH) {
+			kcp->rmt_caps = frg;
+			kcp->rmt_caps_seen = 1;
+		}
+
+		// remote may not have seen our caps yet, tell it with a WINS
+		if (kcp->caps_tell > 0) {
+			kcp->caps_tell--;
+			kcp->probe |= IKCP_ASK_TELL;
+		}
+
 		kcp->rmt_wnd = wnd;
 		ikcp_parse_una(kcp, una);
 		ikcp_shrink_buf(kcp);
 
 		if (cmd == IKCP_CMD_ACK) {
 			if (_itimediff(kcp->current, ts) >= 0) {
-				ikcp_update_ack(kcp, _itimediff(kcp->current, ts));
+				in->rtt = _itimediff(kcp->current, ts);
+				ikcp_update_ack(kcp, in->rtt);
+				if (kcp->rack) ikcp_rack_ack(kcp, sn, ts);
+				if (kcp->tlp) ikcp_tlp_ack(kcp, sn, ts);
 			}
 			ikcp_parse_ack(kcp, sn);
-			ikcp_shrink_buf(kcp);
+			if (flag == 0 || _itimediff(sn, maxack) > 0) {
+				maxack = sn;
+				flag = 1;
+			}
 			if (ikcp_canlog(kcp, IKCP_LOG_IN_ACK)) {
 				ikcp_log(kcp, IKCP_LOG_IN_DATA, 
 					"input ack: sn=%lu rtt=%ld rto=%ld", sn, 
@@ -722,6 +1695,30 @@ int ikcp_input(ikcpcb *kcp, const char *data, long size)
 					(long)kcp->rx_rto);
 			}
 		}
+		else if (cmd == IKCP_CMD_SACK) {
+			IUINT32 i;
+			if (_itimediff(kcp->current, ts) >= 0) {
+				in->rtt = _itimediff(kcp->current, ts);
+				ikcp_update_ack(kcp, in->rtt);
+				if (kcp->rack) ikcp_rack_ack(kcp, sn, ts);
+				if (kcp->tlp) ikcp_tlp_ack(kcp, sn, ts);
+			}
+			for (i = 0; i < len * 8; i++) {
+				if ((((const unsigned char*)data)[i >> 3] >> (i & 7)) & 1) {
+					ikcp_parse_ack(kcp, una + i);
+					if (flag == 0 || _itimediff(una + i, maxack) > 0) {
+						maxack = una + i;
+						flag = 1;
+					}
+				}
+			}
+			if (ikcp_canlog(kcp, IKCP_LOG_IN_ACK)) {
+				ikcp_log(kcp, IKCP_LOG_IN_ACK, 
+					"input sack: una=%lu bits=%lu rtt=%ld rto=%ld", una,
+					(IUINT32)(len * 8), (long)_itimediff(kcp->current, ts),
+					(long)kcp->rx_rto);
+			}
+		}
 		else if (cmd == IKCP_CMD_PUSH) {
 			if (ikcp_canlog(kcp, IKCP_LOG_IN_DATA)) {
 				ikcp_log(kcp, IKCP_LOG_IN_DATA, 
@@ -730,6 +1727,7 @@ int ikcp_input(ikcpcb *kcp, const char *data, long size)
 			if (_itimediff(sn, kcp->rcv_nxt + kcp->rcv_wnd) < 0) {
 				ikcp_ack_push(kcp, sn, ts);
 				if (_itimediff(sn, kcp->rcv_nxt) >= 0) {
+					kcp->rcv_count++;
 					seg = ikcp_segment_new(kcp, len);
 					seg->conv = conv;
 					seg->cmd = cmd;
@@ -739,6 +1737,8 @@ int ikcp_input(ikcpcb *kcp, const char *data, long size)
 					seg->sn = sn;
 					seg->una = una;
 					seg->len = len;
+					seg->ref = NULL;
+					seg->ext = NULL;
 
 					if (len > 0) {
 						memcpy(seg->data, data, len);
@@ -752,6 +1752,7 @@ int ikcp_input(ikcpcb *kcp, const char *data, long size)
 			// ready to send back IKCP_CMD_WINS in ikcp_flush
 			// tell remote my window size
 			kcp->probe |= IKCP_ASK_TELL;
+			kcp->rcv_asked = 1;
 			if (ikcp_canlog(kcp, IKCP_LOG_IN_PROBE)) {
 				ikcp_log(kcp, IKCP_LOG_IN_PROBE, "input probe");
 			}
@@ -763,6 +1764,37 @@ int ikcp_input(ikcpcb *kcp, const char *data, long size)
 					"input wins: %lu", (IUINT32)(wnd));
 			}
 		}
+		else if (cmd == IKCP_CMD_PMTU) {
+			if (len > 0) {
+				// a probe made it, tell its size
+				kcp->pmtu_echo = len + IKCP_OVERHEAD;
+				kcp->probe |= IKCP_ASK_PMTU;
+			}
+			else if (kcp->pmtu_probe != 0 && sn == kcp->pmtu_probe) {
+				ikcp_pmtu_ack(kcp, sn);
+			}
+			if (ikcp_canlog(kcp, IKCP_LOG_IN_PROBE)) {
+				ikcp_log(kcp, IKCP_LOG_IN_PROBE, "input pmtu: size=%lu echo=%d", 
+					(len > 0)? len + IKCP_OVERHEAD : sn, (int)(len == 0));
+			}
+		}
+		else if (cmd == IKCP_CMD_PART) {
+			if (ikcp_canlog(kcp, IKCP_LOG_IN_DATA)) {
+				ikcp_log(kcp, IKCP_LOG_IN_DATA, 
+					"input part: sn=%lu ts=%lu", sn, ts);
+			}
+			if (_itimediff(sn, kcp->rcv_nxt + kcp->rcv_wnd) < 0 && 
+				len > IKCP_PART_HEAD) {
+				IKCPSEG hdr;
+				hdr.conv = conv;
+				hdr.wnd = wnd;
+				hdr.ts = ts;
+				hdr.sn = sn;
+				hdr.una = una;
+				hdr.len = len;
+				ikcp_parse_part(kcp, &hdr, data);
+			}
+		}
 		else {
 			return -3;
 		}
@@ -771,29 +1803,82 @@ int ikcp_input(ikcpcb *kcp, const char *data, long size)
 		size -= len;
 	}
 
-	if (_itimediff(kcp->snd_una, una) > 0) {
-		if (kcp->cwnd < kcp->rmt_wnd) {
-			IUINT32 mss = kcp->mss;
-			if (kcp->cwnd < kcp->ssthresh) {
-				kcp->cwnd++;
-				kcp->incr += mss;
-			}	else {
-				if (kcp->incr < mss) kcp->incr = mss;
-				kcp->incr += (mss * mss) / kcp->incr + (mss / 16);
-				if ((kcp->cwnd + 1) * mss <= kcp->incr) {
-					kcp->cwnd++;
-				}
-			}
-			if (kcp->cwnd > kcp->rmt_wnd) {
-				kcp->cwnd = kcp->rmt_wnd;
-				kcp->incr = kcp->rmt_wnd * mss;
-			}
-		}
+	if (flag != 0) {
+		in->maxack[in->nack++] = maxack;
 	}
 
 	return 0;
 }
 
+// fastack or rack and cc once for all packets of the batch
+static void ikcp_input_end(ikcpcb *kcp, struct IKCPINPUT *in)
+{
+	ikcp_shrink_buf(kcp);
+
+	if (kcp->rack) {
+		if (kcp->rack_wait && _itimediff(kcp->current, kcp->ts_rack) >= 0)
+			ikcp_rack_detect(kcp);
+	}
+	else if (in->nack > 0) {
+		ikcp_parse_fastack(kcp, in->maxack, in->nack);
+	}
+
+	if (_itimediff(kcp->snd_una, in->una) > 0 || kcp->nsnd_buf != in->nsnd_buf) {
+		kcp->cc->on_ack(kcp, kcp->snd_una - in->una, 
+			in->nsnd_buf - kcp->nsnd_buf, in->rtt);
+		kcp->snd_delivered += in->nsnd_buf - kcp->nsnd_buf;
+		if (kcp->tlp) ikcp_tlp_arm(kcp);
+	}
+
+	// acked by una alone, the probe's outcome is unknown
+	if (kcp->tlp_out && _itimediff(kcp->snd_una, kcp->tlp_sn) > 0) {
+		kcp->tlp_out = 0;
+	}
+
+	// queueing inflates srtt, the window tuner wants the path's own rtt
+	if (in->rtt >= 0 && (kcp->rtt_min == 0 || (IUINT32)in->rtt <= kcp->rtt_min ||
+		_itimediff(kcp->current, kcp->ts_rtt_min) >= 
+		(IINT32)(IKCP_WND_RTT_WIN * kcp->tick))) {
+		kcp->rtt_min = _imax_((IUINT32)in->rtt, 1);
+		kcp->ts_rtt_min = kcp->current;
+	}
+}
+
+int ikcp_input(ikcpcb *kcp, const char *data, long size)
+{
+	struct IKCPINPUT in;
+	int hr;
+
+	ikcp_input_begin(kcp, &in);
+	hr = ikcp_input_packet(kcp, data, size, &in);
+	ikcp_input_end(kcp, &in);
+
+	return hr;
+}
+
+int ikcp_input_batch(ikcpcb *kcp, const char * const *data, 
+	const long *size, int count)
+{
+	struct IKCPINPUT in;
+	int i, hr = 0;
+
+	ikcp_input_begin(kcp, &in);
+
+	for (i = 0; i < count; i++) {
+		int r;
+		if (in.nack == IKCP_BATCH_MAX) {
+			ikcp_input_end(kcp, &in);
+			ikcp_input_begin(kcp, &in);
+		}
+		r = ikcp_input_packet(kcp, data[i], size[i], &in);
+		if (r < 0 && hr == 0) hr = r;
+	}
+
+	ikcp_input_end(kcp, &in);
+
+	return hr;
+}
+
 
 //---------------------------------------------------------------------
 // ikcp_encode_seg
@@ -802,7 +1887,7 @@ static char *ikcp_encode_seg(char *ptr, const IKCPSEG *seg)
 {
 	ptr = ikcp_encode32u(ptr, seg->conv);
 	ptr = ikcp_encode8u(ptr, (IUINT8)seg->cmd);
-	ptr = ikcp_encode8u(ptr, (IUINT8)seg->frg);
+	ptr = ikcp_encode8u(ptr, (IUINT8)(seg->frg > 255 ? 255 : seg->frg));
 	ptr = ikcp_encode16u(ptr, (IUINT16)seg->wnd);
 	ptr = ikcp_encode32u(ptr, seg->ts);
 	ptr = ikcp_encode32u(ptr, seg->sn);
@@ -813,35 +1898,454 @@ static char *ikcp_encode_seg(char *ptr, const IKCPSEG *seg)
 
 static int ikcp_wnd_unused(const ikcpcb *kcp)
 {
-	if (kcp->nrcv_que < kcp->rcv_wnd) {
-		return kcp->rcv_wnd - kcp->nrcv_que;
+	// while shrinking the smaller window is advertised, the old one is
+	// still accepted
+	IUINT32 wnd = (kcp->rcv_shrink)? kcp->rcv_shrink : kcp->rcv_wnd;
+	if (kcp->nrcv_que < wnd) {
+		return wnd - kcp->nrcv_que;
 	}
 	return 0;
 }
 
 
+//---------------------------------------------------------------------
+// ikcp_ack_hold: delayed ack mode keeps pending acks back until the
+// deadline or count is reached, unless one of them is out of order
+//---------------------------------------------------------------------
+static int ikcp_ack_hold(const ikcpcb *kcp)
+{
+	IUINT32 sn, i;
+
+	if (_itimediff(kcp->current, kcp->ts_ack) >= 0)
+		return 0;
+
+	if (kcp->ackmax > 0 && kcp->ackcount >= kcp->ackmax)
+		return 0;
+
+	for (i = 0; i < kcp->ackcount; i++) {
+		ikcp_ack_get(kcp, i, &sn, NULL);
+		if (_itimediff(sn, kcp->rcv_nxt) >= 0)
+			return 0;
+	}
+
+	return 1;
+}
+
+
+//---------------------------------------------------------------------
+// ikcp_flush_sack: the whole acklist as one SACK, a bitmap of rcv_buf
+// from una. acks too far ahead for one mss of bitmap go out as ACK
+//---------------------------------------------------------------------
+static char *ikcp_flush_sack(ikcpcb *kcp, IKCPSEG *seg, char *ptr)
+{
+	IUINT32 maxbits = (ikcp_ctl_mtu(kcp) - IKCP_OVERHEAD) * 8;
+	IUINT32 nbits = 0;
+	IUINT32 sn, ts, i;
+	int size;
+
+	for (i = 0; i < kcp->ackcount; i++) {
+		ikcp_ack_get(kcp, i, &sn, NULL);
+		if (_itimediff(sn, kcp->rcv_nxt) < 0) continue;
+		if (sn - kcp->rcv_nxt < maxbits && sn - kcp->rcv_nxt >= nbits)
+			nbits = sn - kcp->rcv_nxt + 1;
+	}
+
+	// the newest ack echoes its ts for rtt estimation
+	ikcp_ack_get(kcp, kcp->ackcount - 1, &seg->sn, &seg->ts);
+	seg->cmd = IKCP_CMD_SACK;
+	seg->len = (nbits + 7) / 8;
+
+	size = (int)(ptr - ikcp_obuf(kcp));
+	if (size + IKCP_OVERHEAD + seg->len > ikcp_ctl_mtu(kcp)) {
+		ptr = ikcp_output_buf(kcp, size);
+	}
+
+	ptr = ikcp_encode_seg(ptr, seg);
+	memset(ptr, 0, seg->len);
+	for (i = 0; i < nbits; i++) {
+		if (IKCP_RCV_SLOT(kcp, kcp->rcv_nxt + i) != NULL) {
+			ptr[i >> 3] |= (char)(1 << (i & 7));
+		}
+	}
+	ptr += seg->len;
+
+	if (ikcp_canlog(kcp, IKCP_LOG_OUT_ACK)) {
+		ikcp_log(kcp, IKCP_LOG_OUT_ACK, "output sack: una=%lu acks=%lu bits=%lu",
+			kcp->rcv_nxt, kcp->ackcount, nbits);
+	}
+
+	seg->cmd = IKCP_CMD_ACK;
+	seg->len = 0;
+	for (i = 0; i < kcp->ackcount; i++) {
+		ikcp_ack_get(kcp, i, &sn, &ts);
+		if (_itimediff(sn, kcp->rcv_nxt) < 0 || sn - kcp->rcv_nxt < maxbits)
+			continue;
+		size = (int)(ptr - ikcp_obuf(kcp));
+		if (size + IKCP_OVERHEAD > ikcp_ctl_mtu(kcp)) {
+			ptr = ikcp_output_buf(kcp, size);
+		}
+		seg->sn = sn;
+		seg->ts = ts;
+		ptr = ikcp_encode_seg(ptr, seg);
+	}
+
+	return ptr;
+}
+
+
+// a due mtu probe, padded to its size in a datagram of its own
+// xorshift bytes
+static void ikcp_fill_pad(char *ptr, IUINT32 len, IUINT32 seed)
+{
+	IUINT32 x = seed | 1;
+	IUINT32 i;
+	for (i = 0; i < len; i++) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		ptr[i] = (char)(x >> 24);
+	}
+}
+
+static void ikcp_flush_pmtu(ikcpcb *kcp, IKCPSEG *seg)
+{
+	IUINT32 current = kcp->current;
+	char *ptr;
+
+	if (_itimediff(current, kcp->ts_pmtu) < 0) return;
+
+	if (kcp->pmtu_probe != 0 && kcp->pmtu_tries >= IKCP_PMTU_TRIES) {
+		kcp->pmtu_hi = (kcp->pmtu_probe == kcp->pmtu_hi)?
+			kcp->pmtu_lo : kcp->pmtu_probe - 1;
+		kcp->pmtu_probe = 0;
+	}
+
+	if (kcp->pmtu_probe == 0) {
+		if (kcp->pmtu_lo >= kcp->pmtu_hi) {
+			// settled, look for a larger one later
+			kcp->pmtu_hi = kcp->pmtu_max;
+			kcp->ts_pmtu = current + IKCP_PMTU_RAISE * kcp->tick;
+			return;
+		}
+		kcp->pmtu_probe = (kcp->pmtu_hi - kcp->pmtu_lo <= IKCP_PMTU_STEP)?
+			kcp->pmtu_hi : (kcp->pmtu_lo + kcp->pmtu_hi + 1) / 2;
+		kcp->pmtu_tries = 0;
+	}
+
+	kcp->pmtu_tries++;
+	kcp->ts_pmtu = current + _imax_((IUINT32)kcp->rx_rto, kcp->interval);
+
+	seg->cmd = IKCP_CMD_PMTU;
+	seg->sn = kcp->pmtu_probe;
+	seg->ts = current;
+	seg->len = kcp->pmtu_probe - IKCP_OVERHEAD;
+
+	// incompressible padding, a compressing transform must not shrink
+	// the probe below the size it tests
+	ptr = ikcp_encode_seg(ikcp_obuf(kcp), seg);
+	ikcp_fill_pad(ptr, seg->len, seg->ts);
+	ikcp_output_buf(kcp, (int)kcp->pmtu_probe);
+	seg->len = 0;
+
+	if (ikcp_canlog(kcp, IKCP_LOG_OUT_PROBE)) {
+		ikcp_log(kcp, IKCP_LOG_OUT_PROBE, "output pmtu: size=%lu try=%lu",
+			kcp->pmtu_probe, kcp->pmtu_tries);
+	}
+}
+
+
+//---------------------------------------------------------------------
+// window auto-tuning, windows are counted in segments of the current
+// mss. snd_wnd is tuned once per srtt, rcv_wnd once per window received
+//---------------------------------------------------------------------
+static IUINT32 ikcp_tune_wnd(ikcpcb *kcp, IUINT32 wnd, IUINT32 floor)
+{
+	IUINT32 limit = _imin_(kcp->wnd_max / kcp->mss, IKCP_WND_MAX);
+	return _ibound_(floor, wnd, _imax_(limit, floor));
+}
+
+static void ikcp_tune_snd(ikcpcb *kcp)
+{
+	IUINT32 current = kcp->current;
+	IINT32 elapsed = _itimediff(current, kcp->ts_snd_tune);
+	IUINT32 bdp, wnd = kcp->snd_wnd;
+
+	if (kcp->rtt_min == 0 || 
+		elapsed < (IINT32)_imax_((IUINT32)kcp->rx_srtt, kcp->interval)) 
+		return;
+
+	// delivered per min rtt, the peak decays by 1/8 a round
+	bdp = (IUINT32)((IUINT64)kcp->snd_delivered * kcp->rtt_min / elapsed);
+	kcp->snd_bdp = _imax_(bdp, kcp->snd_bdp - kcp->snd_bdp / 8);
+
+	if (kcp->snd_limited & IKCP_WND_BY_SND) {
+		if (bdp * 2 > wnd) wnd = bdp * 2;
+	}
+	else if (kcp->snd_bdp * 4 < wnd) {
+		wnd = kcp->snd_bdp * 2;
+	}
+
+	// a WASK asks a tuning remote for a larger window
+	if (kcp->snd_limited & IKCP_WND_BY_RMT) {
+		kcp->probe |= IKCP_ASK_SEND;
+	}
+
+	wnd = ikcp_tune_wnd(kcp, wnd, kcp->snd_wnd_min);
+	if (wnd > kcp->snd_wnd && ikcp_snd_reserve(kcp, wnd) == 0) {
+		kcp->snd_wnd = wnd;
+	}
+	else if (wnd < kcp->snd_wnd) {
+		kcp->snd_wnd = wnd;
+	}
+
+	kcp->ts_snd_tune = current;
+	kcp->snd_delivered = 0;
+	kcp->snd_limited = 0;
+}
+
+static void ikcp_tune_rcv(ikcpcb *kcp)
+{
+	IUINT32 current = kcp->current;
+	IUINT32 wnd;
+
+	// segments sent under the old window are still taken in, the window
+	// gives way only as rcv_nxt moves up to the old right edge
+	if (kcp->rcv_shrink) {
+		IUINT32 keep = (_itimediff(kcp->rcv_edge, kcp->rcv_nxt) > 0)?
+			kcp->rcv_edge - kcp->rcv_nxt : 0;
+		kcp->rcv_wnd = _imax_(kcp->rcv_shrink, keep);
+		if (kcp->rcv_wnd == kcp->rcv_shrink) {
+			kcp->rcv_shrink = 0;
+		}
+	}
+
+	wnd = kcp->rcv_wnd;
+
+	// the remote ran into the window, the reader keeps up and the last
+	// growth has been used
+	if (kcp->rcv_asked && kcp->nrcv_que * 4 < wnd &&
+		_itimediff(kcp->rcv_nxt, kcp->rcv_tune_sn) >= 0) {
+		wnd = ikcp_tune_wnd(kcp, wnd * 2, kcp->rcv_wnd_min);
+		if (wnd > kcp->rcv_wnd && 
+			ikcp_ring_reserve(&kcp->rcv_buf, &kcp->rcv_buf_size, wnd) == 0) {
+			kcp->rcv_wnd = wnd;
+			kcp->rcv_shrink = 0;
+		}
+		kcp->rcv_tune_sn = kcp->rcv_nxt + kcp->rcv_wnd;
+		kcp->ts_rcv_tune = current;
+		kcp->rcv_count = 0;
+	}
+	else if (_itimediff(current, kcp->ts_rcv_tune) >= 
+		(IINT32)(IKCP_WND_IDLE * kcp->tick)) {
+		// less than a window a second is far below any bdp
+		if (kcp->rcv_count < wnd) {
+			IUINT32 goal = ikcp_tune_wnd(kcp, wnd / 2, kcp->rcv_wnd_min);
+			if (goal < wnd) {
+				kcp->rcv_shrink = goal;
+				kcp->rcv_edge = kcp->rcv_nxt + wnd;
+			}
+		}
+		kcp->ts_rcv_tune = current;
+		kcp->rcv_count = 0;
+	}
+
+	kcp->rcv_asked = 0;
+}
+
+
+//---------------------------------------------------------------------
+// ikcp_pace: refill pacing credit, window over srtt unless cc knows
+// better. credit is capped to 2ms of sending (two packets at least)
+//---------------------------------------------------------------------
+static void ikcp_pace(ikcpcb *kcp, IUINT32 window)
+{
+	IUINT32 current = kcp->current;
+	IUINT32 rate = 0, burst;
+	IINT32 elapsed;
+
+	if (kcp->cc->pacing_rate) {
+		rate = kcp->cc->pacing_rate(kcp);
+	}
+
+	// no rtt yet, let the window go out at once
+	if (rate == 0 && kcp->rx_srtt == 0) {
+		kcp->pacing_rate = 0;
+		kcp->ts_pacing = current;
+		kcp->pacing_credit = 0x7fffffff;
+		return;
+	}
+
+	// slow start doubles per rtt, ask for room to grow
+	if (rate == 0) {
+		IUINT64 r = (IUINT64)window * (kcp->mss + IKCP_OVERHEAD) * 1000 * kcp->tick;
+		r /= (IUINT32)kcp->rx_srtt;
+		r = (kcp->cwnd < kcp->ssthresh)? r * 2 : r * 5 / 4;
+		rate = (r > 0xffffffff)? 0xffffffff : (IUINT32)r;
+	}
+
+	if (kcp->pacing_rate == 0) {
+		kcp->pacing_credit = 0;
+		kcp->ts_pacing = current;
+	}
+
+	elapsed = _itimediff(current, kcp->ts_pacing);
+	if (elapsed > 0) {
+		// a debt from sending past the credit is paid off first
+		IINT64 credit = (IINT64)((IUINT64)rate * (IUINT32)elapsed / 
+			(1000 * kcp->tick));
+		credit += kcp->pacing_credit;
+		kcp->pacing_credit = (credit > 0x7fffffff)? 0x7fffffff : (IINT32)credit;
+		kcp->ts_pacing = current;
+	}
+
+	burst = _imax_(rate / 500, kcp->mtu * 2);
+	if (kcp->pacing_credit > (IINT32)burst) 
+		kcp->pacing_credit = (IINT32)burst;
+
+	kcp->pacing_rate = rate;
+}
+
+// out of pacing credit: the rest waits for ts_paced
+static int ikcp_pace_hold(ikcpcb *kcp, const IKCPSEG *segment)
+{
+	IUINT32 need = IKCP_OVERHEAD + segment->len, wait;
+
+	if (kcp->pacing == 0 || kcp->pacing_credit >= (IINT32)need) return 0;
+
+	need -= kcp->pacing_credit;
+	wait = (IUINT32)((IUINT64)need * 1000 * kcp->tick / 
+		_imax_(kcp->pacing_rate, 1));
+	kcp->paced = 1;
+	kcp->ts_paced = kcp->current + _imax_(wait, 1);
+	return 1;
+}
+
+// a segment sent before the mtu fell back, cut into pieces that fit
+static char *ikcp_flush_parts(ikcpcb *kcp, const IKCPSEG *segment, 
+	char *ptr)
+{
+	const char *data = IKCP_SEG_DATA(segment);
+	IUINT32 room = kcp->mtu - IKCP_OVERHEAD - IKCP_PART_HEAD;
+	IUINT32 offset, n;
+	IKCPSEG part;
+	int size;
+
+	part.conv = segment->conv;
+	part.cmd = IKCP_CMD_PART;
+	part.frg = kcp->caps;
+	part.wnd = segment->wnd;
+	part.ts = segment->ts;
+	part.sn = segment->sn;
+	part.una = segment->una;
+
+	for (offset = 0; offset < segment->len; offset += n) {
+		n = _imin_(room, segment->len - offset);
+		part.len = IKCP_PART_HEAD + n;
+		size = (int)(ptr - ikcp_obuf(kcp));
+		if (size + IKCP_OVERHEAD + part.len > kcp->mtu) {
+			ptr = ikcp_output_buf(kcp, size);
+		}
+		ptr = ikcp_encode_seg(ptr, &part);
+		ptr = ikcp_encode32u(ptr, offset);
+		ptr = ikcp_encode32u(ptr, segment->len);
+		ptr = ikcp_encode8u(ptr, (IUINT8)_imin_(segment->frg, 255));
+		memcpy(ptr, data + offset, n);
+		ptr += n;
+	}
+
+	return ptr;
+}
+
+// append one data segment to the flush buffer
+static char *ikcp_flush_data(ikcpcb *kcp, IKCPSEG *segment, char *ptr, 
+	IUINT32 wnd)
+{
+	int size = (int)(ptr - ikcp_obuf(kcp));
+	int need = IKCP_OVERHEAD + segment->len;
+
+	segment->ts = kcp->current;
+	segment->wnd = wnd;
+	segment->una = kcp->rcv_nxt;
+
+	if (need > (int)kcp->mtu) {
+		ptr = ikcp_flush_parts(kcp, segment, ptr);
+	}
+	else {
+		if (size + need > (int)kcp->mtu) {
+			ptr = ikcp_output_buf(kcp, size);
+		}
+
+		ptr = ikcp_encode_seg(ptr, segment);
+
+		if (segment->len > 0) {
+			memcpy(ptr, IKCP_SEG_DATA(segment), segment->len);
+			ptr += segment->len;
+		}
+	}
+
+	if (kcp->pacing) {
+		kcp->pacing_credit -= need;
+	}
+
+	if (segment->xmit >= kcp->dead_link) {
+		kcp->state = -1;
+	}
+
+	return ptr;
+}
+
+
+//---------------------------------------------------------------------
+// drop the message at the head of snd_queue
+//---------------------------------------------------------------------
+static void ikcp_drop_queued(ikcpcb *kcp)
+{
+	IUINT32 frg;
+	do {
+		IKCPSEG *seg = iqueue_entry(kcp->snd_queue.next, IKCPSEG, node);
+		iqueue_del(&seg->node);
+		// a buffer not cut yet holds the rest of its message
+		if (seg->cut > 0) {
+			kcp->nsnd_que -= seg->frg + 1;
+			frg = 0;
+		}	else {
+			kcp->nsnd_que--;
+			frg = seg->frg;
+		}
+		ikcp_segment_delete(kcp, seg);
+	}	while (frg != 0 && !iqueue_is_empty(&kcp->snd_queue));
+
+	kcp->snd_dropped++;
+}
+
+
 //---------------------------------------------------------------------
 // ikcp_flush
 //---------------------------------------------------------------------
 void ikcp_flush(ikcpcb *kcp)
 {
 	IUINT32 current = kcp->current;
-	char *buffer = kcp->buffer;
-	char *ptr = buffer;
+	char *ptr = ikcp_obuf(kcp);
 	int count, size, i;
 	IUINT32 resent, cwnd;
 	IUINT32 rtomin;
-	struct IQUEUEHEAD *p;
+	struct IQUEUEHEAD *p, *next;
 	int change = 0;
 	int lost = 0;
+	int blackhole = 0;
 	IKCPSEG seg;
 
 	// 'ikcp_update' haven't been called. 
 	if (kcp->updated == 0) return;
 
+	if (kcp->wnd_max > 0) {
+		ikcp_tune_snd(kcp);
+		ikcp_tune_rcv(kcp);
+	}
+
 	seg.conv = kcp->conv;
 	seg.cmd = IKCP_CMD_ACK;
-	seg.frg = 0;
+	seg.frg = kcp->caps;
 	seg.wnd = ikcp_wnd_unused(kcp);
 	seg.una = kcp->rcv_nxt;
 	seg.len = 0;
@@ -850,31 +2354,50 @@ void ikcp_flush(ikcpcb *kcp)
 
 	// flush acknowledges
 	count = kcp->ackcount;
-	for (i = 0; i < count; i++) {
-		size = (int)(ptr - buffer);
-		if (size + IKCP_OVERHEAD > (int)kcp->mtu) {
-			ikcp_output(kcp, buffer, size);
-			ptr = buffer;
+	if (count > 0 && kcp->ackdelay > 0 && ikcp_ack_hold(kcp)) {
+		count = 0;
+	}
+	else if (count > 0 && (kcp->caps & kcp->rmt_caps & IKCP_CAP_SACK)) {
+		ptr = ikcp_flush_sack(kcp, &seg, ptr);
+		seg.cmd = IKCP_CMD_ACK;
+		seg.len = 0;
+		if (kcp->ackdelay > 0) kcp->ack_suppressed += count - 1;
+		kcp->ackcount = 0;
+	}
+	else if (count > 0) {
+		for (i = 0; i < count; i++) {
+			IUINT32 sn;
+			ikcp_ack_get(kcp, i, &sn, NULL);
+			// in delayed mode una covers in-order acks, only the newest
+			// one is sent for its ts sample
+			if (kcp->ackdelay > 0 && i + 1 < count &&
+				_itimediff(sn, kcp->rcv_nxt) < 0) {
+				kcp->ack_suppressed++;
+				continue;
+			}
+			size = (int)(ptr - ikcp_obuf(kcp));
+			if (size + (int)IKCP_OVERHEAD > (int)ikcp_ctl_mtu(kcp)) {
+				ptr = ikcp_output_buf(kcp, size);
+			}
+			ikcp_ack_get(kcp, i, &seg.sn, &seg.ts);
+			ptr = ikcp_encode_seg(ptr, &seg);
 		}
-		ikcp_ack_get(kcp, i, &seg.sn, &seg.ts);
-		ptr = ikcp_encode_seg(ptr, &seg);
+		kcp->ackcount = 0;
 	}
 
-	kcp->ackcount = 0;
-
 	// probe window size (if remote window size equals zero)
 	if (kcp->rmt_wnd == 0) {
 		if (kcp->probe_wait == 0) {
-			kcp->probe_wait = IKCP_PROBE_INIT;
+			kcp->probe_wait = IKCP_PROBE_INIT * kcp->tick;
 			kcp->ts_probe = kcp->current + kcp->probe_wait;
 		}	
 		else {
 			if (_itimediff(kcp->current, kcp->ts_probe) >= 0) {
-				if (kcp->probe_wait < IKCP_PROBE_INIT) 
-					kcp->probe_wait = IKCP_PROBE_INIT;
+				if (kcp->probe_wait < IKCP_PROBE_INIT * kcp->tick) 
+					kcp->probe_wait = IKCP_PROBE_INIT * kcp->tick;
 				kcp->probe_wait += kcp->probe_wait / 2;
-				if (kcp->probe_wait > IKCP_PROBE_LIMIT)
-					kcp->probe_wait = IKCP_PROBE_LIMIT;
+				if (kcp->probe_wait > IKCP_PROBE_LIMIT * kcp->tick)
+					kcp->probe_wait = IKCP_PROBE_LIMIT * kcp->tick;
 				kcp->ts_probe = kcp->current + kcp->probe_wait;
 				kcp->probe |= IKCP_ASK_SEND;
 			}
@@ -887,10 +2410,9 @@ void ikcp_flush(ikcpcb *kcp)
 	// flush window probing commands
 	if (kcp->probe & IKCP_ASK_SEND) {
 		seg.cmd = IKCP_CMD_WASK;
-		size = (int)(ptr - buffer);
-		if (size + IKCP_OVERHEAD > (int)kcp->mtu) {
-			ikcp_output(kcp, buffer, size);
-			ptr = buffer;
+		size = (int)(ptr - ikcp_obuf(kcp));
+		if (size + IKCP_OVERHEAD > (int)ikcp_ctl_mtu(kcp)) {
+			ptr = ikcp_output_buf(kcp, size);
 		}
 		ptr = ikcp_encode_seg(ptr, &seg);
 	}
@@ -898,10 +2420,20 @@ void ikcp_flush(ikcpcb *kcp)
 	// flush window probing commands
 	if (kcp->probe & IKCP_ASK_TELL) {
 		seg.cmd = IKCP_CMD_WINS;
-		size = (int)(ptr - buffer);
-		if (size + IKCP_OVERHEAD > (int)kcp->mtu) {
-			ikcp_output(kcp, buffer, size);
-			ptr = buffer;
+		size = (int)(ptr - ikcp_obuf(kcp));
+		if (size + IKCP_OVERHEAD > (int)ikcp_ctl_mtu(kcp)) {
+			ptr = ikcp_output_buf(kcp, size);
+		}
+		ptr = ikcp_encode_seg(ptr, &seg);
+	}
+
+	// tell the size of the last mtu probe received
+	if (kcp->probe & IKCP_ASK_PMTU) {
+		seg.cmd = IKCP_CMD_PMTU;
+		seg.sn = kcp->pmtu_echo;
+		size = (int)(ptr - ikcp_obuf(kcp));
+		if ((IUINT32)size + IKCP_OVERHEAD > ikcp_ctl_mtu(kcp)) {
+			ptr = ikcp_output_buf(kcp, size);
 		}
 		ptr = ikcp_encode_seg(ptr, &seg);
 	}
@@ -913,14 +2445,46 @@ void ikcp_flush(ikcpcb *kcp)
 	if (kcp->nocwnd == 0) cwnd = _imin_(kcp->cwnd, cwnd);
 
 	// move data from snd_queue to snd_buf
-	while (_itimediff(kcp->snd_nxt, kcp->snd_una + cwnd) < 0) {
+	while (_itimediff(kcp->snd_nxt, kcp->snd_una + cwnd) < 0 &&
+		_itimediff(kcp->snd_nxt, kcp->snd_una + kcp->rto_heap_size) < 0) {
 		IKCPSEG *newseg;
 		if (iqueue_is_empty(&kcp->snd_queue)) break;
 
 		newseg = iqueue_entry(kcp->snd_queue.next, IKCPSEG, node);
 
-		iqueue_del(&newseg->node);
-		iqueue_add_tail(&newseg->node, &kcp->snd_buf);
+		// hold long messages until the remote has advertised XFRAG,
+		// drop them if it can not reassemble them
+		if (newseg->frg > 255 &&
+			(kcp->caps & kcp->rmt_caps & IKCP_CAP_XFRAG) == 0) {
+			if (kcp->rmt_caps_seen == 0) {
+				kcp->probe |= IKCP_ASK_SEND;
+				break;
+			}
+			ikcp_drop_queued(kcp);
+			continue;
+		}
+
+		// the next segment of a referenced buffer, the rest stays queued
+		if (newseg->cut > 0 && newseg->len > newseg->cut) {
+			IKCPSEG *part = ikcp_segment_new(kcp, 0);
+			if (part == NULL) break;
+			kcp->ref_retain(newseg->ref, kcp, kcp->user);
+			part->ref = newseg->ref;
+			part->ext = newseg->ext;
+			part->len = newseg->cut;
+			part->cut = 0;
+			part->frg = newseg->frg;
+			iqueue_init(&part->node);
+			newseg->ext += newseg->cut;
+			newseg->len -= newseg->cut;
+			if (newseg->frg > 0) newseg->frg--;
+			newseg = part;
+		}	else {
+			iqueue_del_init(&newseg->node);
+			newseg->cut = 0;
+		}
+
+		IKCP_SND_SLOT(kcp, kcp->snd_nxt) = newseg;
 		kcp->nsnd_que--;
 		kcp->nsnd_buf++;
 
@@ -936,87 +2500,145 @@ void ikcp_flush(ikcpcb *kcp)
 		newseg->xmit = 0;
 	}
 
+	// a window held data back, let the tuner grow it
+	if (kcp->wnd_max > 0 && !iqueue_is_empty(&kcp->snd_queue) &&
+		_itimediff(kcp->snd_nxt, kcp->snd_una + cwnd) >= 0) {
+		if (cwnd == kcp->snd_wnd) kcp->snd_limited |= IKCP_WND_BY_SND;
+		if (cwnd == kcp->rmt_wnd) kcp->snd_limited |= IKCP_WND_BY_RMT;
+	}
+
 	// calculate resent
 	resent = (kcp->fastresend > 0)? (IUINT32)kcp->fastresend : 0xffffffff;
 	rtomin = (kcp->nodelay == 0)? (kcp->rx_rto >> 3) : 0;
 
-	// flush data segments
-	for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = p->next) {
+	kcp->paced = 0;
+	if (kcp->pacing) {
+		ikcp_pace(kcp, cwnd);
+	}
+
+	if (_itimediff(kcp->snd_fresh, kcp->snd_una) < 0) {
+		kcp->snd_fresh = kcp->snd_una;
+	}
+
+	// reorder windows passed since the last ack
+	if (kcp->rack && kcp->rack_wait && 
+		_itimediff(current, kcp->ts_rack) >= 0) {
+		ikcp_rack_detect(kcp);
+	}
+
+	// fast retransmit, a segment also timed out is left to the timer
+	for (p = kcp->fast_queue.next; p != &kcp->fast_queue; p = next) {
 		IKCPSEG *segment = iqueue_entry(p, IKCPSEG, node);
-		int needsend = 0;
-		if (segment->xmit == 0) {
-			needsend = 1;
-			segment->xmit++;
-			segment->rto = kcp->rx_rto;
-			segment->resendts = current + segment->rto + rtomin;
-		} else if (_itimediff(current, segment->resendts) >= 0) {
-			needsend = 1;
-			segment->xmit++;
-			kcp->xmit++;
-			if (kcp->nodelay == 0) {
-				segment->rto += kcp->rx_rto;
-			} else {
-				segment->rto += kcp->rx_rto / 2;
-			}
-			segment->resendts = current + segment->rto;
-			lost = 1;
-		} else if (segment->fastack >= resent) {
-			needsend = 1;
-			segment->xmit++;
-			segment->fastack = 0;
-			segment->resendts = current + segment->rto;
-			change++;
+		next = p->next;
+		if (kcp->rack == 0 && segment->fastack < resent) {
+			iqueue_del_init(p);
+			continue;
 		}
+		if (_itimediff(current, segment->resendts) >= 0) continue;
+		if (ikcp_pace_hold(kcp, segment)) break;
 
-		if (needsend) {
-			int size, need;
-			segment->ts = current;
-			segment->wnd = seg.wnd;
-			segment->una = kcp->rcv_nxt;
+		iqueue_del_init(p);
+		segment->xmit++;
+		segment->fastack = kcp->rack;	// rack marks its own resends
 
-			size = (int)(ptr - buffer);
-			need = IKCP_OVERHEAD + segment->len;
+		segment->resendts = current + segment->rto;
+		ikcp_heap_update(kcp, segment);
+		change++;
+		ptr = ikcp_flush_data(kcp, segment, ptr, seg.wnd);
+	}
 
-			if (size + need > (int)kcp->mtu) {
-				ikcp_output(kcp, buffer, size);
-				ptr = buffer;
-			}
+	// retransmit timed out segments, earliest first
+	while (kcp->paced == 0 && kcp->rto_heap_len > 0) {
+		IKCPSEG *segment = kcp->rto_heap[0];
+		if (_itimediff(current, segment->resendts) < 0) break;
+		if (ikcp_pace_hold(kcp, segment)) break;
 
-			ptr = ikcp_encode_seg(ptr, segment);
+		segment->xmit++;
+		kcp->xmit++;
+		if (kcp->nodelay == 0) {
+			segment->rto += kcp->rx_rto;
+		} else {
+			segment->rto += kcp->rx_rto / 2;
+		}
+		segment->resendts = current + segment->rto;
+		ikcp_heap_down(kcp, segment);
+		if (kcp->rack) {
+			iqueue_del_init(&segment->node);
+			segment->fastack = 0;
+		}
+		if (kcp->tlp) {
+			if (kcp->tlp_out) kcp->tlp_out = IKCP_TLP_REARMED;
+			ikcp_tlp_arm(kcp);
+		}
+		lost = 1;
+		kcp->pmtu_lost++;
+		// a resend of an older mtu failing once more is not enough, the
+		// timeouts must pile up at this one with snd_una stuck
+		if (segment->xmit > IKCP_PMTU_BLACKHOLE && 
+			kcp->pmtu_lost > IKCP_PMTU_BLACKHOLE && kcp->pmtu_max > 0 &&
+			(kcp->caps & kcp->rmt_caps & IKCP_CAP_PMTU) &&
+			kcp->mtu > ikcp_pmtu_floor(kcp)) {
+			blackhole = 1;
+		}
+		ptr = ikcp_flush_data(kcp, segment, ptr, seg.wnd);
+	}
 
-			if (segment->len > 0) {
-				memcpy(ptr, segment->data, segment->len);
-				ptr += segment->len;
-			}
+	// first transmission
+	for (; kcp->paced == 0 && kcp->snd_fresh != kcp->snd_nxt; kcp->snd_fresh++) {
+		IKCPSEG *segment = IKCP_SND_SLOT(kcp, kcp->snd_fresh);
+		if (segment == NULL) continue;
+		if (ikcp_pace_hold(kcp, segment)) break;
+
+		segment->xmit++;
+		segment->rto = kcp->rx_rto;
+		segment->resendts = current + segment->rto + rtomin;
+		ikcp_heap_push(kcp, segment);
+		ptr = ikcp_flush_data(kcp, segment, ptr, seg.wnd);
+		if (kcp->tlp) ikcp_tlp_arm(kcp);
+	}
 
-			if (segment->xmit >= kcp->dead_link) {
-				kcp->state = -1;
-			}
+	// no ack for a while: probe with the newest segment in flight rather
+	// than leave a lost tail to its rto
+	if (kcp->tlp && kcp->tlp_out != IKCP_TLP_OUT && kcp->paced == 0 && 
+		kcp->nsnd_buf > 0 && _itimediff(current, kcp->ts_tlp) >= 0) {
+		IKCPSEG *segment = NULL;
+		IUINT32 sn = kcp->snd_fresh;
+		while (segment == NULL && sn != kcp->snd_una) {
+			segment = IKCP_SND_SLOT(kcp, --sn);
+		}
+		if (segment != NULL) {
+			segment->xmit++;
+			segment->fastack = 0;
+			ptr = ikcp_flush_data(kcp, segment, ptr, seg.wnd);
+			kcp->tlp_out = IKCP_TLP_OUT;
+			kcp->tlp_sn = segment->sn;
+			kcp->tlp_ts = current;
+			kcp->tlp_sent++;
 		}
 	}
 
 	// flash remain segments
-	size = (int)(ptr - buffer);
+	size = (int)(ptr - ikcp_obuf(kcp));
 	if (size > 0) {
-		ikcp_output(kcp, buffer, size);
+		ikcp_output_buf(kcp, size);
 	}
 
-	// update ssthresh
-	if (change) {
-		IUINT32 inflight = kcp->snd_nxt - kcp->snd_una;
-		kcp->ssthresh = inflight / 2;
-		if (kcp->ssthresh < IKCP_THRESH_MIN)
-			kcp->ssthresh = IKCP_THRESH_MIN;
-		kcp->cwnd = kcp->ssthresh + resent;
-		kcp->incr = kcp->cwnd * kcp->mss;
+	if (blackhole) {
+		ikcp_pmtu_fallback(kcp);
 	}
 
-	if (lost) {
-		kcp->ssthresh = cwnd / 2;
-		if (kcp->ssthresh < IKCP_THRESH_MIN)
-			kcp->ssthresh = IKCP_THRESH_MIN;
-		kcp->cwnd = 1;
-		kcp->incr = kcp->mss;
+	if (kcp->pmtu_max > 0 && (kcp->caps & kcp->rmt_caps & IKCP_CAP_PMTU)) {
+		ikcp_flush_pmtu(kcp, &seg);
+	}
+
+	// update congestion window
+	if (change && kcp->cc->on_fastresend) {
+		kcp->cc->on_fastresend(kcp, kcp->snd_nxt - kcp->snd_una, 
+			kcp->rack? (IUINT32)change : resent);
+	}
+
+	if (lost && kcp->cc->on_timeout) {
+		kcp->cc->on_timeout(kcp, cwnd);
 	}
 
 	if (kcp->cwnd < 1) {
@@ -1033,7 +2655,7 @@ void ikcp_flush(ikcpcb *kcp)
 //---------------------------------------------------------------------
 void ikcp_update(ikcpcb *kcp, IUINT32 current)
 {
-	IINT32 slap;
+	IINT32 slap, limit = (IINT32)(10000 * kcp->tick);
 
 	kcp->current = current;
 
@@ -1044,7 +2666,7 @@ void ikcp_update(ikcpcb *kcp, IUINT32 current)
 
 	slap = _itimediff(kcp->current, kcp->ts_flush);
 
-	if (slap >= 10000 || slap < -10000) {
+	if (slap >= limit || slap < -limit) {
 		kcp->ts_flush = kcp->current;
 		slap = 0;
 	}
@@ -1056,6 +2678,9 @@ void ikcp_update(ikcpcb *kcp, IUINT32 current)
 		}
 		ikcp_flush(kcp);
 	}
+	else if (kcp->paced && _itimediff(kcp->current, kcp->ts_paced) >= 0) {
+		ikcp_flush(kcp);
+	}
 }
 
 
@@ -1074,14 +2699,14 @@ IUINT32 ikcp_check(const ikcpcb *kcp, IUINT32 current)
 	IINT32 tm_flush = 0x7fffffff;
 	IINT32 tm_packet = 0x7fffffff;
 	IUINT32 minimal = 0;
-	struct IQUEUEHEAD *p;
+	IINT32 limit = (IINT32)(10000 * kcp->tick);
 
 	if (kcp->updated == 0) {
 		return current;
 	}
 
-	if (_itimediff(current, ts_flush) >= 10000 ||
-		_itimediff(current, ts_flush) < -10000) {
+	if (_itimediff(current, ts_flush) >= limit ||
+		_itimediff(current, ts_flush) < -limit) {
 		ts_flush = current;
 	}
 
@@ -1091,12 +2716,29 @@ IUINT32 ikcp_check(const ikcpcb *kcp, IUINT32 current)
 
 	tm_flush = _itimediff(ts_flush, current);
 
-	for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = p->next) {
-		const IKCPSEG *seg = iqueue_entry(p, const IKCPSEG, node);
-		IINT32 diff = _itimediff(seg->resendts, current);
-		if (diff <= 0) {
+	if (kcp->paced) {
+		IINT32 diff = _itimediff(kcp->ts_paced, current);
+		if (diff <= 0) return current;
+		if (diff < tm_flush) tm_flush = diff;
+	}
+
+	// unsent segments are covered by ts_flush or ts_paced
+	if (kcp->rto_heap_len > 0) {
+		tm_packet = _itimediff(kcp->rto_heap[0]->resendts, current);
+		if (tm_packet <= 0) {
 			return current;
 		}
+	}
+
+	if (kcp->rack && kcp->rack_wait) {
+		IINT32 diff = _itimediff(kcp->ts_rack, current);
+		if (diff <= 0) return current;
+		if (diff < tm_packet) tm_packet = diff;
+	}
+
+	if (kcp->tlp && kcp->tlp_out != IKCP_TLP_OUT && kcp->nsnd_buf > 0) {
+		IINT32 diff = _itimediff(kcp->ts_tlp, current);
+		if (diff <= 0) return current;
 		if (diff < tm_packet) tm_packet = diff;
 	}
 
@@ -1107,26 +2749,75 @@ IUINT32 ikcp_check(const ikcpcb *kcp, IUINT32 current)
 }
 
 
+void ikcp_setvec(ikcpcb *kcp, char **bufs, int *lens, int count)
+{
+	if (bufs == NULL || lens == NULL || count <= 0) {
+		bufs = NULL;
+		lens = NULL;
+		count = 0;
+	}
+	kcp->vec_bufs = bufs;
+	kcp->vec_lens = lens;
+	kcp->vec_size = count;
+	kcp->nvec = 0;
+}
+
+int ikcp_takevec(ikcpcb *kcp)
+{
+	int count = kcp->nvec;
+	kcp->nvec = 0;
+	return count;
+}
+
+
 int ikcp_setmtu(ikcpcb *kcp, int mtu)
 {
 	char *buffer;
 	if (mtu < 50 || mtu < (int)IKCP_OVERHEAD) 
 		return -1;
-	buffer = (char*)ikcp_malloc((mtu + IKCP_OVERHEAD) * 3);
+	// room for mtu probes up to pmtu_max
+	buffer = (char*)ikcp_malloc((_imax_((IUINT32)mtu, kcp->pmtu_max) + 
+		IKCP_OVERHEAD) * 3);
 	if (buffer == NULL) 
 		return -2;
 	kcp->mtu = mtu;
 	kcp->mss = kcp->mtu - IKCP_OVERHEAD;
 	ikcp_free(kcp->buffer);
 	kcp->buffer = buffer;
+	kcp->pmtu_base = kcp->mtu;
+	kcp->pmtu_lo = kcp->mtu;
+	kcp->pmtu_hi = _imax_(kcp->mtu, kcp->pmtu_max);
+	kcp->pmtu_probe = 0;
+	kcp->ts_pmtu = kcp->current;
+	return 0;
+}
+
+int ikcp_pmtud(ikcpcb *kcp, int max_mtu, int min_mtu)
+{
+	IUINT32 old_max = kcp->pmtu_max, old_min = kcp->pmtu_min;
+	int raise = max_mtu > (int)kcp->pmtu_base;
+	int lower = min_mtu > 0 && min_mtu < (int)kcp->pmtu_base;
+	if (lower && (min_mtu < 50 || min_mtu < (int)IKCP_OVERHEAD))
+		return -1;
+	kcp->pmtu_max = raise? (IUINT32)max_mtu : lower? kcp->pmtu_base : 0;
+	kcp->pmtu_min = lower? (IUINT32)min_mtu : 0;
+	if (ikcp_setmtu(kcp, (int)kcp->pmtu_base) < 0) {
+		kcp->pmtu_max = old_max;
+		kcp->pmtu_min = old_min;
+		return -2;
+	}
 	return 0;
 }
 
+static IUINT32 ikcp_bound_interval(const ikcpcb *kcp, int interval)
+{
+	IUINT32 lower = (kcp->tick > 1)? IKCP_INTERVAL_MIN_US : IKCP_INTERVAL_MIN;
+	return _ibound_(lower, (interval > 0)? (IUINT32)interval : 0, 5000 * kcp->tick);
+}
+
 int ikcp_interval(ikcpcb *kcp, int interval)
 {
-	if (interval > 5000) interval = 5000;
-	else if (interval < 10) interval = 10;
-	kcp->interval = interval;
+	kcp->interval = ikcp_bound_interval(kcp, interval);
 	return 0;
 }
 
@@ -1135,16 +2826,14 @@ int ikcp_nodelay(ikcpcb *kcp, int nodelay, int interval, int resend, int nc)
 	if (nodelay >= 0) {
 		kcp->nodelay = nodelay;
 		if (nodelay) {
-			kcp->rx_minrto = IKCP_RTO_NDL;	
+			kcp->rx_minrto = IKCP_RTO_NDL * kcp->tick;	
 		}	
 		else {
-			kcp->rx_minrto = IKCP_RTO_MIN;
+			kcp->rx_minrto = IKCP_RTO_MIN * kcp->tick;
 		}
 	}
 	if (interval >= 0) {
-		if (interval > 5000) interval = 5000;
-		else if (interval < 10) interval = 10;
-		kcp->interval = interval;
+		kcp->interval = ikcp_bound_interval(kcp, interval);
 	}
 	if (resend >= 0) {
 		kcp->fastresend = resend;
@@ -1156,19 +2845,120 @@ int ikcp_nodelay(ikcpcb *kcp, int nodelay, int interval, int resend, int nc)
 }
 
 
+int ikcp_ackdelay(ikcpcb *kcp, int delay, int count)
+{
+	if (delay < 0 || count < 0)
+		return -1;
+	if (delay > (int)(5000 * kcp->tick)) delay = (int)(5000 * kcp->tick);
+	kcp->ackdelay = delay;
+	kcp->ackmax = count;
+	return 0;
+}
+
+int ikcp_setcaps(ikcpcb *kcp, int caps)
+{
+	int old = (int)kcp->caps;
+	kcp->caps = (IUINT32)caps & 0xff;
+	kcp->caps_tell = (kcp->caps != 0)? IKCP_CAPS_TELL : 0;
+	return old;
+}
+
+int ikcp_setclock(ikcpcb *kcp, int microseconds)
+{
+	IUINT32 tick = microseconds? 1000 : 1;
+	if (kcp->updated) 
+		return -1;
+	if (tick != kcp->tick) {
+		kcp->interval = kcp->interval / kcp->tick * tick;
+		kcp->ts_flush = kcp->interval;
+		kcp->rx_minrto = kcp->rx_minrto / kcp->tick * tick;
+		kcp->rx_rto = kcp->rx_rto / kcp->tick * tick;
+		kcp->ackdelay = kcp->ackdelay / kcp->tick * tick;
+		kcp->tick = tick;
+	}
+	return 0;
+}
+
+int ikcp_pacing(ikcpcb *kcp, int enable)
+{
+	kcp->pacing = enable? 1 : 0;
+	kcp->pacing_rate = 0;
+	kcp->paced = 0;
+	return 0;
+}
+
+int ikcp_rack(ikcpcb *kcp, int enable)
+{
+	kcp->rack = enable? 1 : 0;
+	kcp->rack_seen = 0;
+	kcp->rack_wait = 0;
+	kcp->rack_reo = 1;
+	kcp->rack_persist = 0;
+	return 0;
+}
+
+int ikcp_tlp(ikcpcb *kcp, int enable)
+{
+	kcp->tlp = enable? 1 : 0;
+	kcp->tlp_out = 0;
+	ikcp_tlp_arm(kcp);
+	return 0;
+}
+
+int ikcp_setcc(ikcpcb *kcp, const struct IKCPCC *cc)
+{
+	if (cc == NULL) cc = &ikcp_cc_reno;
+	if (kcp->cc->release) {
+		kcp->cc->release(kcp);
+	}
+	kcp->cc = cc;
+	kcp->cc_state = NULL;
+	if (cc->init && cc->init(kcp) < 0) {
+		kcp->cc = &ikcp_cc_reno;
+		ikcp_reno_init(kcp);
+		return -1;
+	}
+	return 0;
+}
+
 int ikcp_wndsize(ikcpcb *kcp, int sndwnd, int rcvwnd)
 {
 	if (kcp) {
 		if (sndwnd > 0) {
+			if (ikcp_snd_reserve(kcp, sndwnd))
+				return -2;
 			kcp->snd_wnd = sndwnd;
+			kcp->snd_wnd_min = sndwnd;
 		}
 		if (rcvwnd > 0) {
+			if (ikcp_ring_reserve(&kcp->rcv_buf, &kcp->rcv_buf_size, rcvwnd))
+				return -2;
 			kcp->rcv_wnd = rcvwnd;
+			kcp->rcv_wnd_min = rcvwnd;
+			kcp->rcv_shrink = 0;
 		}
 	}
 	return 0;
 }
 
+int ikcp_wndtune(ikcpcb *kcp, IUINT32 max_bytes)
+{
+	kcp->wnd_max = max_bytes;
+	kcp->ts_snd_tune = kcp->current;
+	kcp->ts_rcv_tune = kcp->current;
+	kcp->snd_delivered = 0;
+	kcp->snd_bdp = 0;
+	kcp->snd_limited = 0;
+	kcp->rcv_count = 0;
+	kcp->rcv_asked = 0;
+	kcp->rcv_shrink = 0;
+	if (max_bytes == 0) {
+		kcp->snd_wnd = kcp->snd_wnd_min;
+		kcp->rcv_wnd = kcp->rcv_wnd_min;
+	}
+	return 0;
+}
+
 int ikcp_waitsnd(const ikcpcb *kcp)
 {
 	return kcp->nsnd_buf + kcp->nsnd_que;
@@ -268,9 +268,15 @@ struct IKCPSEG
 	IUINT32 rto;
 	IUINT32 fastack;
 	IUINT32 xmit;
+	IUINT32 heap;		// index in kcp->rto_heap once sent
+	IUINT32 cut;		// queued 'ref' payload cut into segments of this size as sent
+	void *ref;			// owner of 'ext', NULL if payload is inline
+	const char *ext;
 	char data[1];
 };
 
+#define IKCP_SEG_DATA(seg) ((seg)->ref ? (seg)->ext : (const char*)(seg)->data)
+
 
 //---------------------------------------------------------------------
 // IKCPCB
@@ -283,6 +289,8 @@ struct IKCPCB
 	IINT32 rx_rttval, rx_srtt, rx_rto, rx_minrto;
 	IUINT32 snd_wnd, rcv_wnd, rmt_wnd, cwnd, probe;
 	IUINT32 current, interval, ts_flush, xmit;
+	// clock units per millisecond, 1000 in microsecond mode
+	IUINT32 tick;
 	IUINT32 nrcv_buf, nsnd_buf;
 	IUINT32 nrcv_que, nsnd_que;
 	IUINT32 nodelay, updated;
@@ -290,23 +298,117 @@ struct IKCPCB
 	IUINT32 dead_link, incr;
 	struct IQUEUEHEAD snd_queue;
 	struct IQUEUEHEAD rcv_queue;
-	struct IQUEUEHEAD snd_buf;
-	struct IQUEUEHEAD rcv_buf;
+	// rings indexed by sn, capacity is a power of two >= window
+	struct IKCPSEG **snd_buf;
+	struct IKCPSEG **rcv_buf;
+	IUINT32 snd_buf_size, rcv_buf_size;
+	// retransmission timers: sent segments of snd_buf are kept in a
+	// min-heap on resendts, the ones due by fastack on fast_queue and
+	// snd_fresh is the first sn not sent yet
+	struct IKCPSEG **rto_heap;
+	IUINT32 rto_heap_len, rto_heap_size, snd_fresh;
+	struct IQUEUEHEAD fast_queue;
 	IUINT32 *acklist;
 	IUINT32 ackcount;
 	IUINT32 ackblock;
+	IUINT32 caps, rmt_caps, caps_tell, rmt_caps_seen;
+	// long messages dropped unsent once the remote showed no XFRAG
+	IUINT32 snd_dropped;
+	IUINT32 ackdelay, ackmax, ts_ack, ack_suppressed;
+	// pacer: data segments spend byte credit refilled at pacing_rate
+	// (bytes/s), paced is set while a flush waits for ts_paced
+	IUINT32 pacing, pacing_rate, ts_pacing, paced, ts_paced;
+	IINT32 pacing_credit;
+	// path mtu discovery: pmtu_lo is the largest size confirmed, probes
+	// of pmtu_probe bytes search up to pmtu_hi. pmtu_base is the mtu set
+	// by hand, pmtu_min the floor a black hole falls back to, pmtu_echo
+	// the probe size the remote is owed an answer for. pmtu_lost counts
+	// timeouts since snd_una or the mtu last moved
+	IUINT32 pmtu_base, pmtu_min, pmtu_max, pmtu_lo, pmtu_hi, pmtu_probe;
+	IUINT32 pmtu_tries, ts_pmtu, pmtu_echo, pmtu_lost;
+	// a segment arriving in pieces after the remote lowered its mtu,
+	// rcv_part_len bytes of it in order so far
+	struct IKCPSEG *rcv_part;
+	IUINT32 rcv_part_len;
+	// window auto-tuning above the ikcp_wndsize windows up to wnd_max
+	// bytes: snd_wnd follows twice the segments delivered per min rtt,
+	// rcv_wnd doubles when the remote asks with a WASK while it is full
+	IUINT32 wnd_max, snd_wnd_min, rcv_wnd_min;
+	IUINT32 ts_snd_tune, snd_delivered, snd_bdp, snd_limited;
+	IUINT32 rtt_min, ts_rtt_min;
+	IUINT32 ts_rcv_tune, rcv_tune_sn, rcv_count, rcv_asked;
+	// a shrink advertises rcv_shrink at once but keeps rcv_nxt + rcv_wnd
+	// at rcv_edge until rcv_nxt catches up, so segments sent under the
+	// old window are still accepted
+	IUINT32 rcv_shrink, rcv_edge;
+	// rack loss detection: rack_ts/rack_sn is the newest transmission
+	// acked and rack_rtt its rtt. one sent before it is lost once
+	// rack_rtt plus rack_reo quarters of min rtt have passed, ts_rack is
+	// when the next one still inside expires if rack_wait is set.
+	// spurious resends widen rack_reo for rack_persist loss rounds
+	IUINT32 rack, rack_ts, rack_sn, rack_rtt, rack_seen;
+	IUINT32 rack_wait, ts_rack, rack_reo, rack_persist;
+	// tail loss probe: with no ack by ts_tlp the last segment in flight
+	// is resent as tlp_sn at tlp_ts, once until answered or an rto. the
+	// ack echoing the probe's ts counts it needed, one echoing the
+	// original spurious
+	IUINT32 tlp, ts_tlp, tlp_out, tlp_sn, tlp_ts;
+	IUINT32 tlp_sent, tlp_needed, tlp_spurious;
 	void *user;
 	char *buffer;
+	// vectored output: flushes encode into vec_bufs, nvec of them are
+	// filled with vec_lens bytes
+	char **vec_bufs;
+	int *vec_lens;
+	int vec_size, nvec;
 	int fastresend;
 	int nocwnd;
+	// stream mode: sends append to the tail of snd_queue up to mss and
+	// all segments have frg 0. stream_cap is the tail's payload capacity
+	int stream, stream_cap;
 	int logmask;
 	int (*output)(const char *buf, int len, struct IKCPCB *kcp, void *user);
 	void (*writelog)(const char *log, struct IKCPCB *kcp, void *user);
+	void* (*seg_malloc)(size_t size, struct IKCPCB *kcp, void *user);
+	void (*seg_free)(void *ptr, struct IKCPCB *kcp, void *user);
+	void (*ref_retain)(void *ref, struct IKCPCB *kcp, void *user);
+	void (*ref_release)(void *ref, struct IKCPCB *kcp, void *user);
+	const struct IKCPCC *cc;
+	void *cc_state;
 };
 
 
 typedef struct IKCPCB ikcpcb;
 
+
+//---------------------------------------------------------------------
+// congestion control: maintains kcp->cwnd (segments in flight)
+//---------------------------------------------------------------------
+struct IKCPCC
+{
+	const char *name;
+	// set up cc_state, returns below zero for error
+	int (*init)(ikcpcb *kcp);
+	void (*release)(ikcpcb *kcp);
+	// after input: una_acked segments left by snd_una, delivered
+	// segments acked in total, rtt the newest sample or -1
+	void (*on_ack)(ikcpcb *kcp, IUINT32 una_acked, IUINT32 delivered,
+		IINT32 rtt);
+	// after flush retransmitted by fastack
+	void (*on_fastresend)(ikcpcb *kcp, IUINT32 inflight, IUINT32 resent);
+	// after flush retransmitted by timeout, window used by that flush
+	void (*on_timeout)(ikcpcb *kcp, IUINT32 window);
+	// bytes per second for the pacer, NULL or 0 for cwnd over srtt
+	IUINT32 (*pacing_rate)(ikcpcb *kcp);
+};
+
+// reno-like default: slow start, additive increase, collapse on timeout
+extern const struct IKCPCC ikcp_cc_reno;
+
+// bbr-like: cwnd from a bottleneck bandwidth and min rtt model, random
+// loss does not shrink it
+extern const struct IKCPCC ikcp_cc_bbr;
+
 #define IKCP_LOG_OUTPUT			1
 #define IKCP_LOG_INPUT			2
 #define IKCP_LOG_SEND			4
@@ -320,6 +422,17 @@ typedef struct IKCPCB ikcpcb;
 #define IKCP_LOG_OUT_PROBE		1024
 #define IKCP_LOG_OUT_WINS		2048
 
+// protocol extensions, advertised in 'frg' of non-data segments and only
+// used once both sides have them enabled
+#define IKCP_CAP_SACK			1
+// messages over 255 fragments: 'frg' saturates at 255 and only 0 marks
+// the last fragment, read them with ikcp_recv_fragments. one queued
+// before the remote's caps were seen is dropped and counted in
+// snd_dropped if the remote turns out not to have it
+#define IKCP_CAP_XFRAG			2
+// path mtu probes: padded segments echoed back by size
+#define IKCP_CAP_PMTU			4
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -339,9 +452,29 @@ void ikcp_release(ikcpcb *kcp);
 // user/upper level recv: returns size, returns below zero for EAGAIN
 int ikcp_recv(ikcpcb *kcp, char *buffer, int len);
 
+// user/upper level recv without reassembly: moves the segments of the
+// next message to list, read them with IKCP_SEG_DATA. returns size,
+// returns below zero for EAGAIN
+int ikcp_recv_segments(ikcpcb *kcp, struct IQUEUEHEAD *list);
+
+// user/upper level recv for messages larger than rcv_wnd: appends the
+// fragments of the next message received so far to list, *more stays
+// nonzero until the last one. returns size, below zero for EAGAIN
+int ikcp_recv_fragments(ikcpcb *kcp, struct IQUEUEHEAD *list, int *more);
+
+// release segments taken by ikcp_recv_segments/ikcp_recv_fragments
+void ikcp_free_segments(ikcpcb *kcp, struct IQUEUEHEAD *list);
+
 // user/upper level send, returns below zero for error
 int ikcp_send(ikcpcb *kcp, const char *buffer, int len);
 
+// send without copying, segments point into 'buffer' until they are acked.
+// the buffer is queued whole and cut as the window lets segments out, so
+// only those in flight cost a segment. 'ref' owns the buffer:
+// kcp->ref_retain is called for every segment made and kcp->ref_release
+// when that segment is freed. returns below zero for error
+int ikcp_send_ref(ikcpcb *kcp, const char *buffer, int len, void *ref);
+
 // update state (call it repeatedly, every 10ms-100ms), or you can ask 
 // ikcp_check when to call it again (without ikcp_input/_send calling).
 // 'current' - current timestamp in millisec. 
@@ -359,9 +492,24 @@ IUINT32 ikcp_check(const ikcpcb *kcp, IUINT32 current);
 // when you received a low level packet (eg. UDP packet), call it
 int ikcp_input(ikcpcb *kcp, const char *data, long size);
 
+// input count packets at once: fastack and the congestion window are
+// updated once per batch. returns the error of the first bad packet,
+// the others are still taken
+int ikcp_input_batch(ikcpcb *kcp, const char * const *data, 
+	const long *size, int count);
+
 // flush pending data
 void ikcp_flush(ikcpcb *kcp);
 
+// vectored output: flushes encode straight into the 'count' caller
+// buffers (mtu bytes each) instead of calling output per datagram. once
+// all are in use they go through output and are reused. count 0 turns
+// it off, datagrams not taken yet are dropped
+void ikcp_setvec(ikcpcb *kcp, char **bufs, int *lens, int count);
+
+// datagrams filled since the last call, lengths in 'lens' of setvec
+int ikcp_takevec(ikcpcb *kcp);
+
 // check the size of next message in the recv queue
 int ikcp_peeksize(const ikcpcb *kcp);
 
@@ -369,11 +517,58 @@ int ikcp_peeksize(const ikcpcb *kcp);
 int ikcp_setmtu(ikcpcb *kcp, int mtu);
 
 // set maximum window size: sndwnd=32, rcvwnd=32 by default
+// returns below zero if the send/recv rings can not grow
 int ikcp_wndsize(ikcpcb *kcp, int sndwnd, int rcvwnd);
 
+// window auto-tuning: snd_wnd and rcv_wnd grow from the ikcp_wndsize
+// ones with the measured bandwidth-delay product and shrink back when
+// idle, each up to 'max_bytes' of payload. 0 disables
+int ikcp_wndtune(ikcpcb *kcp, IUINT32 max_bytes);
+
 // get how many packet is waiting to be sent
 int ikcp_waitsnd(const ikcpcb *kcp);
 
+// delayed ack: hold in-order acks up to 'delay' millisec (rounded up to
+// the flush interval) or 'count' pending acks, then send una plus the
+// newest sn/ts sample. out-of-order acks are never held. delay=0 disables
+int ikcp_ackdelay(ikcpcb *kcp, int delay, int count);
+
+// enable protocol extensions (IKCP_CAP_*), returns the previous set
+int ikcp_setcaps(ikcpcb *kcp, int caps);
+
+// microsecond clock: 'current', interval, rto, ackdelay and every other
+// time given to or kept by kcp is in microseconds. the remote only echoes
+// 'ts', so it needs no such mode. call it before ikcp_update, returns
+// below zero for error
+int ikcp_setclock(ikcpcb *kcp, int microseconds);
+
+// spread data segments over the rtt instead of bursting the window,
+// ikcp_check reports the pacing deadlines
+int ikcp_pacing(ikcpcb *kcp, int enable);
+
+// path mtu discovery (IKCP_CAP_PMTU): probes search from the mtu up to
+// 'max_mtu' and the mtu follows the largest size echoed back. when
+// segments keep timing out it falls back to 'min_mtu', below the mtu set
+// by hand for paths that do not carry it, and searches up from there.
+// segments already larger than the mtu are resent in pieces. output
+// buffers must hold max_mtu bytes. 0 for both disables, 0 for min_mtu
+// never goes below the mtu. returns below zero for error
+int ikcp_pmtud(ikcpcb *kcp, int max_mtu, int min_mtu);
+
+// rack loss detection in place of fastack counting: a segment is resent
+// when one sent after it has been acked and a reorder window of a
+// quarter min rtt has passed. the fastresend count is then unused
+int ikcp_rack(ikcpcb *kcp, int enable);
+
+// tail loss probe: resend the last segment in flight once after 2*srtt
+// without acks instead of waiting for its rto. tlp_sent, tlp_needed and
+// tlp_spurious count the probes
+int ikcp_tlp(ikcpcb *kcp, int enable);
+
+// switch congestion control, NULL for ikcp_cc_reno.
+// returns below zero for error
+int ikcp_setcc(ikcpcb *kcp, const struct IKCPCC *cc);
+
 // fastest: ikcp_nodelay(kcp, 1, 20, 2, 1)
 // nodelay: 0:disable(default), 1:enable
 // interval: internal update timer interval in millisec, default is 100ms 
@@ -389,6 +584,12 @@ void ikcp_log(ikcpcb *kcp, int mask, const char *fmt, ...);
 // setup allocator
 void ikcp_allocator(void* (*new_malloc)(size_t), void (*new_free)(void*));
 
+// setup segment allocator of one kcp object, takes precedence over
+// ikcp_allocator for segments. call it before any ikcp_send/ikcp_input
+void ikcp_segment_allocator(ikcpcb *kcp,
+	void* (*seg_malloc)(size_t size, ikcpcb *kcp, void *user),
+	void (*seg_free)(void *ptr, ikcpcb *kcp, void *user));
+
 
 #ifdef __cplusplus
 }
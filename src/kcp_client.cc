@@ -22,6 +22,14 @@ bool KCPClient::Write(const char *buf, std::size_t len) {
     return stream_->Write(buf, len);
 }
 
+bool KCPClient::WriteShared(SharedBuffer buf) {
+    return stream_->WriteShared(std::move(buf));
+}
+
+KCPStats KCPClient::stats() {
+    return stream_->stats();
+}
+
 uint32_t KCPClient::conv() const {
     return stream_->conv();
 }
@@ -42,6 +50,10 @@ void KCPClient::OnRecvKCP(const char *buf, size_t size) {
     cb_->OnRecvKCP(buf, size);
 }
 
+bool KCPClient::OnRecvKCPMessage(KCPMessage& msg) {
+    return cb_->OnRecvKCPMessage(msg);
+}
+
 bool KCPClient::OnError(const std::error_code& ec) {
     return cb_->OnError(ec);
 }
@@ -21,6 +21,8 @@ public:
     bool Open(KCPClientCallback *cb) override;
     void Close() override;
     bool Write(const char *buf, std::size_t len) override;
+    bool WriteShared(SharedBuffer buf) override;
+    KCPStats stats() override;
     uint32_t conv() const override;
     const IP4Address& local_address() const override;
     const IP4Address& remote_address() const override;
@@ -28,6 +30,7 @@ public:
 private:
     // stream interface
     void OnRecvKCP(const char *buf, size_t size) override;
+    bool OnRecvKCPMessage(KCPMessage& msg) override;
     bool OnError(const std::error_code& ec) override;
 
     std::shared_ptr<UDPInterface> udp_;
@@ -65,6 +68,14 @@ public:
         return executor()->Invoke(&KCPClientInterface::Write, impl_.get(), buf, len);
     }
 
+    bool WriteShared(SharedBuffer buf) override {
+        return executor()->Invoke(&KCPClientInterface::WriteShared, impl_.get(), std::move(buf));
+    }
+
+    KCPStats stats() override {
+        return executor()->Invoke(&KCPClientInterface::stats, impl_.get());
+    }
+
     uint32_t conv() const {
         return impl_->conv();
     }
@@ -6,8 +6,8 @@ using namespace kcp;
 
 //static
 std::unique_ptr<KCPContextInterface>
-KCPContextInterface::Create(size_t thread_num) {
-    return std::make_unique<KCPContext>(IOContextInterface::Create(thread_num));
+KCPContextInterface::Create(size_t thread_num, const ExecutorConfig& config) {
+    return std::make_unique<KCPContext>(IOContextInterface::Create(thread_num, config));
 }
 
 void KCPContext::Start() {
@@ -22,6 +22,10 @@ ExecutorInterface *KCPContext::executor() {
     return io_ctx_->executor();
 }
 
+void KCPContext::Rebalance() {
+    io_ctx_->Rebalance();
+}
+
 std::unique_ptr<KCPStreamInterface>
 KCPContext::CreateStream(const IP4Address& addr,
                          const IP4Address& peer,
@@ -15,6 +15,7 @@ public:
     void Start() override;
     void Stop() override;
     ExecutorInterface *executor() override;
+    void Rebalance() override;
     std::unique_ptr<KCPStreamInterface> CreateStream(const IP4Address& addr, 
                                                     const IP4Address& peer, 
                                                     uint32_t conv) override;
@@ -15,6 +15,8 @@ std::string ErrorCategory::message(int err) const {
         return "bad udp msg";
     case ErrNum::kBadKCPConv:
         return "bad kcp conv";
+    case ErrNum::kMessageTooLarge:
+        return "message too large";
     default:
         break;
     }
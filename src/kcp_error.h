@@ -10,7 +10,8 @@ enum class ErrNum : uint8_t {
     kBadIP4Address,
     kKCPInputFailed,
     kBadUDPMsg,
-    kBadKCPConv
+    kBadKCPConv,
+    kMessageTooLarge
 };
 
 class ErrorCategory : public std::error_category {
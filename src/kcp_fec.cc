@@ -0,0 +1,419 @@
+#include "kcp_fec.h"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace kcp;
+
+namespace {
+// GF(2^8) over x^8 + x^4 + x^3 + x^2 + 1, multiplication by table
+class GaloisField {
+public:
+    GaloisField() {
+        uint8_t exp[512];
+        int log[256] = { 0 };
+
+        int x = 1;
+        for (int i = 0; i < 255; ++i) {
+            exp[i] = static_cast<uint8_t>(x);
+            log[x] = i;
+            x <<= 1;
+            if (x & 0x100) {
+                x ^= 0x11d;
+            }
+        }
+
+        for (int i = 255; i < 512; ++i) {
+            exp[i] = exp[i - 255];
+        }
+
+        for (int a = 0; a < 256; ++a) {
+            for (int b = 0; b < 256; ++b) {
+                mul_[a][b] = (a && b) ? exp[log[a] + log[b]] : 0;
+            }
+
+            inv_[a] = a ? exp[255 - log[a]] : 0;
+        }
+    }
+
+    uint8_t Mul(uint8_t a, uint8_t b) const { return mul_[a][b]; }
+    uint8_t Inv(uint8_t a) const { return inv_[a]; }
+
+    // dst ^= c * src
+    void MulAdd(uint8_t c, const char *src, char *dst, size_t len) const {
+        if (0 == c) {
+            return;
+        }
+
+        const uint8_t *row = mul_[c];
+        for (size_t i = 0; i < len; ++i) {
+            dst[i] ^= row[static_cast<uint8_t>(src[i])];
+        }
+    }
+
+    // parity rows form a Cauchy matrix 1 / (x_p + y_d) with x_p = k + p
+    // and y_d = d, every square submatrix is invertible
+    uint8_t Cauchy(int k, int p, int d) const {
+        return inv_[static_cast<uint8_t>((k + p) ^ d)];
+    }
+
+    // in place Gauss-Jordan over a k x k row-major matrix
+    bool Invert(std::vector<uint8_t>& m, int k) const {
+        std::vector<uint8_t> inv(k * k, 0);
+        for (int i = 0; i < k; ++i) {
+            inv[i * k + i] = 1;
+        }
+
+        for (int col = 0; col < k; ++col) {
+            int pivot = col;
+            while (pivot < k && 0 == m[pivot * k + col]) {
+                ++pivot;
+            }
+
+            if (pivot == k) {
+                return false;
+            }
+
+            if (pivot != col) {
+                for (int j = 0; j < k; ++j) {
+                    std::swap(m[pivot * k + j], m[col * k + j]);
+                    std::swap(inv[pivot * k + j], inv[col * k + j]);
+                }
+            }
+
+            uint8_t scale = Inv(m[col * k + col]);
+            for (int j = 0; j < k; ++j) {
+                m[col * k + j] = Mul(m[col * k + j], scale);
+                inv[col * k + j] = Mul(inv[col * k + j], scale);
+            }
+
+            for (int row = 0; row < k; ++row) {
+                uint8_t f = m[row * k + col];
+                if (row == col || 0 == f) {
+                    continue;
+                }
+
+                for (int j = 0; j < k; ++j) {
+                    m[row * k + j] ^= Mul(f, m[col * k + j]);
+                    inv[row * k + j] ^= Mul(f, inv[col * k + j]);
+                }
+            }
+        }
+
+        m.swap(inv);
+        return true;
+    }
+private:
+    uint8_t mul_[256][256];
+    uint8_t inv_[256];
+};
+
+const GaloisField& GF() {
+    static const GaloisField gf;
+    return gf;
+}
+
+// little endian like the kcp header
+void Put16(char *p, uint16_t v) {
+    p[0] = static_cast<char>(v);
+    p[1] = static_cast<char>(v >> 8);
+}
+
+uint16_t Get16(const char *p) {
+    return static_cast<uint16_t>(static_cast<uint8_t>(p[0]) | (static_cast<uint8_t>(p[1]) << 8));
+}
+
+void Put32(char *p, uint32_t v) {
+    Put16(p, static_cast<uint16_t>(v));
+    Put16(p + 2, static_cast<uint16_t>(v >> 16));
+}
+
+uint32_t Get32(const char *p) {
+    return Get16(p) | (static_cast<uint32_t>(Get16(p + 2)) << 16);
+}
+}
+
+FECCodec::FECCodec(FECCallback *cb, int data_shards, int parity_shards, bool adaptive,
+                   uint32_t max_delay)
+    : cb_(cb)
+    , data_shards_(std::clamp(data_shards, 1, kMaxShards - 1))
+    , max_parity_(std::clamp(parity_shards, 0, kMaxShards - data_shards_))
+    , adaptive_(adaptive)
+    , max_delay_(max_delay) {
+    shards_.resize(data_shards_);
+    OpenGroup();
+}
+
+void FECCodec::Encode(const char *buf, size_t len) {
+    out_buf_.resize(len + kTrailerSize);
+    std::memcpy(out_buf_.data(), buf, len);
+    PutTrailer(out_buf_.data() + len, static_cast<int>(shards_count_), 0);
+    cb_->OnFECOutput(out_buf_.data(), out_buf_.size());
+
+    // coded with its length in front, shorter shards are zero padded
+    if (parity_ > 0) {
+        auto& shard = shards_[shards_count_];
+        shard.resize(2 + len);
+        Put16(shard.data(), static_cast<uint16_t>(len));
+        std::memcpy(shard.data() + 2, buf, len);
+    }
+
+    if (++shards_count_ == static_cast<size_t>(data_shards_)) {
+        CloseGroup();
+    }
+}
+
+void FECCodec::Flush(uint32_t current) {
+    if (0 == shards_count_) {
+        return;
+    }
+
+    // sparse traffic such as lone acks fills a group over several flushes
+    if (!waiting_) {
+        waiting_ = true;
+        waiting_since_ = current;
+    }
+
+    if (static_cast<int32_t>(current - waiting_since_) >= static_cast<int32_t>(max_delay_)) {
+        CloseGroup();
+    }
+}
+
+void FECCodec::CloseGroup() {
+    // a partial group gets its share of the parity, one at least
+    int k = static_cast<int>(shards_count_);
+    if (parity_ > 0) {
+        parity_ = (parity_ * k + data_shards_ - 1) / data_shards_;
+        SendParity();
+    }
+
+    ++group_;
+    shards_count_ = 0;
+    waiting_ = false;
+    OpenGroup();
+}
+
+void FECCodec::OpenGroup() {
+    parity_ = max_parity_;
+
+    // twice the expected losses plus one, one parity at least keeps the
+    // loss measurable
+    if (adaptive_ && max_parity_ > 0) {
+        int parity = (data_shards_ * peer_loss_ * 2 + 99) / 100 + (peer_loss_ > 0 ? 1 : 0);
+        parity_ = std::clamp(parity, 1, max_parity_);
+    }
+}
+
+void FECCodec::SendParity() {
+    auto& gf = GF();
+    int k = static_cast<int>(shards_count_);
+
+    size_t shard_size = 0;
+    for (int d = 0; d < k; ++d) {
+        shard_size = (std::max)(shard_size, shards_[d].size());
+    }
+
+    // kcp datagrams start with conv, keep it for demultiplexing
+    out_buf_.assign(4 + shard_size + kTrailerSize, 0);
+    if (shards_[0].size() >= 2 + 4) {
+        std::memcpy(out_buf_.data(), shards_[0].data() + 2, 4);
+    }
+
+    char *parity = out_buf_.data() + 4;
+    for (int p = 0; p < parity_; ++p) {
+        std::memset(parity, 0, shard_size);
+        for (int d = 0; d < k; ++d) {
+            gf.MulAdd(gf.Cauchy(k, p, d), shards_[d].data(), parity, shards_[d].size());
+        }
+
+        PutTrailer(parity + shard_size, k + p, k);
+        cb_->OnFECOutput(out_buf_.data(), out_buf_.size());
+    }
+}
+
+void FECCodec::PutTrailer(char *p, int index, int data) const {
+    Put32(p, group_);
+    p[4] = static_cast<char>(index);
+    p[5] = static_cast<char>(data);
+    p[6] = static_cast<char>(parity_);
+    p[7] = static_cast<char>(loss_);
+}
+
+bool FECCodec::Decode(const char *buf, size_t len) {
+    if (len < kTrailerSize) {
+        return false;
+    }
+
+    len -= kTrailerSize;
+    const char *trailer = buf + len;
+    uint32_t id = Get32(trailer);
+    int index = static_cast<uint8_t>(trailer[4]);
+    // 0 for data shards, the actual group size for parity
+    int data = static_cast<uint8_t>(trailer[5]);
+    int parity = static_cast<uint8_t>(trailer[6]);
+    peer_loss_ = (std::min)(static_cast<int>(static_cast<uint8_t>(trailer[7])), 100);
+
+    if (0 == data) {
+        cb_->OnFECData(buf, len);
+    } else if (index < data || len < 4 + 2) {
+        return false;
+    }
+
+    auto group = FindGroup(id);
+    if (!group || group->have[index]) {
+        return true;
+    }
+
+    group->have[index] = true;
+    group->received++;
+    group->max_index = (std::max)(group->max_index, index);
+    // data shards carry the parity planned for a full group, the parity
+    // of a partial one tells how much was sent
+    if (0 != data || 0 == group->data) {
+        group->parity = parity;
+    }
+    if (group->done || 0 == parity) {
+        return true;
+    }
+
+    if (group->shards.size() <= static_cast<size_t>(index)) {
+        group->shards.resize(index + 1);
+    }
+
+    auto& shard = group->shards[index];
+    if (0 == data) {
+        shard.resize(2 + len);
+        Put16(shard.data(), static_cast<uint16_t>(len));
+        std::memcpy(shard.data() + 2, buf, len);
+    } else {
+        if (0 == group->data) {
+            group->data = data;
+            group->shard_size = len - 4;
+        }
+
+        if (data != group->data || len - 4 != group->shard_size) {
+            return false;
+        }
+
+        shard.assign(buf + 4, buf + len);
+    }
+
+    if (group->data > 0) {
+        Recover(group);
+    }
+
+    return true;
+}
+
+void FECCodec::Recover(Group *group) {
+    int k = group->data;
+    if (group->received < k) {
+        return;
+    }
+
+    group->shards.resize(k + group->parity);
+
+    std::vector<int> rows, missing;
+    for (int d = 0; d < k; ++d) {
+        if (group->have[d]) {
+            rows.push_back(d);
+        } else {
+            missing.push_back(d);
+        }
+    }
+
+    for (int i = k; i < k + group->parity && rows.size() < static_cast<size_t>(k); ++i) {
+        if (group->have[i]) {
+            rows.push_back(i);
+        }
+    }
+
+    group->done = true;
+    if (missing.empty() || rows.size() < static_cast<size_t>(k)) {
+        return;
+    }
+
+    auto& gf = GF();
+    std::vector<uint8_t> m(k * k, 0);
+    for (int r = 0; r < k; ++r) {
+        if (rows[r] < k) {
+            m[r * k + rows[r]] = 1;
+            continue;
+        }
+
+        for (int d = 0; d < k; ++d) {
+            m[r * k + d] = gf.Cauchy(k, rows[r] - k, d);
+        }
+    }
+
+    if (!gf.Invert(m, k)) {
+        return;
+    }
+
+    std::vector<char> shard(group->shard_size);
+    for (int d : missing) {
+        std::fill(shard.begin(), shard.end(), 0);
+        for (int r = 0; r < k; ++r) {
+            auto& src = group->shards[rows[r]];
+            gf.MulAdd(m[d * k + r], src.data(), shard.data(), (std::min)(src.size(), shard.size()));
+        }
+
+        size_t len = Get16(shard.data());
+        if (len + 2 <= shard.size()) {
+            ++recovered_;
+            cb_->OnFECData(shard.data() + 2, len);
+        }
+    }
+}
+
+FECCodec::Group *FECCodec::FindGroup(uint32_t id) {
+    if (!seen_ || static_cast<int32_t>(id - newest_) > 0) {
+        newest_ = id;
+        seen_ = true;
+    }
+
+    // too late to help
+    if (static_cast<int32_t>(newest_ - id) >= static_cast<int32_t>(kGroupWindow)) {
+        return nullptr;
+    }
+
+    auto& group = groups_[id % kGroupWindow];
+    if (group.used && group.id == id) {
+        return &group;
+    }
+
+    if (group.used) {
+        Retire(&group);
+    }
+
+    group.id = id;
+    group.used = true;
+    group.done = false;
+    group.data = 0;
+    group.parity = 0;
+    group.received = 0;
+    group.max_index = -1;
+    group.shard_size = 0;
+    group.have.reset();
+    for (auto&& shard : group.shards) {
+        shard.clear();
+    }
+
+    return &group;
+}
+
+// counts the shards of a group leaving the window, groups lost as a
+// whole are not seen
+void FECCodec::Retire(Group *group) {
+    int data = group->data > 0 ? group->data : group->max_index + 1;
+    int expected = (std::max)(data + group->parity, group->received);
+
+    expected_ += expected;
+    lost_ += expected - group->received;
+
+    if (expected_ >= kLossSamples) {
+        loss_ = static_cast<int>((lost_ * 100 + expected_ / 2) / expected_);
+        expected_ = 0;
+        lost_ = 0;
+    }
+}
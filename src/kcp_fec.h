@@ -0,0 +1,111 @@
+#ifndef _KCP_FEC_H_INCLUDED
+#define _KCP_FEC_H_INCLUDED
+
+#include <array>
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace kcp {
+class FECCallback {
+protected:
+    virtual ~FECCallback() = default;
+public:
+    // a datagram ready for the socket
+    virtual void OnFECOutput(const char *buf, size_t len) = 0;
+    // a kcp datagram of the peer, as received or rebuilt from parity
+    virtual void OnFECData(const char *buf, size_t len) = 0;
+};
+
+// Reed-Solomon erasure coding over groups of outgoing datagrams. any
+// data_shards of the data_shards + parity_shards datagrams of a group
+// rebuild the missing ones.
+//
+// every datagram ends with a trailer (group, index, data and parity
+// count, loss seen by the sender), parity datagrams also start with the
+// conv of their group so KCPAPI::ParseConv still works on them. both
+// ends must enable it with the same overhead.
+class FECCodec {
+public:
+    static constexpr size_t kTrailerSize = 8;
+    // conv in front of parity and the length prefix of coded shards
+    static constexpr size_t kParityHeadSize = 6;
+    // the kcp mtu has to leave room for this
+    static constexpr size_t kOverhead = kTrailerSize + kParityHeadSize;
+    static constexpr int kMaxShards = 255;
+
+    // a partial group is closed once it has waited max_delay, in the
+    // clock Flush is called with
+    FECCodec(FECCallback *cb, int data_shards, int parity_shards, bool adaptive,
+             uint32_t max_delay);
+
+    FECCodec(const FECCodec&) = delete;
+    FECCodec& operator =(const FECCodec&) = delete;
+
+    // kcp output, the group is closed once it has data_shards datagrams
+    void Encode(const char *buf, size_t len);
+    // at the end of a kcp flush, closes a partial group that has waited
+    // long enough. its parity is scaled down to the datagrams in it
+    void Flush(uint32_t current);
+    // false for a datagram without a valid trailer
+    bool Decode(const char *buf, size_t len);
+
+    int parity_shards() const { return parity_; }
+    // percent of the peer's datagrams lost on the way here
+    int loss() const { return loss_; }
+    uint64_t recovered() const { return recovered_; }
+private:
+    static constexpr size_t kGroupWindow = 64;
+    static constexpr uint64_t kLossSamples = 1024;
+
+    struct Group {
+        uint32_t id = 0;
+        bool used = false;
+        bool done = false;
+        int data = 0;
+        int parity = 0;
+        int received = 0;
+        int max_index = -1;
+        size_t shard_size = 0;
+        std::bitset<kMaxShards + 1> have;
+        std::vector<std::vector<char>> shards;
+    };
+
+    void OpenGroup();
+    void CloseGroup();
+    void SendParity();
+    void Recover(Group *group);
+    Group *FindGroup(uint32_t id);
+    void Retire(Group *group);
+    void PutTrailer(char *p, int index, int data) const;
+
+    FECCallback *cb_;
+    int data_shards_;
+    int max_parity_;
+    bool adaptive_;
+    uint32_t max_delay_;
+
+    // encoder
+    uint32_t group_ = 0;
+    int parity_ = 0;
+    std::vector<std::vector<char>> shards_;
+    size_t shards_count_ = 0;
+    // the first Flush that saw the group partial
+    bool waiting_ = false;
+    uint32_t waiting_since_ = 0;
+    std::vector<char> out_buf_;
+
+    // decoder
+    std::array<Group, kGroupWindow> groups_;
+    uint32_t newest_ = 0;
+    bool seen_ = false;
+    uint64_t expected_ = 0;
+    uint64_t lost_ = 0;
+    int loss_ = 0;
+    int peer_loss_ = 0;
+    uint64_t recovered_ = 0;
+};
+}
+
+#endif // !_KCP_FEC_H_INCLUDED
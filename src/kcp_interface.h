@@ -12,6 +12,13 @@ protected:
 public:
     virtual void OnRecvKCP(const char *buf, size_t size) = 0;
     virtual bool OnError(const std::error_code& ec) = 0;
+
+    // scatter-gather delivery, return false to get OnRecvKCP instead.
+    // move msg away to keep its segments past the call. with
+    // partial_message a large message comes in parts, see msg.more().
+    // declining a first part gets whole messages from then on, declining
+    // a later one fails the stream
+    virtual bool OnRecvKCPMessage(KCPMessage&) { return false; }
 };
 
 class KCPStreamInterface {
@@ -20,7 +27,13 @@ public:
 
     virtual bool Open(const KCPConfig& config, KCPStreamCallback *cb) = 0;
     virtual void Close() = 0;
+    // a message over one segment is copied once and queued whole
     virtual bool Write(const char *buf, size_t len) = 0;
+    // segments reference buf until acked instead of copying it, and are
+    // cut only as the window lets them out: memory beyond buf follows
+    // the window, not the message size
+    virtual bool WriteShared(SharedBuffer buf) = 0;
+    virtual KCPStats stats() = 0;
     virtual const IP4Address& local_address() const = 0;
     virtual const IP4Address& remote_address() const = 0;
     virtual uint32_t conv() const = 0;
@@ -35,6 +48,8 @@ public:
     virtual void OnClose() = 0;
     virtual void OnRecvKCP(const char *buf, size_t size) = 0;
     virtual bool OnError(const std::error_code& ec) = 0;
+    // see KCPStreamCallback::OnRecvKCPMessage
+    virtual bool OnRecvKCPMessage(KCPMessage&) { return false; }
 };
 
 class KCPClientInterface {
@@ -43,7 +58,9 @@ public:
 
     virtual bool Open(KCPClientCallback *cb) = 0;
     virtual bool Write(const char *buf, size_t len) = 0;
+    virtual bool WriteShared(SharedBuffer buf) = 0;
     virtual void Close() = 0;
+    virtual KCPStats stats() = 0;
     virtual uint32_t conv() const = 0;
     virtual const IP4Address& local_address() const = 0;
     virtual const IP4Address& remote_address() const = 0;
@@ -74,12 +91,14 @@ struct KCPServerConfig : KCPConfig {
 
 class KCPContextInterface {
 public:
-    static std::unique_ptr<KCPContextInterface> Create(size_t thread_num = 0);
+    static std::unique_ptr<KCPContextInterface> Create(
+        size_t thread_num = 0, const ExecutorConfig& config = ExecutorConfig());
 
     virtual ~KCPContextInterface() = default;
     virtual void Start() = 0;
     virtual void Stop() = 0;
     virtual ExecutorInterface *executor() = 0;
+    virtual void Rebalance() = 0;
     virtual std::unique_ptr<KCPStreamInterface> CreateStream(
         const IP4Address& addr, const IP4Address& peer, uint32_t conv) = 0;
     virtual std::unique_ptr<KCPClientInterface> CreateClient(
@@ -27,10 +27,18 @@ public:
         mux_->SetRecvBufSize(recv_size);
     }
 
+    bool SetDontFragment(bool enable) override {
+        return mux_->SetDontFragment(enable);
+    }
+
     bool Send(const IP4Address& to, const char *buf, size_t len) override {
         return mux_->Send(to, buf, len);
     }
 
+    bool SendBatch(const IP4Address& to, const UDPDatagram *datagrams, size_t count) override {
+        return mux_->SendBatch(to, datagrams, count);
+    }
+
     const IP4Address& local_address() const override {
         return  mux_->local_address();
     }
@@ -96,10 +104,18 @@ void KCPMux::SetRecvBufSize(size_t recv_size) {
     udp_->SetRecvBufSize(recv_size);
 }
 
+bool KCPMux::SetDontFragment(bool enable) {
+    return udp_->SetDontFragment(enable);
+}
+
 bool KCPMux::Send(const IP4Address& to, const char *buf, size_t len) {
     return udp_->Send(to, buf, len);
 }
 
+bool KCPMux::SendBatch(const IP4Address& to, const UDPDatagram *datagrams, size_t count) {
+    return udp_->SendBatch(to, datagrams, count);
+}
+
 const IP4Address& KCPMux::local_address() const {
     return udp_->local_address();
 }
@@ -116,16 +132,49 @@ bool KCPMux::OnRecvUDP(const IP4Address& from, const char *buf, size_t len) {
 
     StreamKey key(from, conv);
     auto by_key = by_key_streams_.find(key);
-    if (by_key_streams_.end() != by_key) {
+    if (by_key_streams_.end() != by_key && by_key->second->cb_) {
         return by_key->second->cb_->OnRecvUDP(from, buf, len);
     }
 
     return false;
 }
 
+// runs of one conv go to their stream as a batch
+bool KCPMux::OnRecvUDPBatch(const IP4Address& from, const UDPDatagram *datagrams, size_t count) {
+    bool ok = true;
+    for (size_t i = 0; i < count;) {
+        uint32_t conv = 0;
+        if (!KCPAPI::ParseConv(datagrams[i].buf, datagrams[i].len, &conv)) {
+            ok = false;
+            ++i;
+            continue;
+        }
+
+        size_t n = 1;
+        uint32_t next_conv = 0;
+        while (i + n < count &&
+               KCPAPI::ParseConv(datagrams[i + n].buf, datagrams[i + n].len, &next_conv) &&
+               next_conv == conv) {
+            ++n;
+        }
+
+        StreamKey key(from, conv);
+        auto by_key = by_key_streams_.find(key);
+        if (by_key_streams_.end() != by_key && by_key->second->cb_) {
+            ok = by_key->second->cb_->OnRecvUDPBatch(from, &datagrams[i], n) && ok;
+        } else {
+            ok = false;
+        }
+
+        i += n;
+    }
+
+    return ok;
+}
+
 bool KCPMux::OnError(const std::error_code& ec) {
     for (auto&& stream : by_key_streams_) {
-        if (!stream.second->cb_->OnError(ec)) {
+        if (stream.second->cb_ && !stream.second->cb_->OnError(ec)) {
             return false;
         }
     }
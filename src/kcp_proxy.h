@@ -20,13 +20,16 @@ public:
     bool Open(UDPCallback *cb) override;
     void Close() override;
     void SetRecvBufSize(size_t recv_size) override;
+    bool SetDontFragment(bool enable) override;
     bool Send(const IP4Address& to, const char *buf, size_t len) override;
+    bool SendBatch(const IP4Address& to, const UDPDatagram *datagrams, size_t count) override;
     const IP4Address& local_address() const override;
     ExecutorInterface *executor() override;
 
     // udp callback
     bool OnRecvUDP(const IP4Address& from, const char *buf, size_t len) override;
     bool OnError(const std::error_code& ec) override;
+    bool OnRecvUDPBatch(const IP4Address& from, const UDPDatagram *datagrams, size_t count) override;
 private:
     explicit KCPMux(std::shared_ptr<UDPInterface> udp) : udp_(udp) {}
     ~KCPMux();
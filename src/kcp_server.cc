@@ -47,6 +47,15 @@ bool KCPServer::OnRecvUDP(const IP4Address& from, const char *buf, size_t len) {
     return proxy_->OnRecvUDP(from, buf, len);
 }
 
+bool KCPServer::OnRecvUDPBatch(const IP4Address& from, const UDPDatagram *datagrams, size_t count) {
+    if (stopped_) {
+        return false;
+    }
+
+    KCP_ASSERT(proxy_);
+    return proxy_->OnRecvUDPBatch(from, datagrams, count);
+}
+
 bool KCPServer::OnNewClient(const IP4Address& from,
                             uint32_t conv,
                             const char *buf,
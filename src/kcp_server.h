@@ -23,6 +23,7 @@ private:
 
     // udp callback
     bool OnRecvUDP(const IP4Address& from, const char *buf, size_t len) override;
+    bool OnRecvUDPBatch(const IP4Address& from, const UDPDatagram *datagrams, size_t count) override;
     bool OnError(const std::error_code& ec) override;
 
     std::shared_ptr<UDPInterface> udp_;
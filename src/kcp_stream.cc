@@ -1,6 +1,9 @@
 #include "kcp_stream.h"
 #include "logging.h"
 
+#include <algorithm>
+#include <cstdlib>
+
 using namespace kcp;
 
 //static
@@ -17,28 +20,113 @@ bool KCPAPI::ParseConv(const char *buf, size_t len, uint32_t *conv) {
     return true;
 }
 
+KCPStream::~KCPStream() {
+    Close();
+
+    if (api_) {
+        api_.FreeSegments(&pending_);
+    }
+}
+
 bool KCPStream::Open(const KCPConfig& config, KCPStreamCallback *cb) {
     if (!api_.Init(conv_, &KCPStream::KCPOutput, this)) {
         return false;
     }
 
-    api_.set_mtu(config.mtu);
+    KCP_ASSERT(udp_);
+    allocator_ = udp_->executor()->allocator();
+    // always through KCPMalloc, SegmentReleaser frees segments without kcp
+    api_.set_allocator(&KCPStream::KCPMalloc, &KCPStream::KCPFree);
+    releaser_ = std::make_shared<SegmentReleaser>(udp_, allocator_);
+
+    api_.set_ref_callbacks(&KCPStream::KCPRetain, &KCPStream::KCPRelease);
+
+    api_.set_clock(config.microsecond_clock);
+    tick_ = api_->tick;
+
+    bool use_us = config.microsecond_clock;
+    int mtu = config.mtu;
+    int max_mtu = (std::max)(config.mtu, config.max_mtu);
+    // the floor only applies while probing
+    int min_mtu = (config.max_mtu > 0 && config.min_mtu > 0) ?
+        (std::min)(config.mtu, config.min_mtu) : config.mtu;
+    if (config.fec_data_shards > 0) {
+        fec_ = std::make_unique<FECCodec>(this,
+                                          config.fec_data_shards,
+                                          config.fec_parity_shards,
+                                          config.fec_adaptive,
+                                          static_cast<uint32_t>(config.fec_max_delay) * tick_);
+        mtu -= static_cast<int>(FECCodec::kOverhead);
+        max_mtu -= static_cast<int>(FECCodec::kOverhead);
+        min_mtu -= static_cast<int>(FECCodec::kOverhead);
+    }
+
+    if (config.compress) {
+        transforms_.Add(std::make_unique<LZTransform>());
+    }
+    for (auto& factory : config.transforms) {
+        if (auto stage = factory ? factory() : nullptr) {
+            transforms_.Add(std::move(stage));
+        }
+    }
+    if (!transforms_.empty()) {
+        transforms_.Reserve((std::max)(config.mtu, config.max_mtu));
+        mtu -= static_cast<int>(transforms_.overhead());
+        max_mtu -= static_cast<int>(transforms_.overhead());
+        min_mtu -= static_cast<int>(transforms_.overhead());
+    }
+
+    // a probe over the path mtu must be lost, not fragmented on the way
+    bool pmtud = (max_mtu > mtu || min_mtu < mtu) && udp_->SetDontFragment(true);
+    api_.set_mtu(mtu);
+    api_.set_pmtud(pmtud ? max_mtu : 0, pmtud ? min_mtu : 0);
+    if (allocator_) {
+        // data segments up to the largest mss pmtud may reach
+        size_t overhead = api_->mtu - api_->mss;
+        allocator_->Reserve(sizeof(IKCPSEG) + (std::max)(api_->mtu, api_->pmtu_max) - overhead);
+    }
     api_.set_wndsize(config.sndwnd, config.rcvwnd);
+    api_.set_wndtune(config.wnd_max_bytes);
     api_.set_nodelay(config.nodelay ? 1 : 0,
-                     config.interval,
+                     (use_us && config.interval_us > 0) ? config.interval_us : config.interval * tick_,
                      config.resend,
                      config.nocwnd ? 1 : 0);
-    api_->rx_minrto = config.min_rto;
+    api_->rx_minrto = (use_us && config.min_rto_us > 0) ? config.min_rto_us : config.min_rto * tick_;
+    api_.set_caps((config.sack ? IKCP_CAP_SACK : 0) |
+                  (config.large_message ? IKCP_CAP_XFRAG : 0) |
+                  (pmtud ? IKCP_CAP_PMTU : 0));
+    api_.set_ackdelay(config.ack_delay * tick_, config.ack_max);
+    api_.set_stream(config.stream);
+    max_message_size_ = config.max_message_size;
+    partial_message_ = config.partial_message;
+    api_.set_cc(config.congestion == Congestion::kBBR ? &ikcp_cc_bbr : nullptr);
+    api_.set_pacing(config.pacing);
+    api_.set_rack(config.rack);
+    api_.set_tlp(config.tail_loss_probe);
+
+    // fec encodes per datagram, the rest go out once per flush
+    if (!fec_) {
+        // room for the transforms to grow each datagram in place
+        flush_stride_ = (std::max)(api_->mtu, api_->pmtu_max) + transforms_.overhead();
+        flush_buf_.resize(flush_stride_ * kFlushBatch);
+        flush_bufs_.resize(kFlushBatch);
+        flush_lens_.resize(kFlushBatch);
+        flush_datagrams_.resize(kFlushBatch);
+        for (int i = 0; i < kFlushBatch; ++i) {
+            flush_bufs_[i] = flush_buf_.data() + flush_stride_ * i;
+        }
+        api_.set_vec(flush_bufs_.data(), flush_lens_.data(), kFlushBatch);
+    }
 
     cb_ = cb;
     closed_ = false;
 
-    KCP_ASSERT(udp_);
-    if (!udp_->executor()->DispatchTask(this, this)) {
+    task_ = udp_->executor()->DispatchTask(this, this);
+    if (!task_) {
         return false;
     }
 
-    udp_->SetRecvBufSize(config.mtu);
+    udp_->SetRecvBufSize((std::max)(config.mtu, config.max_mtu));
     return udp_->Open(this);
 }
 
@@ -51,7 +139,8 @@ void KCPStream::Close() {
     closed_ = true;
 
     if (udp_) {
-        udp_->executor()->CancelTask(this);
+        udp_->executor()->CancelTask(task_);
+        task_ = TaskHandle();
         udp_->Close();
     }
 }
@@ -61,10 +150,63 @@ bool KCPStream::Write(const char *buf, size_t len) {
         return false;
     }
 
+    // one copy of a long message, segments are cut from it as they go out
+    if (len > api_->mss) {
+        return WriteShared(SharedBuffer::From(std::vector<char>(buf, buf + len)));
+    }
+
     KCP_LOG(kInfo) << "kcp send len=" << len << std::endl;
     return api_.Send(buf, len);
 }
 
+bool KCPStream::WriteShared(SharedBuffer buf) {
+    if (closed_) {
+        return false;
+    }
+
+    // a single segment is cheaper to copy than to track
+    if (buf.len <= api_->mss) {
+        return Write(buf.data, buf.len);
+    }
+
+    KCP_LOG(kInfo) << "kcp send shared len=" << buf.len << std::endl;
+
+    auto ref = new SendRef{ std::move(buf.owner) };
+    bool ok = api_.SendRef(buf.data, buf.len, ref);
+    if (0 == ref->segments) {
+        delete ref;
+    }
+
+    return ok;
+}
+
+KCPStats KCPStream::stats() {
+    KCPStats stats;
+    if (!api_) {
+        return stats;
+    }
+
+    stats.srtt = api_->rx_srtt / tick_;
+    stats.rto = api_->rx_rto / tick_;
+    stats.srtt_us = api_->rx_srtt * (1000 / tick_);
+    stats.rto_us = api_->rx_rto * (1000 / tick_);
+    stats.cwnd = api_->cwnd;
+    stats.snd_wnd = api_->snd_wnd;
+    stats.rcv_wnd = api_->rcv_wnd;
+    stats.retransmits = api_->xmit;
+    stats.ack_suppressed = api_->ack_suppressed;
+    stats.tlp_sent = api_->tlp_sent;
+    stats.tlp_needed = api_->tlp_needed;
+    stats.tlp_spurious = api_->tlp_spurious;
+    stats.mtu = api_->mtu;
+    if (fec_) {
+        stats.fec_recovered = static_cast<uint32_t>(fec_->recovered());
+        stats.fec_loss = fec_->loss();
+        stats.mtu += static_cast<uint32_t>(FECCodec::kOverhead);
+    }
+    return stats;
+}
+
 const IP4Address& KCPStream::local_address() const {
     return udp_->local_address();
 }
@@ -89,18 +231,146 @@ void KCPStream::WriteUDP(const char *buf, std::size_t len) {
     }
 }
 
+void KCPStream::WriteFlushed() {
+    int count = api_.TakeVec();
+    if (count <= 0) {
+        return;
+    }
+
+    KCP_LOG(kInfo) << "udp send batch count=" << count << std::endl;
+
+    int n = 0;
+    for (int i = 0; i < count; ++i) {
+        size_t len = static_cast<size_t>(flush_lens_[i]);
+        if (!transforms_.empty()) {
+            len = transforms_.Encode(flush_bufs_[i], len, flush_stride_);
+        }
+        if (len > 0) {
+            flush_datagrams_[n++] = { flush_bufs_[i], len };
+        }
+    }
+
+    if (n > 0 && !udp_->SendBatch(peer_, flush_datagrams_.data(), n)) {
+        OnKCPError(ErrNum::kUDPSendFailed);
+    }
+}
+
+bool KCPStream::InputKCP(const char *buf, std::size_t len) {
+    if (!transforms_.empty()) {
+        buf = transforms_.Decode(buf, &len);
+        if (!buf) {
+            OnKCPError(ErrNum::kKCPInputFailed);
+            return false;
+        }
+    }
+
+    if (!api_.Input(buf, len)) {
+        OnKCPError(ErrNum::kKCPInputFailed);
+        return false;
+    }
+
+    return true;
+}
+
 void KCPStream::TryRecvKCP() {
-    int size = 0;
-    while ((size = api_.peek_size()) > 0) {
+    while (cb_ && RecvMessage(&message_)) {
+        size_t size = message_.size();
         KCP_LOG(kInfo) << "kcp recv len=" << size << std::endl;
 
+        bool more = message_.more();
+        if (cb_->OnRecvKCPMessage(message_)) {
+            message_.Release();
+            in_parts_ = more;
+            continue;
+        }
+
+        // parts go only through OnRecvKCPMessage, a callback without it
+        // gets whole messages from the first part on
+        if (in_parts_) {
+            message_.Release();
+            OnKCPError(ErrNum::kInvalidArgment);
+            Close();
+            return;
+        }
+
+        if (more) {
+            partial_message_ = false;
+            UnrecvMessage(&message_);
+            continue;
+        }
+
         if (recv_buf_.size() < size) {
             recv_buf_.resize(size);
         }
 
-        api_.Recv(&recv_buf_[0], size);
-        cb_->OnRecvKCP(&recv_buf_[0], size);
+        message_.CopyTo(recv_buf_.data());
+        message_.Release();
+        cb_->OnRecvKCP(recv_buf_.data(), size);
+    }
+}
+
+bool KCPStream::RecvMessage(KCPMessage *msg) {
+    bool more = false;
+    int size = -1;
+    if ((api_->caps & api_->rmt_caps & IKCP_CAP_XFRAG) || !iqueue_is_empty(&pending_)) {
+        // drained as they arrive, a large message must not hold rcv_wnd
+        size = api_.RecvFragments(&pending_, &more);
+    } else {
+        // at most 255 fragments, rcv_wnd bounds them
+        size = api_.RecvSegments(&pending_);
+    }
+    if (size < 0) {
+        return false;
+    }
+
+    pending_size_ += size;
+    // a peer that never ends its message must not grow it without bound
+    if (max_message_size_ > 0 && pending_size_ > max_message_size_) {
+        api_.FreeSegments(&pending_);
+        pending_size_ = 0;
+        OnKCPError(ErrNum::kMessageTooLarge);
+        Close();
+        return false;
+    }
+
+    if (more && !partial_message_) {
+        return false;
+    }
+
+    // a moved-from message lost its releaser
+    if (!msg->releaser_) {
+        msg->releaser_ = releaser_;
+    }
+
+    // unlink into a null terminated chain, the message may move around
+    auto first = pending_.next;
+    pending_.prev->next = nullptr;
+    iqueue_init(&pending_);
+
+    msg->segments_ = iqueue_entry(first, IKCPSEG, node);
+    msg->size_ = pending_size_;
+    msg->more_ = more;
+    pending_size_ = 0;
+
+    for (auto p = first; p; p = p->next) {
+        auto seg = iqueue_entry(p, IKCPSEG, node);
+        msg->slices_.push_back({ IKCP_SEG_DATA(seg), seg->len });
     }
+
+    return true;
+}
+
+void KCPStream::UnrecvMessage(KCPMessage *msg) {
+    auto seg = static_cast<IKCPSEG *>(msg->segments_);
+    while (seg) {
+        auto next = seg->node.next;
+        iqueue_add_tail(&seg->node, &pending_);
+        seg = next ? iqueue_entry(next, IKCPSEG, node) : nullptr;
+    }
+
+    pending_size_ = msg->size_;
+    msg->segments_ = nullptr;
+    msg->Release();
 }
 
 bool KCPStream::OnKCPError(ErrNum err) {
@@ -116,8 +386,12 @@ bool KCPStream::OnRecvUDP(const IP4Address& from, const char *buf, size_t len) {
     KCP_LOG(kInfo) << "udp recv len=" << len
         << ",from=" << from.ip4_string() << "," << from.port << std::endl;
 
-    if (!api_.Input(buf, len)) {
-        OnKCPError(ErrNum::kKCPInputFailed);
+    if (fec_) {
+        if (!fec_->Decode(buf, len)) {
+            OnKCPError(ErrNum::kKCPInputFailed);
+            return false;
+        }
+    } else if (!InputKCP(buf, len)) {
         return false;
     }
 
@@ -126,6 +400,59 @@ bool KCPStream::OnRecvUDP(const IP4Address& from, const char *buf, size_t len) {
     return true;
 }
 
+bool KCPStream::OnRecvUDPBatch(const IP4Address& from, const UDPDatagram *datagrams, size_t count) {
+    if (!(from == peer_)) {
+        OnKCPError(ErrNum::kBadIP4Address);
+        return false;
+    }
+
+    KCP_LOG(kInfo) << "udp recv batch count=" << count
+        << ",from=" << from.ip4_string() << "," << from.port << std::endl;
+
+    bool ok = true;
+    if (fec_) {
+        for (size_t i = 0; i < count; ++i) {
+            ok = fec_->Decode(datagrams[i].buf, datagrams[i].len) && ok;
+        }
+    } else {
+        batch_data_.resize(count);
+        batch_size_.resize(count);
+        size_t stride = transforms_.capacity();
+        if (!transforms_.empty() && decode_buf_.size() < stride * count) {
+            decode_buf_.resize(stride * count);
+        }
+        // a datagram that fails to decode is left out of the batch
+        size_t n = 0;
+        for (size_t i = 0; i < count; ++i) {
+            batch_data_[n] = datagrams[i].buf;
+            batch_size_[n] = static_cast<long>(datagrams[i].len);
+            if (!transforms_.empty()) {
+                char *dst = decode_buf_.data() + stride * i;
+                size_t len = transforms_.Decode(datagrams[i].buf, datagrams[i].len, dst, stride);
+                if (0 == len) {
+                    ok = false;
+                    continue;
+                }
+                batch_data_[n] = dst;
+                batch_size_[n] = static_cast<long>(len);
+            }
+            ++n;
+        }
+
+        if (n > 0) {
+            ok = api_.InputBatch(batch_data_.data(), batch_size_.data(), static_cast<int>(n)) && ok;
+        }
+    }
+
+    if (!ok) {
+        OnKCPError(ErrNum::kKCPInputFailed);
+    }
+
+    TryRecvKCP();
+
+    return ok;
+}
+
 bool KCPStream::OnError(const std::error_code& ec) {
     if (!cb_) {
         return true;
@@ -139,27 +466,118 @@ uint32_t KCPStream::OnRun(uint32_t now) {
         return kNotContinue;
     }
 
-    int32_t delay = TimeDiff(api_.Check(now), now);
+    // the executor runs on microseconds, kcp on its own clock
+    uint32_t current = (1 == tick_) ? Now32() : now;
+
+    int32_t delay = TimeDiff(api_.Check(current), current);
     if (delay <= 0) {
-        api_.Update(now);
-        delay = 1;
+        api_.Update(current);
+        // the peer can not take a long message queued before its caps
+        if (api_->snd_dropped != snd_dropped_) {
+            snd_dropped_ = api_->snd_dropped;
+            OnKCPError(ErrNum::kMessageTooLarge);
+        }
+        if (fec_) {
+            fec_->Flush(current);
+        } else {
+            WriteFlushed();
+        }
+        // next flush or pacing deadline
+        delay = std::max<int32_t>(TimeDiff(api_.Check(current), current), 1);
     }
 
-    return delay;
+    return delay * (1000 / tick_);
 }
 
 void KCPStream::OnCancel() {}
 
+void KCPStream::OnFECOutput(const char *buf, size_t len) {
+    WriteUDP(buf, len);
+}
+
+void KCPStream::OnFECData(const char *buf, size_t len) {
+    InputKCP(buf, len);
+}
+
 // static
 int KCPStream::KCPOutput(const char *buf, int len, struct IKCPCB *kcp, void *user) {
     KCP_LOG(kInfo) << "kcp output conv=" << kcp->conv
         << ",len=" << len << std::endl;
 
     KCPStream *stream = reinterpret_cast<KCPStream *>(user);
-    stream->WriteUDP(buf, len);
+    size_t size = static_cast<size_t>(len);
+    if (!stream->transforms_.empty()) {
+        buf = stream->transforms_.Encode(buf, &size);
+        if (!buf) {
+            return 0;
+        }
+    }
+
+    if (stream->fec_) {
+        stream->fec_->Encode(buf, size);
+    } else {
+        stream->WriteUDP(buf, size);
+    }
     return 0;
 }
 
+// static
+void *KCPStream::KCPMalloc(size_t size, struct IKCPCB *, void *user) {
+    KCPStream *stream = reinterpret_cast<KCPStream *>(user);
+    if (!stream->allocator_) {
+        return std::malloc(size);
+    }
+
+    return stream->allocator_->Allocate(size);
+}
+
+// static
+void KCPStream::KCPFree(void *ptr, struct IKCPCB *, void *user) {
+    KCPStream *stream = reinterpret_cast<KCPStream *>(user);
+    if (!stream->allocator_) {
+        std::free(ptr);
+        return;
+    }
+
+    stream->allocator_->Deallocate(ptr);
+}
+
+// static
+void KCPStream::KCPRetain(void *ref, struct IKCPCB *, void *) {
+    ++reinterpret_cast<SendRef *>(ref)->segments;
+}
+
+// static
+void KCPStream::KCPRelease(void *ref, struct IKCPCB *, void *) {
+    auto send_ref = reinterpret_cast<SendRef *>(ref);
+    if (0 == --send_ref->segments) {
+        delete send_ref;
+    }
+}
+
+void KCPStream::SegmentReleaser::Release(void *segments) {
+    auto free_segments = [allocator = allocator_, segments] {
+        auto seg = reinterpret_cast<IKCPSEG *>(segments);
+        while (seg) {
+            auto next = seg->node.next;
+            if (allocator) {
+                allocator->Deallocate(seg);
+            } else {
+                std::free(seg);
+            }
+
+            seg = next ? iqueue_entry(next, IKCPSEG, node) : nullptr;
+        }
+    };
+
+    auto executor = udp_->executor();
+    if (executor->CanNowExecuted()) {
+        free_segments();
+    } else {
+        executor->Post(std::move(free_segments));
+    }
+}
+
 // static
 std::unique_ptr<KCPStreamAdapter>
 KCPStreamAdapter::Create(std::shared_ptr<UDPInterface> udp,
@@ -1,7 +1,9 @@
 #ifndef _KCP_STREAM_H_INCLUDED
 #define _KCP_STREAM_H_INCLUDED
 
+#include <algorithm>
 #include <memory>
+#include <mutex>
 #include <cstdint>
 
 #include "ikcp.h"
@@ -9,11 +11,16 @@
 #include "udp_interface.h"
 #include "kcp_interface.h"
 #include "kcp_error.h"
+#include "kcp_fec.h"
+#include "kcp_transform.h"
 
 namespace kcp {
 class KCPAPI : public std::unique_ptr<ikcpcb, void (*)(ikcpcb *)> {
 public:
     using OutputFunc = decltype(std::declval<ikcpcb>().output);
+    using MallocFunc = decltype(std::declval<ikcpcb>().seg_malloc);
+    using FreeFunc = decltype(std::declval<ikcpcb>().seg_free);
+    using RefFunc = decltype(std::declval<ikcpcb>().ref_retain);
 
     KCPAPI()
         : std::unique_ptr<ikcpcb, void(*)(ikcpcb *)>(nullptr, &ikcp_release) {}
@@ -27,14 +34,51 @@ public:
         return 0 == ikcp_send(get(), buffer,static_cast<int>(len));
     }
 
+    bool SendRef(const char *buffer, size_t len, void *ref) noexcept {
+        return 0 == ikcp_send_ref(get(), buffer, static_cast<int>(len), ref);
+    }
+
+    // segments of the next whole message are moved to list. < 0 none ready
+    int RecvSegments(struct IQUEUEHEAD *list) noexcept {
+        return ikcp_recv_segments(get(), list);
+    }
+
+    // fragments of the next message received so far are appended to
+    // list, more is set until the last one. < 0 none ready
+    int RecvFragments(struct IQUEUEHEAD *list, bool *more) noexcept {
+        int more_frags = 0;
+        int size = ikcp_recv_fragments(get(), list, &more_frags);
+        *more = (0 != more_frags);
+        return size;
+    }
+
+    void FreeSegments(struct IQUEUEHEAD *list) noexcept {
+        ikcp_free_segments(get(), list);
+    }
+
     bool Input(const char *data, size_t size) noexcept {
         return 0 == ikcp_input(get(), data, static_cast<long>(size));
     }
 
+    // false if any of them failed, the others are still taken
+    bool InputBatch(const char * const *data, const long *size, int count) noexcept {
+        return 0 == ikcp_input_batch(get(), data, size, count);
+    }
+
     void Flush() noexcept {
         ikcp_flush(get());
     }
 
+    // flushes fill bufs of mtu bytes, count 0 back to output
+    void set_vec(char **bufs, int *lens, int count) noexcept {
+        ikcp_setvec(get(), bufs, lens, count);
+    }
+
+    // datagrams filled since the last call
+    int TakeVec() noexcept {
+        return ikcp_takevec(get());
+    }
+
     // -1 failed
     int peek_size() const noexcept {
         return ikcp_peeksize(get());
@@ -51,11 +95,66 @@ public:
         return 0 == ikcp_wndsize(get(), sndwnd, rcvwnd);
     }
 
+    // 0 keeps the windows fixed
+    void set_wndtune(size_t max_bytes) noexcept {
+        ikcp_wndtune(get(), static_cast<IUINT32>((std::min<size_t>)(max_bytes, UINT32_MAX)));
+    }
+
     // < 0 failed
     bool set_nodelay(int nodelay, int interval, int resend, int nc) noexcept {
         return 0 == ikcp_nodelay(get(), nodelay, interval, resend, nc);
     }
 
+    // IKCP_CAP_*
+    void set_caps(int caps) noexcept {
+        ikcp_setcaps(get(), caps);
+    }
+
+    // nullptr for the default
+    bool set_cc(const IKCPCC *cc) noexcept {
+        return 0 == ikcp_setcc(get(), cc);
+    }
+
+    // before any other time setting, < 0 failed
+    bool set_clock(bool microseconds) noexcept {
+        return 0 == ikcp_setclock(get(), microseconds ? 1 : 0);
+    }
+
+    void set_pacing(bool pacing) noexcept {
+        ikcp_pacing(get(), pacing ? 1 : 0);
+    }
+
+    void set_rack(bool rack) noexcept {
+        ikcp_rack(get(), rack ? 1 : 0);
+    }
+
+    void set_tlp(bool tlp) noexcept {
+        ikcp_tlp(get(), tlp ? 1 : 0);
+    }
+
+    // 0 disables, < 0 failed
+    bool set_pmtud(int max_mtu, int min_mtu) noexcept {
+        return 0 == ikcp_pmtud(get(), max_mtu, min_mtu);
+    }
+
+    void set_stream(bool stream) noexcept {
+        get()->stream = stream ? 1 : 0;
+    }
+
+    // < 0 failed
+    bool set_ackdelay(int delay, int count) noexcept {
+        return 0 == ikcp_ackdelay(get(), delay, count);
+    }
+
+    void set_allocator(MallocFunc seg_malloc, FreeFunc seg_free) noexcept {
+        ikcp_segment_allocator(get(), seg_malloc, seg_free);
+    }
+
+    void set_ref_callbacks(RefFunc retain, RefFunc release) noexcept {
+        get()->ref_retain = retain;
+        get()->ref_release = release;
+    }
+
     void Update(uint32_t current) noexcept {
         ikcp_update(get(), current);
     }
@@ -80,6 +179,7 @@ public:
 
 class KCPStream : public UDPCallback
                 , public TaskInterface
+                , public FECCallback
                 , public KCPStreamInterface {
 public:
     KCPStream(std::shared_ptr<UDPInterface> udp,
@@ -87,39 +187,113 @@ public:
               uint32_t conv)
         : udp_(udp)
         , peer_(peer)
-        , conv_(conv) {}
+        , conv_(conv) {
+        iqueue_init(&pending_);
+    }
 
-    ~KCPStream() { Close(); }
+    // on the executor thread, the update task is linked into the stream
+    ~KCPStream();
 
     bool Open(const KCPConfig& config, KCPStreamCallback *cb) override;
     void Close() override;
     bool Write(const char *buf, size_t len) override;
+    bool WriteShared(SharedBuffer buf) override;
+    KCPStats stats() override;
     const IP4Address& local_address() const override;
     const IP4Address& remote_address() const override;
     uint32_t conv() const override;
     ExecutorInterface *executor() override;
 private:
+    // one per WriteShared, counts the segments still pointing into owner
+    struct SendRef {
+        std::shared_ptr<const void> owner;
+        size_t segments = 0;
+    };
+
+    // frees received segments handed out in a KCPMessage, keeps the io
+    // thread and its allocator alive for messages outliving the stream
+    class SegmentReleaser : public KCPMessage::ReleaserInterface {
+    public:
+        SegmentReleaser(std::shared_ptr<UDPInterface> udp, AllocatorInterface *allocator)
+            : udp_(udp)
+            , allocator_(allocator) {}
+
+        void Release(void *segments) override;
+    private:
+        std::shared_ptr<UDPInterface> udp_;
+        AllocatorInterface *allocator_;
+    };
+
+    bool RecvMessage(KCPMessage *msg);
+    void UnrecvMessage(KCPMessage *msg);
+
     void WriteUDP(const char *buf, std::size_t len);
+    void WriteFlushed();
+    bool InputKCP(const char *buf, std::size_t len);
     void TryRecvKCP();
     bool OnKCPError(ErrNum err);
 
     // udp callback
     bool OnRecvUDP(const IP4Address& from, const char *buf, size_t len) override;
+    bool OnRecvUDPBatch(const IP4Address& from, const UDPDatagram *datagrams, size_t count) override;
     bool OnError(const std::error_code& ec) override;
 
     // task callback
     uint32_t OnRun(uint32_t now) override;
     void OnCancel() override;
 
+    // fec callback
+    void OnFECOutput(const char *buf, size_t len) override;
+    void OnFECData(const char *buf, size_t len) override;
+
     // kcp output
     static int KCPOutput(const char *buf, int len, struct IKCPCB *kcp, void *user);
 
-    KCPAPI api_;
+    // kcp segment allocator
+    static void *KCPMalloc(size_t size, struct IKCPCB *kcp, void *user);
+    static void KCPFree(void *ptr, struct IKCPCB *kcp, void *user);
+
+    // kcp segment payload references
+    static void KCPRetain(void *ref, struct IKCPCB *kcp, void *user);
+    static void KCPRelease(void *ref, struct IKCPCB *kcp, void *user);
+
     std::shared_ptr<UDPInterface> udp_;
+    // segments live in the io thread allocator, release before udp_
+    KCPAPI api_;
+    AllocatorInterface *allocator_ = nullptr;
     IP4Address peer_;
+    std::shared_ptr<SegmentReleaser> releaser_;
+    // fragments of a message still arriving
+    IQUEUEHEAD pending_;
+    size_t pending_size_ = 0;
+    size_t max_message_size_ = 0;
+    bool partial_message_ = false;
+    // OnRecvKCPMessage took a part of a message that is not complete yet
+    bool in_parts_ = false;
+    // long messages kcp dropped unsent, reported as they are seen
+    uint32_t snd_dropped_ = 0;
+    KCPMessage message_;
     std::vector<char> recv_buf_;
+    std::vector<const char *> batch_data_;
+    std::vector<long> batch_size_;
+    // a received batch after the transforms
+    std::vector<char> decode_buf_;
+    // datagrams of one flush, sent as a batch
+    static constexpr int kFlushBatch = 32;
+    size_t flush_stride_ = 0;
+    std::vector<char> flush_buf_;
+    std::vector<char *> flush_bufs_;
+    std::vector<int> flush_lens_;
+    std::vector<UDPDatagram> flush_datagrams_;
+    // per-datagram stages next to kcp, then fec next to udp_
+    TransformChain transforms_;
+    std::unique_ptr<FECCodec> fec_;
     KCPStreamCallback *cb_ = nullptr;
+    // the update task on the executor
+    TaskHandle task_;
     uint32_t conv_ = 0;
+    // kcp time unit per millisecond
+    uint32_t tick_ = 1;
     bool closed_ = true;
 };
 
@@ -129,27 +303,47 @@ public:
         std::shared_ptr<UDPInterface> udp, const IP4Address& peer, uint32_t conv);
 
     explicit KCPStreamAdapter(std::unique_ptr<KCPStreamInterface> impl)
-        : impl_(std::move(impl)) {}
+        : guard_(std::make_shared<CallbackGuard>())
+        , impl_(std::move(impl)) {}
 
+    // never blocks, the stream is closed and freed on its executor
     ~KCPStreamAdapter() {
-        executor()->Invoke([this] {
+        guard_->Detach();
+
+        ExecutorInterface *executor = this->executor();
+        if (executor->CanNowExecuted()) {
             impl_->Close();
-            impl_.reset();
+            return;
+        }
+
+        executor->Post([impl = std::move(impl_), guard = guard_] {
+            impl->Close();
         });
     }
 
     bool Open(const KCPConfig& config, KCPStreamCallback *cb) override {
-        return executor()->Invoke(&KCPStreamInterface::Open, impl_.get(), config, cb);
+        guard_->Attach(cb);
+        return executor()->Invoke(&KCPStreamInterface::Open, impl_.get(), config, guard_.get());
     }
 
+    // never blocks, no callback is made once it returns
     void Close() override {
-        return executor()->Invoke(&KCPStreamInterface::Close, impl_.get());
+        guard_->Detach();
+        executor()->Post([impl = impl_.get()] { impl->Close(); });
     }
 
     bool Write(const char *buf, size_t len) override {
         return executor()->Invoke(&KCPStreamInterface::Write, impl_.get(), buf, len);
     }
 
+    bool WriteShared(SharedBuffer buf) override {
+        return executor()->Invoke(&KCPStreamInterface::WriteShared, impl_.get(), std::move(buf));
+    }
+
+    KCPStats stats() override {
+        return executor()->Invoke(&KCPStreamInterface::stats, impl_.get());
+    }
+
     const IP4Address& local_address() const override {
         return impl_->local_address();
     }
@@ -166,6 +360,43 @@ public:
         return impl_->executor();
     }
 private:
+    // forwards to the user callback until Detach, which only waits for a
+    // callback already running
+    class CallbackGuard : public KCPStreamCallback {
+    public:
+        void Attach(KCPStreamCallback *cb) {
+            std::lock_guard<std::recursive_mutex> lock(mutex_);
+            cb_ = cb;
+        }
+
+        void Detach() {
+            std::lock_guard<std::recursive_mutex> lock(mutex_);
+            cb_ = nullptr;
+        }
+
+        void OnRecvKCP(const char *buf, size_t size) override {
+            std::lock_guard<std::recursive_mutex> lock(mutex_);
+            if (cb_) {
+                cb_->OnRecvKCP(buf, size);
+            }
+        }
+
+        bool OnError(const std::error_code& ec) override {
+            std::lock_guard<std::recursive_mutex> lock(mutex_);
+            return cb_ ? cb_->OnError(ec) : true;
+        }
+
+        bool OnRecvKCPMessage(KCPMessage& msg) override {
+            std::lock_guard<std::recursive_mutex> lock(mutex_);
+            return cb_ ? cb_->OnRecvKCPMessage(msg) : true;
+        }
+    private:
+        std::recursive_mutex mutex_;
+        KCPStreamCallback *cb_ = nullptr;
+    };
+
+    // outlives impl_, the stream calls into it until it is closed
+    std::shared_ptr<CallbackGuard> guard_;
     std::unique_ptr<KCPStreamInterface> impl_;
 };
 }
@@ -0,0 +1,305 @@
+#include "kcp_transform.h"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+using namespace kcp;
+
+namespace {
+constexpr size_t kMinMatch = 4;
+constexpr size_t kMaxOffset = 0xffff;
+
+inline uint32_t Load32(const uint8_t *p) {
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// the rest of a 4 bit length as 255 runs
+bool PutLength(uint8_t **op, const uint8_t *oend, size_t n) {
+    uint8_t *p = *op;
+    for (; n >= 255; n -= 255) {
+        if (p == oend) {
+            return false;
+        }
+        *p++ = 255;
+    }
+
+    if (p == oend) {
+        return false;
+    }
+    *p++ = static_cast<uint8_t>(n);
+    *op = p;
+    return true;
+}
+
+bool GetLength(const uint8_t **ip, const uint8_t *iend, size_t *n) {
+    const uint8_t *p = *ip;
+    uint8_t b;
+    do {
+        if (p == iend) {
+            return false;
+        }
+        b = *p++;
+        *n += b;
+    } while (255 == b);
+
+    *ip = p;
+    return true;
+}
+
+// match 0 ends the block with literals only
+bool PutSequence(uint8_t **op, const uint8_t *oend, const uint8_t *lit,
+                 size_t nlit, size_t offset, size_t match) {
+    uint8_t *p = *op;
+    if (p == oend) {
+        return false;
+    }
+
+    size_t ml = match ? match - kMinMatch : 0;
+    uint8_t *token = p++;
+    *token = static_cast<uint8_t>(((std::min)(nlit, size_t(15)) << 4) |
+                                  (std::min)(ml, size_t(15)));
+
+    if (nlit >= 15 && !PutLength(&p, oend, nlit - 15)) {
+        return false;
+    }
+
+    if (static_cast<size_t>(oend - p) < nlit) {
+        return false;
+    }
+    std::memcpy(p, lit, nlit);
+    p += nlit;
+
+    if (match) {
+        if (oend - p < 2) {
+            return false;
+        }
+        *p++ = static_cast<uint8_t>(offset);
+        *p++ = static_cast<uint8_t>(offset >> 8);
+
+        if (ml >= 15 && !PutLength(&p, oend, ml - 15)) {
+            return false;
+        }
+    }
+
+    *op = p;
+    return true;
+}
+}
+
+void TransformChain::Add(std::unique_ptr<DatagramTransform> stage) {
+    overhead_ += stage->overhead();
+    stages_.push_back(std::move(stage));
+}
+
+void TransformChain::Reserve(size_t mtu) {
+    if (buf_.size() < mtu) {
+        buf_.resize(mtu);
+    }
+}
+
+size_t TransformChain::Encode(char *buf, size_t len, size_t cap) {
+    for (auto& stage : stages_) {
+        len = stage->Encode(buf, len, cap);
+        if (0 == len) {
+            break;
+        }
+    }
+
+    return len;
+}
+
+const char *TransformChain::Encode(const char *buf, size_t *len) {
+    Reserve(*len + overhead_);
+    std::memcpy(buf_.data(), buf, *len);
+    *len = Encode(buf_.data(), *len, buf_.size());
+    return *len ? buf_.data() : nullptr;
+}
+
+size_t TransformChain::Decode(const char *buf, size_t len, char *dst, size_t cap) {
+    if (len > cap) {
+        return 0;
+    }
+
+    std::memcpy(dst, buf, len);
+    for (auto it = stages_.rbegin(); it != stages_.rend() && len; ++it) {
+        len = (*it)->Decode(dst, len, cap);
+    }
+
+    return len;
+}
+
+const char *TransformChain::Decode(const char *buf, size_t *len) {
+    *len = Decode(buf, *len, buf_.data(), buf_.size());
+    return *len ? buf_.data() : nullptr;
+}
+
+LZTransform::LZTransform()
+    : table_(size_t(1) << kHashBits, 0), base_(1) {}
+
+size_t LZTransform::Encode(char *buf, size_t len, size_t cap) {
+    if (len < kConvSize || len + kOverhead > cap) {
+        return 0;
+    }
+
+    size_t body = len - kConvSize;
+    uint8_t *p = reinterpret_cast<uint8_t *>(buf) + kConvSize;
+    bytes_in_ += len;
+
+    if (body >= kMinSize) {
+        if (skip_ > 0) {
+            --skip_;
+        } else {
+            // worth it only if it saves 1/32 at least
+            scratch_.resize(body);
+            size_t clen = Compress(p, body, scratch_.data(), body - body / 32 - kOverhead);
+            if (clen > 0) {
+                p[0] = kLZ;
+                std::memcpy(p + 1, scratch_.data(), clen);
+                backoff_ = 0;
+                bytes_out_ += kConvSize + kOverhead + clen;
+                return kConvSize + kOverhead + clen;
+            }
+
+            backoff_ = (std::min)((std::max)(backoff_ * 2, 1), kMaxBackoff);
+            skip_ = backoff_;
+        }
+    }
+
+    std::memmove(p + 1, p, body);
+    p[0] = kRaw;
+    bytes_out_ += len + kOverhead;
+    return len + kOverhead;
+}
+
+size_t LZTransform::Decode(char *buf, size_t len, size_t cap) {
+    if (len < kConvSize + kOverhead || cap < kConvSize) {
+        return 0;
+    }
+
+    size_t body = len - kConvSize - kOverhead;
+    uint8_t *p = reinterpret_cast<uint8_t *>(buf) + kConvSize;
+
+    if (kRaw == p[0]) {
+        std::memmove(p, p + 1, body);
+        return len - kOverhead;
+    }
+
+    if (kLZ != p[0]) {
+        return 0;
+    }
+
+    scratch_.resize(cap - kConvSize);
+    size_t n = Decompress(p + 1, body, scratch_.data(), scratch_.size());
+    if (0 == n) {
+        return 0;
+    }
+
+    std::memcpy(p, scratch_.data(), n);
+    return kConvSize + n;
+}
+
+size_t LZTransform::Compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap) {
+    // entries below base_ belong to earlier datagrams
+    if (base_ > (std::numeric_limits<uint32_t>::max)() - len) {
+        std::fill(table_.begin(), table_.end(), 0);
+        base_ = 1;
+    }
+
+    const uint32_t base = base_;
+    base_ += static_cast<uint32_t>(len);
+
+    uint8_t *op = dst;
+    const uint8_t *oend = dst + cap;
+    size_t anchor = 0;
+    size_t i = 0;
+
+    while (i + kMinMatch <= len) {
+        uint32_t v = Load32(src + i);
+        uint32_t h = (v * 2654435761u) >> (32 - kHashBits);
+        uint32_t ref = table_[h];
+        table_[h] = base + static_cast<uint32_t>(i);
+
+        size_t r = ref - base;
+        if (ref < base || i - r > kMaxOffset || Load32(src + r) != v) {
+            ++i;
+            continue;
+        }
+
+        size_t m = kMinMatch;
+        while (i + m < len && src[r + m] == src[i + m]) {
+            ++m;
+        }
+
+        if (!PutSequence(&op, oend, src + anchor, i - anchor, i - r, m)) {
+            return 0;
+        }
+
+        i += m;
+        anchor = i;
+    }
+
+    if (anchor < len && !PutSequence(&op, oend, src + anchor, len - anchor, 0, 0)) {
+        return 0;
+    }
+
+    return op - dst;
+}
+
+// static
+size_t LZTransform::Decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap) {
+    const uint8_t *ip = src;
+    const uint8_t *iend = src + len;
+    uint8_t *op = dst;
+    const uint8_t *oend = dst + cap;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+
+        size_t nlit = token >> 4;
+        if (15 == nlit && !GetLength(&ip, iend, &nlit)) {
+            return 0;
+        }
+
+        if (static_cast<size_t>(iend - ip) < nlit || static_cast<size_t>(oend - op) < nlit) {
+            return 0;
+        }
+        std::memcpy(op, ip, nlit);
+        op += nlit;
+        ip += nlit;
+
+        if (ip == iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return 0;
+        }
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (0 == offset || offset > static_cast<size_t>(op - dst)) {
+            return 0;
+        }
+
+        size_t match = token & 15;
+        if (15 == match && !GetLength(&ip, iend, &match)) {
+            return 0;
+        }
+        match += kMinMatch;
+
+        if (static_cast<size_t>(oend - op) < match) {
+            return 0;
+        }
+
+        // may overlap, byte by byte repeats the pattern
+        const uint8_t *from = op - offset;
+        for (size_t k = 0; k < match; ++k) {
+            op[k] = from[k];
+        }
+        op += match;
+    }
+
+    return op - dst;
+}
@@ -0,0 +1,95 @@
+#ifndef _KCP_TRANSFORM_H_INCLUDED
+#define _KCP_TRANSFORM_H_INCLUDED
+
+#include "common_types.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace kcp {
+// the per-datagram stages of a session, between kcp and fec. Encode runs
+// them in order on the way out, Decode in reverse on the way in, both in
+// place on buffers of the session's wire mtu.
+class TransformChain {
+public:
+    TransformChain() = default;
+
+    TransformChain(const TransformChain&) = delete;
+    TransformChain& operator =(const TransformChain&) = delete;
+
+    void Add(std::unique_ptr<DatagramTransform> stage);
+    // size of the largest datagram on the wire
+    void Reserve(size_t mtu);
+
+    bool empty() const { return stages_.empty(); }
+    // what all stages may add, the kcp mtu has to leave room for it
+    size_t overhead() const { return overhead_; }
+    size_t capacity() const { return buf_.size(); }
+
+    // buf holds cap bytes, returns the wire length
+    size_t Encode(char *buf, size_t len, size_t cap);
+    // for a read-only datagram, encoded into the chain's own buffer
+    const char *Encode(const char *buf, size_t *len);
+    // into dst of cap bytes, 0 for a malformed datagram
+    size_t Decode(const char *buf, size_t len, char *dst, size_t cap);
+    // into the chain's own buffer, nullptr for a malformed datagram
+    const char *Decode(const char *buf, size_t *len);
+private:
+    std::vector<std::unique_ptr<DatagramTransform>> stages_;
+    size_t overhead_ = 0;
+    std::vector<char> buf_;
+};
+
+// LZ77 with a one byte raw/compressed flag after the conv. small
+// datagrams go out raw, and after one that does not shrink the next
+// attempts back off so incompressible traffic costs little cpu.
+//
+// the compressed body is a sequence of (token, literals, offset, match)
+// with 4 bit literal and match lengths extended by 255 runs, as in lz4
+// blocks. offsets are 16 bit, matches at least 4 bytes.
+class LZTransform : public DatagramTransform {
+public:
+    static constexpr size_t kConvSize = 4;
+    static constexpr size_t kOverhead = 1;
+
+    LZTransform();
+
+    LZTransform(const LZTransform&) = delete;
+    LZTransform& operator =(const LZTransform&) = delete;
+
+    size_t overhead() const override { return kOverhead; }
+    size_t Encode(char *buf, size_t len, size_t cap) override;
+    size_t Decode(char *buf, size_t len, size_t cap) override;
+
+    uint64_t bytes_in() const { return bytes_in_; }
+    uint64_t bytes_out() const { return bytes_out_; }
+
+    // 0 if dst can not hold the result
+    size_t Compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap);
+    static size_t Decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap);
+private:
+    static constexpr int kHashBits = 12;
+    static constexpr size_t kMinMatch = 4;
+    // smaller bodies are headers and acks, not worth a try
+    static constexpr size_t kMinSize = 64;
+    static constexpr int kMaxBackoff = 32;
+
+    enum Flag : uint8_t {
+        kRaw = 0,
+        kLZ = 1,
+    };
+
+    // positions are stored as base_ + offset, older ones are stale
+    std::vector<uint32_t> table_;
+    uint32_t base_ = 0;
+    std::vector<uint8_t> scratch_;
+    int skip_ = 0;
+    int backoff_ = 0;
+    uint64_t bytes_in_ = 0;
+    uint64_t bytes_out_ = 0;
+};
+}
+
+#endif // !_KCP_TRANSFORM_H_INCLUDED
@@ -0,0 +1,146 @@
+#include "segment_pool.h"
+
+using namespace kcp;
+
+namespace {
+constexpr size_t AlignUp(size_t n, size_t align) {
+    return (n + align - 1) / align * align;
+}
+}
+
+SegmentPool::SegmentPool(size_t small_payload, size_t large_payload) {
+    Reserve(sizeof(IKCPSEG) + small_payload);
+    Reserve(sizeof(IKCPSEG) + large_payload);
+}
+
+void *SegmentPool::Allocate(size_t size) {
+    // the smallest class that fits, classes are added in any order
+    size_t i = size_class_count_;
+    for (size_t j = 0; j < size_class_count_; ++j) {
+        if (size <= size_classes_[j].size &&
+            (size_class_count_ == i || size_classes_[j].size < size_classes_[i].size)) {
+            i = j;
+        }
+    }
+
+    if (i < size_class_count_) {
+        auto& size_class = size_classes_[i];
+        if (size_class.free_list ||
+            (DrainRemote() && size_class.free_list)) {
+            ++stats_.hits;
+        } else if (Grow(&size_class)) {
+            ++stats_.misses;
+        } else {
+            return nullptr;
+        }
+
+        BlockHead *head = size_class.free_list;
+        size_class.free_list = head->next;
+        head->owner = this;
+        head->size_class = i;
+
+        ++stats_.in_use;
+        return head + 1;
+    }
+
+    // larger than any class, no session reserved that size
+    auto head = reinterpret_cast<BlockHead *>(new (std::nothrow) char[sizeof(BlockHead) + size]);
+    if (!head) {
+        return nullptr;
+    }
+
+    head->owner = this;
+    head->size_class = kOversize;
+
+    ++stats_.misses;
+    ++stats_.in_use;
+    return head + 1;
+}
+
+void SegmentPool::Deallocate(void *p) {
+    if (!p) {
+        return;
+    }
+
+    BlockHead *head = reinterpret_cast<BlockHead *>(p) - 1;
+    SegmentPool *owner = head->owner;
+    if (this == owner) {
+        Free(head);
+        return;
+    }
+
+    // the owner takes it back on its own thread
+    head->next = owner->remote_free_.load(std::memory_order_relaxed);
+    while (!owner->remote_free_.compare_exchange_weak(
+        head->next, head, std::memory_order_release, std::memory_order_relaxed)) {}
+}
+
+void SegmentPool::Reserve(size_t size) {
+    size = AlignUp(size, sizeof(BlockHead));
+
+    // a class up to a quarter larger serves it well enough
+    for (size_t i = 0; i < size_class_count_; ++i) {
+        if (size <= size_classes_[i].size && size_classes_[i].size <= size + size / 4) {
+            return;
+        }
+    }
+
+    // out of classes, it is served by a larger one or the heap
+    if (size_class_count_ == size_classes_.size()) {
+        return;
+    }
+
+    size_classes_[size_class_count_++].size = size;
+}
+
+AllocatorStats SegmentPool::stats() const {
+    return stats_;
+}
+
+void SegmentPool::Free(BlockHead *head) {
+    --stats_.in_use;
+
+    if (kOversize == head->size_class) {
+        delete [] reinterpret_cast<char *>(head);
+        return;
+    }
+
+    KCP_ASSERT(head->size_class < size_class_count_);
+
+    auto& size_class = size_classes_[head->size_class];
+    head->next = size_class.free_list;
+    size_class.free_list = head;
+}
+
+bool SegmentPool::DrainRemote() {
+    if (!remote_free_.load(std::memory_order_relaxed)) {
+        return false;
+    }
+
+    BlockHead *head = remote_free_.exchange(nullptr, std::memory_order_acquire);
+    while (head) {
+        BlockHead *next = head->next;
+        Free(head);
+        head = next;
+    }
+
+    return true;
+}
+
+bool SegmentPool::Grow(SizeClass *size_class) {
+    size_t stride = sizeof(BlockHead) + size_class->size;
+
+    std::unique_ptr<char[]> slab(new (std::nothrow) char[stride * kBlocksPerSlab]);
+    if (!slab) {
+        return false;
+    }
+
+    for (size_t i = 0; i < kBlocksPerSlab; ++i) {
+        auto head = reinterpret_cast<BlockHead *>(slab.get() + i * stride);
+        head->next = size_class->free_list;
+        size_class->free_list = head;
+    }
+
+    slabs_.push_back(std::move(slab));
+    return true;
+}
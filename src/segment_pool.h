@@ -0,0 +1,69 @@
+#ifndef _SEGMENT_POOL_H_INCLUDED
+#define _SEGMENT_POOL_H_INCLUDED
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+#include "ikcp.h"
+
+#include "common_types.h"
+
+namespace kcp {
+// size-class slab allocator for IKCPSEG, owned by one io thread.
+// blocks are never given back to the heap until the pool is destroyed,
+// so a session in steady state allocates nothing. sessions reserve a
+// class for their mss, a larger mtu or pmtud gets one of its own.
+//
+// a session moved to another thread frees its old blocks from there,
+// they go back to their own pool through a lock-free list.
+class SegmentPool : public AllocatorInterface {
+public:
+    static constexpr size_t kSmallPayload = 128;
+    static constexpr size_t kLargePayload = kKCPMTUDefault;
+    static constexpr size_t kBlocksPerSlab = 64;
+    static constexpr size_t kMaxSizeClasses = 8;
+
+    SegmentPool(size_t small_payload = kSmallPayload,
+                size_t large_payload = kLargePayload);
+
+    SegmentPool(const SegmentPool&) = delete;
+    SegmentPool& operator =(const SegmentPool&) = delete;
+
+    void *Allocate(size_t size) override;
+    void Deallocate(void *p) override;
+    void Reserve(size_t size) override;
+    AllocatorStats stats() const override;
+private:
+    struct alignas(std::max_align_t) BlockHead {
+        union {
+            // while free
+            BlockHead *next;
+            // while in use
+            SegmentPool *owner;
+        };
+        size_t size_class;
+    };
+
+    struct SizeClass {
+        size_t size = 0;
+        BlockHead *free_list = nullptr;
+    };
+
+    static constexpr size_t kOversize = (std::numeric_limits<size_t>::max)();
+
+    bool Grow(SizeClass *size_class);
+    void Free(BlockHead *head);
+    // takes back the blocks other threads freed
+    bool DrainRemote();
+
+    std::array<SizeClass, kMaxSizeClasses> size_classes_;
+    size_t size_class_count_ = 0;
+    std::vector<std::unique_ptr<char[]>> slabs_;
+    AllocatorStats stats_;
+    std::atomic<BlockHead *> remote_free_{ nullptr };
+};
+}
+
+#endif // !_SEGMENT_POOL_H_INCLUDED
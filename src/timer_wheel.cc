@@ -0,0 +1,287 @@
+#include "timer_wheel.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#include <algorithm>
+
+using namespace kcp;
+
+namespace {
+constexpr uint64_t kTickMask = (uint64_t(1) << TimerWheel::kTickBits) - 1;
+
+inline int CountTrailingZeros(uint64_t v) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward64(&index, v);
+    return static_cast<int>(index);
+#else
+    return __builtin_ctzll(v);
+#endif
+}
+
+inline void InitHead(TaskNode *head) {
+    head->prev = head;
+    head->next = head;
+}
+}
+
+TimerWheel::TimerWheel() {
+    for (auto& level : slots_) {
+        for (auto& head : level) {
+            InitHead(&head);
+        }
+    }
+
+    InitHead(&expired_);
+}
+
+void TimerWheel::Schedule(void *key, TaskInterface *task, uint64_t deadline) {
+    TaskNode *node = &task->task_node_;
+    if (node->prev) {
+        Unlink(node);
+    } else {
+        ++count_;
+    }
+
+    node->key = key;
+    node->task = task;
+    // rounded up, a task never runs before its deadline
+    node->tick = (deadline + kTickMask) >> kTickBits;
+    Link(node);
+}
+
+void TimerWheel::Reschedule(TaskInterface *task, uint64_t deadline) {
+    Schedule(task->task_node_.key, task, deadline);
+}
+
+bool TimerWheel::Cancel(TaskInterface *task) {
+    TaskNode *node = &task->task_node_;
+    if (!node->prev) {
+        return false;
+    }
+
+    Unlink(node);
+    --count_;
+    return true;
+}
+
+TaskInterface *TimerWheel::PopExpired(uint64_t now) {
+    // ticks up to limit start before now
+    uint64_t limit = now >> kTickBits;
+
+    while (expired_.next == &expired_) {
+        if (0 == count_) {
+            now_tick_ = (std::max)(now_tick_, limit + 1);
+            return nullptr;
+        }
+
+        uint64_t tick = NextTick();
+        if (tick > limit) {
+            return nullptr;
+        }
+
+        now_tick_ = tick;
+        ProcessTick();
+    }
+
+    TaskNode *node = expired_.next;
+    Unlink(node);
+    --count_;
+    return node->task;
+}
+
+uint64_t TimerWheel::NextDelay(uint64_t now) const {
+    if (0 == count_) {
+        return kNever;
+    }
+
+    if (expired_.next != &expired_) {
+        return 0;
+    }
+
+    // a cascade may come first, the delay is a lower bound then
+    uint64_t deadline = NextTick() << kTickBits;
+    return deadline > now ? deadline - now : 0;
+}
+
+void TimerWheel::Take(void *key, std::vector<TaskInterface *> *tasks) {
+    for (auto& level : slots_) {
+        for (auto& head : level) {
+            TakeList(&head, key, false, tasks);
+        }
+    }
+
+    TakeList(&expired_, key, false, tasks);
+}
+
+void TimerWheel::TakeAll(std::vector<TaskInterface *> *tasks) {
+    for (auto& level : slots_) {
+        for (auto& head : level) {
+            TakeList(&head, nullptr, true, tasks);
+        }
+    }
+
+    TakeList(&expired_, nullptr, true, tasks);
+}
+
+void TimerWheel::Link(TaskNode *node) {
+    uint64_t tick = node->tick;
+    if (tick < now_tick_) {
+        Append(&expired_, node, kExpired);
+        return;
+    }
+
+    // the level of the highest slot digit that differs from now
+    uint64_t diff = tick ^ now_tick_;
+    int level = 0;
+    while (level < kLevels - 1 && (diff >> (kSlotBits * (level + 1)))) {
+        ++level;
+    }
+
+    // the top level wraps around, a slot behind now is a revolution away
+    uint32_t index;
+    if ((tick - now_tick_) >> (kSlotBits * kLevels)) {
+        // beyond the wheel, parked in the top slot cascaded last
+        index = ((now_tick_ >> (kSlotBits * level)) + kSlots - 1) & (kSlots - 1);
+    } else {
+        index = (tick >> (kSlotBits * level)) & (kSlots - 1);
+    }
+
+    Append(&slots_[level][index], node, level * kSlots + index);
+}
+
+void TimerWheel::Unlink(TaskNode *node) {
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+
+    uint32_t slot = node->slot;
+    if (kExpired != slot) {
+        TaskNode *head = &slots_[slot / kSlots][slot % kSlots];
+        if (head->next == head) {
+            bits_[slot / kSlots][slot % kSlots / 64] &= ~(uint64_t(1) << (slot % 64));
+        }
+    }
+
+    node->prev = nullptr;
+    node->next = nullptr;
+}
+
+void TimerWheel::Append(TaskNode *head, TaskNode *node, uint32_t slot) {
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+
+    node->slot = slot;
+    if (kExpired != slot) {
+        bits_[slot / kSlots][slot % kSlots / 64] |= uint64_t(1) << (slot % 64);
+    }
+}
+
+int TimerWheel::FindSlot(int level, int from) const {
+    constexpr int kWords = kSlots / 64;
+    const uint64_t *bits = bits_[level];
+
+    // the first word twice, above from then below it
+    for (int i = 0; i <= kWords; ++i) {
+        int word = (from / 64 + i) % kWords;
+        uint64_t v = bits[word];
+        if (0 == i) {
+            v &= ~uint64_t(0) << (from % 64);
+        } else if (kWords == i) {
+            v &= ~(~uint64_t(0) << (from % 64));
+        }
+
+        if (v) {
+            return word * 64 + CountTrailingZeros(v);
+        }
+    }
+
+    return -1;
+}
+
+uint64_t TimerWheel::NextTick() const {
+    uint64_t next = kNever;
+
+    for (int level = 0; level < kLevels; ++level) {
+        int shift = kSlotBits * level;
+        int current = static_cast<int>(now_tick_ >> shift) & (kSlots - 1);
+        // the current slot waits for its cascade only on a boundary
+        bool pending = 0 == (now_tick_ & ((uint64_t(1) << shift) - 1));
+        int from = pending ? current : (current + 1) & (kSlots - 1);
+
+        int index = FindSlot(level, from);
+        if (index < 0) {
+            continue;
+        }
+
+        uint64_t span = uint64_t(1) << (shift + kSlotBits);
+        uint64_t tick = (now_tick_ & ~(span - 1)) + (uint64_t(index) << shift);
+        if (tick < now_tick_) {
+            tick += span;
+        }
+
+        next = (std::min)(next, tick);
+    }
+
+    return next;
+}
+
+void TimerWheel::Cascade(int level, int index) {
+    TaskNode *head = &slots_[level][index];
+    if (head->next == head) {
+        return;
+    }
+
+    TaskNode list;
+    list.next = head->next;
+    list.prev = head->prev;
+    list.next->prev = &list;
+    list.prev->next = &list;
+    InitHead(head);
+    bits_[level][index / 64] &= ~(uint64_t(1) << (index % 64));
+
+    while (list.next != &list) {
+        TaskNode *node = list.next;
+        list.next = node->next;
+        node->next->prev = &list;
+        Link(node);
+    }
+}
+
+void TimerWheel::ProcessTick() {
+    // top down, so a cascade may refill the slot below it
+    for (int level = kLevels - 1; level > 0; --level) {
+        int shift = kSlotBits * level;
+        if (0 == (now_tick_ & ((uint64_t(1) << shift) - 1))) {
+            Cascade(level, static_cast<int>(now_tick_ >> shift) & (kSlots - 1));
+        }
+    }
+
+    int index = static_cast<int>(now_tick_) & (kSlots - 1);
+    TaskNode *head = &slots_[0][index];
+    while (head->next != head) {
+        TaskNode *node = head->next;
+        Unlink(node);
+        Append(&expired_, node, kExpired);
+    }
+
+    ++now_tick_;
+}
+
+void TimerWheel::TakeList(TaskNode *head, void *key, bool all,
+                          std::vector<TaskInterface *> *tasks) {
+    TaskNode *node = head->next;
+    while (node != head) {
+        TaskNode *next = node->next;
+        if (all || node->key == key) {
+            Unlink(node);
+            --count_;
+            tasks->push_back(node->task);
+        }
+
+        node = next;
+    }
+}
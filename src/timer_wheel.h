@@ -0,0 +1,72 @@
+#ifndef _TIMER_WHEEL_H_INCLUDED
+#define _TIMER_WHEEL_H_INCLUDED
+
+#include "common_types.h"
+
+#include <cstdint>
+#include <vector>
+
+namespace kcp {
+// hierarchical timing wheel of TaskInterface deadlines in NowUs64
+// microseconds. 4 levels of 256 slots over 64us ticks cover 2^38us, a
+// task is linked into its slot through its own TaskNode, so scheduling
+// is O(1) without allocation. a task runs once its deadline has passed,
+// at most a tick late, and is linked into one wheel at a time.
+//
+// the wheel keeps its own clock in ticks, advanced by PopExpired. it
+// jumps to now whenever the wheel runs empty
+class TimerWheel {
+public:
+    static constexpr int kTickBits = 6;
+    static constexpr uint64_t kNever = (std::numeric_limits<uint64_t>::max)();
+
+    TimerWheel();
+
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator =(const TimerWheel&) = delete;
+
+    bool empty() const { return 0 == count_; }
+    size_t size() const { return count_; }
+
+    // moves the task if it is scheduled already
+    void Schedule(void *key, TaskInterface *task, uint64_t deadline);
+    // keeps the key it was scheduled with
+    void Reschedule(TaskInterface *task, uint64_t deadline);
+    // false if the task was not scheduled
+    bool Cancel(TaskInterface *task);
+
+    // the next task due by now, nullptr if none
+    TaskInterface *PopExpired(uint64_t now);
+    // microseconds from now to the next tick with work, kNever if empty
+    uint64_t NextDelay(uint64_t now) const;
+
+    // unlinks the tasks of key, or all of them for TakeAll
+    void Take(void *key, std::vector<TaskInterface *> *tasks);
+    void TakeAll(std::vector<TaskInterface *> *tasks);
+private:
+    static constexpr int kLevels = 4;
+    static constexpr int kSlotBits = 8;
+    static constexpr int kSlots = 1 << kSlotBits;
+    static constexpr uint32_t kExpired = kLevels * kSlots;
+
+    void Link(TaskNode *node);
+    void Unlink(TaskNode *node);
+    void Append(TaskNode *head, TaskNode *node, uint32_t slot);
+    // slots of a level from 'from' on, circular. -1 if all are empty
+    int FindSlot(int level, int from) const;
+    uint64_t NextTick() const;
+    void Cascade(int level, int index);
+    void ProcessTick();
+    void TakeList(TaskNode *head, void *key, bool all,
+                  std::vector<TaskInterface *> *tasks);
+
+    TaskNode slots_[kLevels][kSlots];
+    uint64_t bits_[kLevels][kSlots / 64] = {};
+    TaskNode expired_;
+    // ticks before now_tick_ are processed
+    uint64_t now_tick_ = 0;
+    size_t count_ = 0;
+};
+}
+
+#endif // !_TIMER_WHEEL_H_INCLUDED
@@ -6,12 +6,27 @@
 #include "common_types.h"
 
 namespace kcp {
+struct UDPDatagram {
+    const char *buf;
+    size_t len;
+};
+
 class UDPCallback {
 protected:
     virtual ~UDPCallback() = default;
 public:
     virtual bool OnRecvUDP(const IP4Address& from, const char *buf, size_t len) = 0;
     virtual bool OnError(const std::error_code& ec) = 0;
+
+    // datagrams from one peer read in a row
+    virtual bool OnRecvUDPBatch(const IP4Address& from, const UDPDatagram *datagrams, size_t count) {
+        bool ok = true;
+        for (size_t i = 0; i < count; ++i) {
+            ok = OnRecvUDP(from, datagrams[i].buf, datagrams[i].len) && ok;
+        }
+
+        return ok;
+    }
 };
 
 class UDPInterface {
@@ -21,21 +36,38 @@ public:
     virtual bool Open(UDPCallback *cb) = 0;
     virtual void Close() = 0;
     virtual void SetRecvBufSize(size_t recv_size) = 0;
+    // datagrams over the path mtu are dropped instead of fragmented, for
+    // mtu probing. false if the socket can not do it
+    virtual bool SetDontFragment(bool enable) = 0;
     virtual bool Send(const IP4Address& to, const char *buf, size_t len) = 0;
     virtual const IP4Address& local_address() const = 0;
     virtual ExecutorInterface *executor() = 0;
+
+    // datagrams to one peer in a row, taken before it returns
+    virtual bool SendBatch(const IP4Address& to, const UDPDatagram *datagrams, size_t count) {
+        bool ok = true;
+        for (size_t i = 0; i < count; ++i) {
+            ok = Send(to, datagrams[i].buf, datagrams[i].len) && ok;
+        }
+
+        return ok;
+    }
 };
 
 class IOContextInterface {
 protected:
     virtual ~IOContextInterface() = default;
 public:
-    static std::shared_ptr<IOContextInterface> Create(size_t thread_num);
+    static std::shared_ptr<IOContextInterface> Create(
+        size_t thread_num, const ExecutorConfig& config = ExecutorConfig());
 
     virtual void Start() = 0;
     virtual void Stop() = 0;
     virtual std::shared_ptr<UDPInterface> CreateUDP(const IP4Address& addr) = 0;
     virtual ExecutorInterface *executor() = 0;
+    // moves one socket off the thread that was busiest since the last
+    // call, if that evens the load out
+    virtual void Rebalance() = 0;
 };
 }
 
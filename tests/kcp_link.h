@@ -0,0 +1,156 @@
+#ifndef _KCP_LINK_H_INCLUDED
+#define _KCP_LINK_H_INCLUDED
+
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "ikcp.h"
+
+// two ikcpcb back to back over a simulated link. each direction has a
+// fixed delay, drops datagrams over its mtu, and loses others at random
+// from a seeded generator or as a drop function picks them. time only
+// moves in Step, so every run is the same
+class KCPLink {
+public:
+    // cmd values of the wire format, see ikcp.c
+    static constexpr uint8_t kCmdPush = 81;
+    static constexpr uint8_t kCmdAck = 82;
+    static constexpr uint8_t kCmdSack = 85;
+    static constexpr uint8_t kCmdPmtu = 86;
+    static constexpr size_t kHeadSize = 24;
+
+    struct Datagram {
+        uint32_t at;
+        std::string data;
+    };
+
+    struct Direction {
+        uint32_t delay = 10;
+        // 0 carries any size
+        uint32_t mtu = 0;
+        double loss = 0;
+        // true drops the datagram, n counts the datagrams sent this way
+        std::function<bool(const std::string& data, uint64_t n)> drop;
+        // called for every datagram sent this way, dropped or not
+        std::function<void(const std::string& data)> watch;
+
+        uint64_t sent = 0;
+        uint64_t dropped = 0;
+        std::deque<Datagram> queue;
+    };
+
+    explicit KCPLink(uint32_t conv = 1, uint32_t seed = 1)
+        : rng_(seed)
+        , a_end_{ this, &ab }
+        , b_end_{ this, &ba } {
+        a = ikcp_create(conv, &a_end_);
+        b = ikcp_create(conv, &b_end_);
+        a->output = &KCPLink::Output;
+        b->output = &KCPLink::Output;
+        ikcp_nodelay(a, 1, 10, 2, 1);
+        ikcp_nodelay(b, 1, 10, 2, 1);
+    }
+
+    ~KCPLink() {
+        ikcp_release(a);
+        ikcp_release(b);
+    }
+
+    KCPLink(const KCPLink&) = delete;
+    KCPLink& operator =(const KCPLink&) = delete;
+
+    // one ms: both ends update, then what is due arrives
+    void Step() {
+        ikcp_update(a, now);
+        ikcp_update(b, now);
+        Deliver(&ab, b);
+        Deliver(&ba, a);
+        ++now;
+    }
+
+    // steps until done returns true, false if limit ms pass first
+    bool RunUntil(const std::function<bool()>& done, uint32_t limit) {
+        for (uint32_t end = now + limit; now != end;) {
+            if (done()) {
+                return true;
+            }
+            Step();
+        }
+        return done();
+    }
+
+    // the first segment header of a datagram
+    static uint8_t Cmd(const std::string& data) {
+        return data.size() >= kHeadSize ? static_cast<uint8_t>(data[4]) : 0;
+    }
+
+    static uint32_t Sn(const std::string& data) {
+        return data.size() >= kHeadSize ? Get32(data.data() + 12) : 0;
+    }
+
+    // number of segments with cmd in a datagram
+    static int CountCmd(const std::string& data, uint8_t cmd) {
+        int count = 0;
+        for (size_t off = 0; off + kHeadSize <= data.size();) {
+            count += static_cast<uint8_t>(data[off + 4]) == cmd;
+            off += kHeadSize + Get32(data.data() + off + 20);
+        }
+        return count;
+    }
+
+    ikcpcb *a = nullptr;
+    ikcpcb *b = nullptr;
+    Direction ab;
+    Direction ba;
+    uint32_t now = 0;
+private:
+    struct End {
+        KCPLink *link;
+        Direction *out;
+    };
+
+    static uint32_t Get32(const char *p) {
+        const uint8_t *u = reinterpret_cast<const uint8_t *>(p);
+        return u[0] | (u[1] << 8) | (u[2] << 16) | (static_cast<uint32_t>(u[3]) << 24);
+    }
+
+    static int Output(const char *buf, int len, ikcpcb *, void *user) {
+        End *end = static_cast<End *>(user);
+        end->link->Send(end->out, std::string(buf, len));
+        return 0;
+    }
+
+    void Send(Direction *dir, std::string data) {
+        uint64_t n = dir->sent++;
+        if (dir->watch) {
+            dir->watch(data);
+        }
+        bool lost = (dir->mtu > 0 && data.size() > dir->mtu) ||
+            (dir->drop && dir->drop(data, n)) ||
+            (dir->loss > 0 && std::uniform_real_distribution<double>(0, 1)(rng_) < dir->loss);
+        if (lost) {
+            ++dir->dropped;
+            return;
+        }
+        dir->queue.push_back({ now + dir->delay, std::move(data) });
+    }
+
+    void Deliver(Direction *dir, ikcpcb *to) {
+        while (!dir->queue.empty() && static_cast<int32_t>(now - dir->queue.front().at) >= 0) {
+            Datagram d = std::move(dir->queue.front());
+            dir->queue.pop_front();
+            ikcp_input(to, d.data.data(), static_cast<long>(d.data.size()));
+        }
+    }
+
+    std::mt19937 rng_;
+    End a_end_;
+    End b_end_;
+};
+
+#endif // !_KCP_LINK_H_INCLUDED
@@ -0,0 +1,157 @@
+// FECCodec under chosen losses: every k of the k + m shards of a group
+// rebuild it, a partial group gets its share of parity and the adaptive
+// parity follows the loss the peer reports
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "kcp_fec.h"
+#include "test_util.h"
+
+using namespace kcp;
+
+namespace {
+struct Collector : FECCallback {
+    std::vector<std::string> out;
+    std::vector<std::string> data;
+
+    void OnFECOutput(const char *buf, size_t len) override {
+        out.emplace_back(buf, len);
+    }
+
+    void OnFECData(const char *buf, size_t len) override {
+        data.emplace_back(buf, len);
+    }
+};
+
+// kcp datagrams start with the conv, the sizes differ so padding and the
+// length prefix are covered
+std::string Datagram(int i) {
+    std::string d(24 + i * 37, 0);
+    std::memcpy(&d[0], "conv", 4);
+    for (size_t j = 4; j < d.size(); ++j) {
+        d[j] = static_cast<char>(i * 31 + j);
+    }
+    return d;
+}
+
+// any 4 of the 6 shards of a 4 + 2 group give back the 4 datagrams
+int CheckAnyKOfN() {
+    constexpr int k = 4, m = 2;
+    Collector enc;
+    FECCodec encoder(&enc, k, m, false, 10);
+    std::vector<std::string> sent;
+    for (int i = 0; i < k; ++i) {
+        sent.push_back(Datagram(i));
+        encoder.Encode(sent.back().data(), sent.back().size());
+    }
+    TEST_CHECK(enc.out.size() == static_cast<size_t>(k + m));
+
+    std::sort(sent.begin(), sent.end());
+    for (int mask = 0; mask < (1 << (k + m)); ++mask) {
+        int kept = 0;
+        for (int i = 0; i < k + m; ++i) {
+            kept += (mask >> i) & 1;
+        }
+        if (kept != k) {
+            continue;
+        }
+
+        Collector dec;
+        FECCodec decoder(&dec, k, m, false, 10);
+        for (int i = 0; i < k + m; ++i) {
+            if (mask & (1 << i)) {
+                TEST_CHECK(decoder.Decode(enc.out[i].data(), enc.out[i].size()));
+            }
+        }
+
+        std::sort(dec.data.begin(), dec.data.end());
+        TEST_CHECK(dec.data == sent);
+    }
+
+    return 0;
+}
+
+// 2 datagrams of a 4 + 2 group closed by the delay carry one parity,
+// which rebuilds either of them
+int CheckPartialGroup() {
+    constexpr int k = 4, m = 2;
+    constexpr uint32_t delay = 10;
+    Collector enc;
+    FECCodec encoder(&enc, k, m, false, delay);
+    std::string a = Datagram(1), b = Datagram(2);
+    encoder.Encode(a.data(), a.size());
+    encoder.Encode(b.data(), b.size());
+    encoder.Flush(100);
+    TEST_CHECK(enc.out.size() == 2);
+    encoder.Flush(100 + delay);
+    TEST_CHECK(enc.out.size() == 3);
+
+    for (int lost = 0; lost < 2; ++lost) {
+        Collector dec;
+        FECCodec decoder(&dec, k, m, false, delay);
+        TEST_CHECK(decoder.Decode(enc.out[1 - lost].data(), enc.out[1 - lost].size()));
+        TEST_CHECK(decoder.Decode(enc.out[2].data(), enc.out[2].size()));
+        TEST_CHECK(dec.data.size() == 2);
+        TEST_CHECK(dec.data[1] == (lost ? b : a));
+        TEST_CHECK(decoder.recovered() == 1);
+    }
+
+    return 0;
+}
+
+// a decoder losing one shard in six reports ~17%, and an adaptive encoder
+// hearing it sends (10 * 17 * 2 + 99) / 100 + 1 = 5 parity per group
+int CheckAdaptiveParity() {
+    constexpr int k = 4, m = 2;
+    Collector enc, dec;
+    FECCodec encoder(&enc, k, m, false, 10);
+    FECCodec decoder(&dec, k, m, false, 10);
+    for (int g = 0; g < 300; ++g) {
+        enc.out.clear();
+        for (int i = 0; i < k; ++i) {
+            std::string d = Datagram(i);
+            encoder.Encode(d.data(), d.size());
+        }
+        // the second parity never arrives
+        for (int i = 0; i < k + 1; ++i) {
+            TEST_CHECK(decoder.Decode(enc.out[i].data(), enc.out[i].size()));
+        }
+    }
+    TEST_CHECK(decoder.loss() == 17);
+
+    // the loss goes back in the trailer of what the decoder's side sends
+    Collector back, adaptive_out;
+    FECCodec reply(&back, 10, 8, false, 10);
+    FECCodec adaptive(&adaptive_out, 10, 8, true, 10);
+    TEST_CHECK(adaptive.parity_shards() == 1);
+
+    // the loss the decoder measured, as its own encoder would report it
+    std::string d = Datagram(0);
+    reply.Encode(d.data(), d.size());
+    std::string reported = back.out[0];
+    reported.back() = static_cast<char>(decoder.loss());
+    TEST_CHECK(adaptive.Decode(reported.data(), reported.size()));
+
+    // the group open still has the old parity, the next one follows
+    for (int i = 0; i < 10; ++i) {
+        adaptive.Encode(d.data(), d.size());
+    }
+    TEST_CHECK(adaptive.parity_shards() == 5);
+    adaptive_out.out.clear();
+    for (int i = 0; i < 10; ++i) {
+        adaptive.Encode(d.data(), d.size());
+    }
+    TEST_CHECK(adaptive_out.out.size() == 10 + 5);
+
+    return 0;
+}
+}
+
+int main() {
+    TEST_RUN(CheckAnyKOfN);
+    TEST_RUN(CheckPartialGroup);
+    TEST_RUN(CheckAdaptiveParity);
+    return 0;
+}
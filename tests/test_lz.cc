@@ -0,0 +1,157 @@
+// LZTransform round trips compressible and random bodies, directly and
+// through Encode/Decode, and Decompress stays inside its buffers for
+// random, truncated and corrupted input
+#include <algorithm>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "kcp_transform.h"
+#include "test_util.h"
+
+using namespace kcp;
+
+namespace {
+typedef std::vector<uint8_t> Bytes;
+
+// words and copies of earlier runs, any distance or length the format
+// has, with entropy percent random bytes between them
+Bytes Body(std::mt19937 *rng, size_t len, int entropy) {
+    static const char *kWords[] = { "kcp ", "segment ", "window ", "ack ", "probe " };
+    Bytes b;
+    std::uniform_int_distribution<int> byte(0, 255), pct(0, 99);
+    while (b.size() < len) {
+        if (pct(*rng) < entropy) {
+            b.push_back(static_cast<uint8_t>(byte(*rng)));
+        } else if (b.size() > 16 && pct(*rng) < 50) {
+            size_t offset = 1 + (*rng)() % (std::min)(b.size(), size_t(65535));
+            for (size_t n = 4 + (*rng)() % 300; n > 0; --n) {
+                b.push_back(b[b.size() - offset]);
+            }
+        } else {
+            const char *w = kWords[(*rng)() % 5];
+            b.insert(b.end(), w, w + std::strlen(w));
+        }
+    }
+    b.resize(len);
+    return b;
+}
+
+// worst case of the format: one literal run with its length bytes
+size_t Bound(size_t len) {
+    return len + len / 255 + 16;
+}
+
+int CheckRoundTrip() {
+    std::mt19937 rng(20);
+    LZTransform lz;
+    for (size_t len : { 1, 4, 15, 16, 64, 270, 1400, 9000, 70000 }) {
+        for (int entropy : { 0, 5, 50, 100 }) {
+            Bytes src = Body(&rng, len, entropy);
+            Bytes packed(Bound(len));
+            size_t n = lz.Compress(src.data(), len, packed.data(), packed.size());
+            TEST_CHECK(n > 0);
+            if (0 == entropy && len >= 270) {
+                TEST_CHECK(n < len / 2);
+            }
+
+            Bytes out(len);
+            TEST_CHECK(LZTransform::Decompress(packed.data(), n, out.data(), out.size()) == len);
+            TEST_CHECK(out == src);
+            // one byte short of the output is refused
+            TEST_CHECK(LZTransform::Decompress(packed.data(), n, out.data(), len - 1) == 0);
+        }
+    }
+    return 0;
+}
+
+// datagrams with a conv through two transforms, compressed or raw
+int CheckDatagrams() {
+    std::mt19937 rng(21);
+    LZTransform out, in;
+    for (int i = 0; i < 500; ++i) {
+        size_t len = LZTransform::kConvSize + rng() % 1400;
+        Bytes d = Body(&rng, len, i % 3 ? 2 : 100);
+        std::vector<char> buf(d.begin(), d.end());
+        buf.resize(1400 + LZTransform::kOverhead + LZTransform::kConvSize);
+
+        size_t n = out.Encode(buf.data(), len, buf.size());
+        TEST_CHECK(n > 0);
+        TEST_CHECK(n <= len + LZTransform::kOverhead);
+        TEST_CHECK(in.Decode(buf.data(), n, buf.size()) == len);
+        TEST_CHECK(std::memcmp(d.data(), buf.data(), len) == 0);
+    }
+    TEST_CHECK(out.bytes_out() < out.bytes_in());
+    return 0;
+}
+
+// whatever the input, the result fits cap and ASAN sees no access
+// outside src or dst
+int CheckDecompressBounds() {
+    std::mt19937 rng(22);
+    std::uniform_int_distribution<int> byte(0, 255);
+    LZTransform lz;
+    for (int i = 0; i < 20000; ++i) {
+        Bytes src;
+        switch (i % 4) {
+        case 0: {
+            // random bytes
+            src.resize(rng() % 600);
+            for (uint8_t& c : src) {
+                c = static_cast<uint8_t>(byte(rng));
+            }
+            break;
+        }
+        default: {
+            // a valid stream, truncated or with bytes changed
+            Bytes body = Body(&rng, 1 + rng() % 2000, 5);
+            src.resize(Bound(body.size()));
+            src.resize(lz.Compress(body.data(), body.size(), src.data(), src.size()));
+            if (i % 4 == 1) {
+                src.resize(rng() % (src.size() + 1));
+            } else {
+                for (int k = 1 + rng() % 4; k > 0 && !src.empty(); --k) {
+                    src[rng() % src.size()] = static_cast<uint8_t>(byte(rng));
+                }
+            }
+            break;
+        }
+        }
+
+        // exact sized heap buffers so any overrun is caught
+        size_t cap = 1 + rng() % 2500;
+        Bytes in(src), dst(cap);
+        size_t n = LZTransform::Decompress(in.empty() ? nullptr : in.data(), in.size(), dst.data(), cap);
+        TEST_CHECK(n <= cap);
+    }
+    return 0;
+}
+
+// a datagram flagged compressed with a body that is not, decoded into
+// buffers just large enough for the wire
+int CheckDecodeGarbage() {
+    std::mt19937 rng(23);
+    std::uniform_int_distribution<int> byte(0, 255);
+    LZTransform lz;
+    for (int i = 0; i < 5000; ++i) {
+        size_t len = LZTransform::kConvSize + LZTransform::kOverhead + rng() % 200;
+        size_t cap = len + rng() % 200;
+        std::vector<char> buf(cap);
+        for (size_t k = 0; k < len; ++k) {
+            buf[k] = static_cast<char>(byte(rng));
+        }
+        buf[LZTransform::kConvSize] = 1;
+        TEST_CHECK(lz.Decode(buf.data(), len, cap) <= cap);
+    }
+    return 0;
+}
+}
+
+int main() {
+    TEST_RUN(CheckRoundTrip);
+    TEST_RUN(CheckDatagrams);
+    TEST_RUN(CheckDecompressBounds);
+    TEST_RUN(CheckDecodeGarbage);
+    return 0;
+}
@@ -0,0 +1,129 @@
+// sockets moved back and forth between io threads while an echo runs
+// over them: every message comes back once, whole and in order, and
+// each move lands on the thread asked for
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "asio_udp.h"
+#include "kcp_stream.h"
+#include "test_util.h"
+
+using namespace kcp;
+
+namespace {
+constexpr int kCount = 2000;
+
+std::string Message(int seq) {
+    std::string m(4 + (seq * 7919) % 3000, 0);
+    for (size_t i = 4; i < m.size(); ++i) {
+        m[i] = static_cast<char>(seq + i);
+    }
+    std::memcpy(&m[0], &seq, 4);
+    return m;
+}
+
+struct Echo : KCPStreamCallback {
+    std::unique_ptr<KCPStreamInterface> stream;
+
+    void OnRecvKCP(const char *buf, size_t size) override {
+        stream->Write(buf, size);
+    }
+
+    bool OnError(const std::error_code&) override { return false; }
+};
+
+struct Sender : KCPStreamCallback {
+    std::unique_ptr<KCPStreamInterface> stream;
+    std::atomic<int> got{ 0 };
+    std::atomic<int> bad{ 0 };
+
+    void OnRecvKCP(const char *buf, size_t size) override {
+        if (std::string(buf, size) != Message(got)) {
+            ++bad;
+        }
+        ++got;
+    }
+
+    bool OnError(const std::error_code&) override {
+        ++bad;
+        return false;
+    }
+};
+
+// done runs once per try, it may have side effects
+bool WaitFor(const std::function<bool()>& done) {
+    for (int i = 0; i < 2000; ++i) {
+        if (done()) {
+            return true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    return false;
+}
+
+int CheckEchoAcrossMoves() {
+    auto ctx = AsioIOContext::Create(1, ExecutorConfig());
+    ctx->Start();
+    std::shared_ptr<IOContextThread> threads[2] = {
+        std::make_shared<IOContextThread>(ExecutorConfig()),
+        std::make_shared<IOContextThread>(ExecutorConfig()),
+    };
+    for (auto&& thread : threads) {
+        thread->Start();
+    }
+
+    IP4Address a("127.0.0.1", 17390), b("127.0.0.1", 17391);
+    auto ua = std::static_pointer_cast<AsioUDP>(ctx->CreateUDP(a));
+    auto ub = std::static_pointer_cast<AsioUDP>(ctx->CreateUDP(b));
+    TEST_CHECK(ua && ub);
+
+    Sender sender;
+    Echo echo;
+    KCPConfig config;
+    config.sndwnd = config.rcvwnd = 256;
+    sender.stream = KCPStreamAdapter::Create(ua, b, 9);
+    echo.stream = KCPStreamAdapter::Create(ub, a, 9);
+    TEST_CHECK(sender.stream->Open(config, &sender));
+    TEST_CHECK(echo.stream->Open(config, &echo));
+
+    // every 100 messages one of the sockets moves to the other thread
+    int moves = 0;
+    for (int i = 0; i < kCount; ++i) {
+        std::string m = Message(i);
+        TEST_CHECK(WaitFor([&] { return sender.stream->Write(m.data(), m.size()); }));
+        if (i % 100 == 99) {
+            auto& udp = (moves % 2) ? ub : ua;
+            auto& to = threads[(moves / 2) % 2];
+            udp->MigrateTo(to);
+            TEST_CHECK(WaitFor([&] { return udp->thread() == to.get(); }));
+            ++moves;
+        }
+    }
+
+    TEST_CHECK(WaitFor([&] { return sender.got == kCount || sender.bad > 0; }));
+    TEST_CHECK(sender.bad == 0);
+    TEST_CHECK(sender.got == kCount);
+    TEST_CHECK(moves == kCount / 100);
+
+    sender.stream.reset();
+    echo.stream.reset();
+    ua.reset();
+    ub.reset();
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    ctx->Stop();
+    for (auto&& thread : threads) {
+        thread->Stop();
+    }
+    return 0;
+}
+}
+
+int main() {
+    TEST_RUN(CheckEchoAcrossMoves);
+    return 0;
+}
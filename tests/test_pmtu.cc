@@ -0,0 +1,77 @@
+// path mtu discovery between two ikcpcb: probes raise the mtu to what the
+// link carries, and when the path shrinks under it the lost segments
+// bring it down to the floor and the search settles below the new path
+#include <string>
+#include <vector>
+
+#include "kcp_link.h"
+#include "test_util.h"
+
+namespace {
+constexpr int kSize = 3000;
+
+struct Transfer {
+    KCPLink link;
+    int sent = 0;
+    int got = 0;
+    bool bad = false;
+    std::vector<char> buf = std::vector<char>(1 << 16);
+
+    Transfer(int max_mtu, int min_mtu, uint32_t path) : link(1, 3) {
+        for (ikcpcb *kcp : { link.a, link.b }) {
+            ikcp_setcaps(kcp, IKCP_CAP_PMTU);
+            ikcp_setmtu(kcp, 1400);
+            ikcp_pmtud(kcp, max_mtu, min_mtu);
+            ikcp_wndsize(kcp, 64, 64);
+        }
+        link.ab.mtu = link.ba.mtu = path;
+        link.ab.loss = link.ba.loss = 0.01;
+    }
+
+    // keeps a window of messages going, true once count are in
+    bool Pump(int count) {
+        std::string m(kSize, 0);
+        while (sent < count && ikcp_waitsnd(link.a) < 128) {
+            m[0] = static_cast<char>(sent++);
+            ikcp_send(link.a, m.data(), kSize);
+        }
+        int len;
+        while ((len = ikcp_recv(link.b, buf.data(), static_cast<int>(buf.size()))) > 0) {
+            bad |= len != kSize || buf[0] != static_cast<char>(got);
+            ++got;
+        }
+        return bad || got == count;
+    }
+};
+
+// the mtu climbs from 1400 to within a probe step of a 4000 path
+int CheckRaise() {
+    Transfer t(9000, 0, 4000);
+    TEST_CHECK(t.link.RunUntil([&] { return t.Pump(2000); }, 60000));
+    TEST_CHECK(!t.bad);
+    TEST_CHECK(t.link.a->mtu <= 4000);
+    TEST_CHECK(t.link.a->mtu + 64 > 4000);
+    return 0;
+}
+
+// the path drops to 1100 under a raised mtu: data keeps flowing and the
+// mtu ends up within 64 below the new path
+int CheckBlackHole() {
+    Transfer t(9000, 548, 4000);
+    TEST_CHECK(t.link.RunUntil([&] { return t.Pump(1000); }, 60000));
+    TEST_CHECK(t.link.a->mtu > 1400);
+
+    t.link.ab.mtu = t.link.ba.mtu = 1100;
+    TEST_CHECK(t.link.RunUntil([&] { return t.Pump(3000); }, 120000));
+    TEST_CHECK(!t.bad);
+    TEST_CHECK(t.link.a->mtu <= 1100);
+    TEST_CHECK(t.link.a->mtu + 64 > 1100);
+    return 0;
+}
+}
+
+int main() {
+    TEST_RUN(CheckRaise);
+    TEST_RUN(CheckBlackHole);
+    return 0;
+}
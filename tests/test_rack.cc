@@ -0,0 +1,121 @@
+// rack resends a segment lost mid-window once a later one is acked and
+// the reorder window has passed, well before the rto that recovers it
+// without rack, and a reordered segment does not count as lost
+#include <string>
+#include <vector>
+
+#include "kcp_link.h"
+#include "test_util.h"
+
+namespace {
+constexpr int kCount = 20;
+constexpr uint32_t kLost = 5;
+
+// time sn kLost is sent again after its first transmission is dropped,
+// fast acks off so only rack or the rto can resend it
+int Recover(int rack, uint32_t *resent) {
+    KCPLink link(1, 1);
+    ikcp_nodelay(link.a, 1, 10, 0, 1);
+    ikcp_rack(link.a, rack);
+    ikcp_wndsize(link.a, 64, 64);
+    ikcp_wndsize(link.b, 64, 64);
+
+    int pushes = 0;
+    *resent = 0;
+    link.ab.drop = [&](const std::string& data, uint64_t) {
+        if (KCPLink::Cmd(data) != KCPLink::kCmdPush || KCPLink::Sn(data) != kLost) {
+            return false;
+        }
+        if (++pushes == 2) {
+            *resent = link.now;
+        }
+        return pushes == 1;
+    };
+
+    // one segment per datagram
+    std::string m(1000, 'r');
+    for (int i = 0; i < kCount; ++i) {
+        ikcp_send(link.a, m.data(), static_cast<int>(m.size()));
+    }
+
+    int got = 0;
+    std::vector<char> buf(1 << 16);
+    bool ok = link.RunUntil([&] {
+        while (ikcp_recv(link.b, buf.data(), static_cast<int>(buf.size())) > 0) {
+            ++got;
+        }
+        return got == kCount && ikcp_waitsnd(link.a) == 0;
+    }, 10000);
+
+    TEST_CHECK(ok);
+    TEST_CHECK(pushes == 2);
+    return 0;
+}
+
+int CheckMidWindowLoss() {
+    uint32_t rack_at, rto_at;
+    TEST_CHECK(Recover(1, &rack_at) == 0);
+    TEST_CHECK(Recover(0, &rto_at) == 0);
+    // an rtt of 20, the flush intervals of both ends and the reorder
+    // window, where the rto is still 200
+    TEST_CHECK(rack_at < 60);
+    TEST_CHECK(rack_at < rto_at);
+    return 0;
+}
+
+// sn kLost arrives late instead of lost: held back less than the reorder
+// window it is acked before rack gives up on it
+int CheckReorder() {
+    KCPLink link(1, 1);
+    ikcp_nodelay(link.a, 1, 10, 0, 1);
+    ikcp_rack(link.a, 1);
+    ikcp_wndsize(link.a, 64, 64);
+    ikcp_wndsize(link.b, 64, 64);
+
+    std::string m(1000, 'r');
+    int pushes = 0;
+    link.ab.watch = [&](const std::string& data) {
+        if (KCPLink::Cmd(data) == KCPLink::kCmdPush && KCPLink::Sn(data) == kLost) {
+            ++pushes;
+        }
+    };
+
+    // a warm up round so the reorder window has a min rtt to scale
+    ikcp_send(link.a, m.data(), static_cast<int>(m.size()));
+    TEST_CHECK(link.RunUntil([&] { return ikcp_waitsnd(link.a) == 0; }, 1000));
+
+    // delay the datagram of sn kLost by 2ms
+    std::vector<KCPLink::Datagram> held;
+    link.ab.drop = [&](const std::string& data, uint64_t) {
+        if (KCPLink::Cmd(data) == KCPLink::kCmdPush && KCPLink::Sn(data) == kLost && held.empty()) {
+            held.push_back({ link.now + link.ab.delay + 2, data });
+            return true;
+        }
+        return false;
+    };
+    for (int i = 1; i < kCount; ++i) {
+        ikcp_send(link.a, m.data(), static_cast<int>(m.size()));
+    }
+
+    std::vector<char> buf(1 << 16);
+    bool ok = link.RunUntil([&] {
+        if (!held.empty() && held.front().at == link.now) {
+            ikcp_input(link.b, held.front().data.data(), static_cast<long>(held.front().data.size()));
+        }
+        while (ikcp_recv(link.b, buf.data(), static_cast<int>(buf.size())) > 0) {
+        }
+        return ikcp_waitsnd(link.a) == 0;
+    }, 10000);
+
+    TEST_CHECK(ok);
+    TEST_CHECK(held.size() == 1);
+    TEST_CHECK(pushes == 1);
+    return 0;
+}
+}
+
+int main() {
+    TEST_RUN(CheckMidWindowLoss);
+    TEST_RUN(CheckReorder);
+    return 0;
+}
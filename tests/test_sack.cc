@@ -0,0 +1,93 @@
+// SACK is only used once both ends have it: a one-sided cap leaves the
+// remote on plain acks, two sided the receiver reports holes as one
+// bitmap per flush and the sender still delivers everything in order
+#include <string>
+#include <vector>
+
+#include "kcp_link.h"
+#include "test_util.h"
+
+namespace {
+struct AckCount {
+    int ack = 0;
+    int sack = 0;
+};
+
+std::string Message(int seq) {
+    std::string m(1 + (seq * 131) % 2000, 0);
+    for (size_t i = 0; i < m.size(); ++i) {
+        m[i] = static_cast<char>(seq ^ i);
+    }
+    return m;
+}
+
+// count messages a to b under 10% loss, counting the acks b sends back
+int RoundTrip(int caps_a, int caps_b, int count, AckCount *acks) {
+    KCPLink link(1, 11);
+    link.ab.loss = link.ba.loss = 0.1;
+    link.ba.watch = [acks](const std::string& data) {
+        acks->ack += KCPLink::CountCmd(data, KCPLink::kCmdAck);
+        acks->sack += KCPLink::CountCmd(data, KCPLink::kCmdSack);
+    };
+    ikcp_setcaps(link.a, caps_a);
+    ikcp_setcaps(link.b, caps_b);
+    ikcp_wndsize(link.a, 64, 64);
+    ikcp_wndsize(link.b, 64, 64);
+
+    int sent = 0, got = 0;
+    std::vector<char> buf(1 << 16);
+    bool ok = link.RunUntil([&] {
+        while (sent < count && ikcp_waitsnd(link.a) < 128) {
+            std::string m = Message(sent++);
+            ikcp_send(link.a, m.data(), static_cast<int>(m.size()));
+        }
+
+        int len;
+        while ((len = ikcp_recv(link.b, buf.data(), static_cast<int>(buf.size()))) > 0) {
+            if (std::string(buf.data(), len) != Message(got)) {
+                return true;
+            }
+            ++got;
+        }
+        return got == count && ikcp_waitsnd(link.a) == 0;
+    }, 300000);
+
+    TEST_CHECK(ok);
+    TEST_CHECK(got == count);
+    TEST_CHECK(link.a->rmt_caps == static_cast<IUINT32>(caps_b));
+    TEST_CHECK(link.b->rmt_caps == static_cast<IUINT32>(caps_a));
+    return 0;
+}
+
+// a peer without SACK never gets one, whichever side has it
+int CheckOneSided() {
+    AckCount acks;
+    TEST_CHECK(RoundTrip(IKCP_CAP_SACK, 0, 1000, &acks) == 0);
+    TEST_CHECK(acks.sack == 0);
+    TEST_CHECK(acks.ack > 0);
+
+    acks = AckCount();
+    TEST_CHECK(RoundTrip(0, IKCP_CAP_SACK, 1000, &acks) == 0);
+    TEST_CHECK(acks.sack == 0);
+    TEST_CHECK(acks.ack > 0);
+    return 0;
+}
+
+// both with SACK: holes go out as bitmaps, in fewer segments than the
+// plain acks the same run needs
+int CheckBothSides() {
+    AckCount plain, sack;
+    TEST_CHECK(RoundTrip(0, 0, 1000, &plain) == 0);
+    TEST_CHECK(plain.sack == 0);
+    TEST_CHECK(RoundTrip(IKCP_CAP_SACK, IKCP_CAP_SACK, 1000, &sack) == 0);
+    TEST_CHECK(sack.sack > 0);
+    TEST_CHECK(sack.ack + sack.sack < plain.ack);
+    return 0;
+}
+}
+
+int main() {
+    TEST_RUN(CheckOneSided);
+    TEST_RUN(CheckBothSides);
+    return 0;
+}
@@ -0,0 +1,88 @@
+// the tail of a burst is lost with nothing after it to reveal the loss:
+// the tail loss probe resends it after two srtt where the rto would wait
+// its minimum, and a burst acked in time sends no probe
+#include <string>
+#include <vector>
+
+#include "kcp_link.h"
+#include "test_util.h"
+
+namespace {
+constexpr int kBurst = 4;
+
+struct Probes {
+    IUINT32 sent, needed, spurious;
+};
+
+// sends a burst after a warm up round, dropping the first transmission
+// of its last segment if lose is set. resent is when it went again
+int Burst(int tlp, bool lose, Probes *probes, uint32_t *resent) {
+    KCPLink link(1, 1);
+    // normal mode, the rto does not go below 100
+    ikcp_nodelay(link.a, 0, 10, 0, 1);
+    ikcp_tlp(link.a, tlp);
+
+    std::string m(1000, 't');
+    ikcp_send(link.a, m.data(), static_cast<int>(m.size()));
+    TEST_CHECK(link.RunUntil([&] { return ikcp_waitsnd(link.a) == 0; }, 1000));
+
+    uint32_t tail = link.a->snd_nxt + kBurst - 1, start = link.now;
+    int pushes = 0;
+    *resent = 0;
+    link.ab.drop = [&](const std::string& data, uint64_t) {
+        if (KCPLink::Cmd(data) != KCPLink::kCmdPush || KCPLink::Sn(data) != tail) {
+            return false;
+        }
+        if (++pushes == 2) {
+            *resent = link.now - start;
+        }
+        return lose && pushes == 1;
+    };
+    for (int i = 0; i < kBurst; ++i) {
+        ikcp_send(link.a, m.data(), static_cast<int>(m.size()));
+    }
+
+    int got = 0;
+    std::vector<char> buf(1 << 16);
+    bool ok = link.RunUntil([&] {
+        while (ikcp_recv(link.b, buf.data(), static_cast<int>(buf.size())) > 0) {
+            ++got;
+        }
+        return got == 1 + kBurst && ikcp_waitsnd(link.a) == 0;
+    }, 10000);
+
+    TEST_CHECK(ok);
+    *probes = { link.a->tlp_sent, link.a->tlp_needed, link.a->tlp_spurious };
+    return 0;
+}
+
+int CheckTailLoss() {
+    Probes with, without;
+    uint32_t probe_at, rto_at;
+    TEST_CHECK(Burst(1, true, &with, &probe_at) == 0);
+    TEST_CHECK(Burst(0, true, &without, &rto_at) == 0);
+    TEST_CHECK(with.sent == 1);
+    TEST_CHECK(with.needed == 1);
+    TEST_CHECK(with.spurious == 0);
+    TEST_CHECK(probe_at > 0);
+    TEST_CHECK(probe_at < 100);
+    TEST_CHECK(without.sent == 0);
+    TEST_CHECK(rto_at >= 100);
+    return 0;
+}
+
+int CheckNoLoss() {
+    Probes probes;
+    uint32_t resent;
+    TEST_CHECK(Burst(1, false, &probes, &resent) == 0);
+    TEST_CHECK(probes.sent == 0);
+    TEST_CHECK(resent == 0);
+    return 0;
+}
+}
+
+int main() {
+    TEST_RUN(CheckTailLoss);
+    TEST_RUN(CheckNoLoss);
+    return 0;
+}
@@ -0,0 +1,28 @@
+#ifndef _TEST_UTIL_H_INCLUDED
+#define _TEST_UTIL_H_INCLUDED
+
+#include <iostream>
+
+// the tests are plain executables, a failed check prints where and the
+// test returns non-zero for ctest
+#define TEST_CHECK(cond)                                                   \
+    do {                                                                   \
+        if (!(cond)) {                                                     \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " \
+                      << #cond << std::endl;                               \
+            return 1;                                                      \
+        }                                                                  \
+    } while (0)
+
+// runs a check function returning 0 on success, stops the test at the
+// first one that fails
+#define TEST_RUN(fn)                                                       \
+    do {                                                                   \
+        if (0 != (fn)()) {                                                 \
+            std::cerr << #fn << " failed" << std::endl;                    \
+            return 1;                                                      \
+        }                                                                  \
+        std::cout << #fn << " ok" << std::endl;                            \
+    } while (0)
+
+#endif // !_TEST_UTIL_H_INCLUDED
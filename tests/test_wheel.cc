@@ -0,0 +1,144 @@
+// TimerWheel with deadlines over all four levels and past the wheel:
+// tasks come out in deadline order as their slots cascade down, never
+// before their deadline and at most a tick after it, with reschedules
+// and cancels in between
+#include <algorithm>
+#include <cstdint>
+#include <random>
+#include <set>
+#include <utility>
+#include <vector>
+
+#include "timer_wheel.h"
+#include "test_util.h"
+
+using namespace kcp;
+
+namespace {
+constexpr uint64_t kTick = uint64_t(1) << TimerWheel::kTickBits;
+
+struct Task : TaskInterface {
+    uint64_t deadline = 0;
+    size_t id = 0;
+
+    uint32_t OnRun(uint32_t) override { return kNotContinue; }
+    void OnCancel() override {}
+};
+
+// the tick a deadline is rounded up to
+uint64_t Tick(uint64_t deadline) {
+    return (deadline + kTick - 1) / kTick;
+}
+
+typedef std::set<std::pair<uint64_t, size_t>> Pending;
+
+// spread over 16 bits of ticks to beyond the 2^38us of the wheel
+uint64_t Delay(std::mt19937_64 *rng) {
+    int bits = static_cast<int>((*rng)() % 41);
+    return (*rng)() & ((uint64_t(1) << bits) - 1);
+}
+
+// pops everything due by now: in tick order, none early, and nothing due
+// is left behind
+int PopDue(TimerWheel *wheel, Pending *pending, uint64_t now, uint64_t *last_tick) {
+    while (TaskInterface *t = wheel->PopExpired(now)) {
+        Task *task = static_cast<Task *>(t);
+        uint64_t tick = Tick(task->deadline);
+        TEST_CHECK(task->deadline <= now);
+        TEST_CHECK(tick >= *last_tick);
+        TEST_CHECK(pending->erase({ task->deadline, task->id }) == 1);
+        *last_tick = tick;
+    }
+    TEST_CHECK(pending->empty() || pending->begin()->first + kTick > now);
+    TEST_CHECK(wheel->size() == pending->size());
+    return 0;
+}
+
+// the clock jumps straight to each NextDelay, so every task runs within
+// a tick of its deadline
+int CheckNextDelay() {
+    std::mt19937_64 rng(31);
+    TimerWheel wheel;
+    std::vector<Task> tasks(20000);
+    Pending pending;
+    uint64_t now = 1000;
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        tasks[i].id = i;
+        tasks[i].deadline = now + Delay(&rng);
+        wheel.Schedule(nullptr, &tasks[i], tasks[i].deadline);
+        pending.insert({ tasks[i].deadline, i });
+    }
+
+    uint64_t last_tick = 0;
+    while (!wheel.empty()) {
+        uint64_t delay = wheel.NextDelay(now);
+        TEST_CHECK(delay != TimerWheel::kNever);
+        // a lower bound while a cascade is due, never past the next task
+        TEST_CHECK(now + delay <= pending.begin()->first + kTick);
+        now += delay;
+        while (TaskInterface *t = wheel.PopExpired(now)) {
+            Task *task = static_cast<Task *>(t);
+            TEST_CHECK(task->deadline <= now);
+            TEST_CHECK(now - task->deadline < kTick);
+            // the earliest pending, or one in the same tick
+            TEST_CHECK(Tick(task->deadline) == Tick(pending.begin()->first));
+            TEST_CHECK(Tick(task->deadline) >= last_tick);
+            pending.erase({ task->deadline, task->id });
+            last_tick = Tick(task->deadline);
+        }
+        if (0 == delay) {
+            ++now;
+        }
+    }
+    TEST_CHECK(pending.empty());
+    TEST_CHECK(wheel.NextDelay(now) == TimerWheel::kNever);
+    return 0;
+}
+
+// the clock moves in uneven jumps while tasks are added, moved and
+// cancelled, as an io thread would drive it
+int CheckChurn() {
+    std::mt19937_64 rng(32);
+    TimerWheel wheel;
+    std::vector<Task> tasks(5000);
+    Pending pending;
+    uint64_t now = (uint64_t(1) << 40) - 12345;
+    uint64_t last_tick = 0;
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        tasks[i].id = i;
+    }
+    for (int round = 0; round < 4000; ++round) {
+        for (int k = 0; k < 8; ++k) {
+            Task& task = tasks[rng() % tasks.size()];
+            bool linked = pending.count({ task.deadline, task.id }) > 0;
+            if (linked && 0 == rng() % 4) {
+                TEST_CHECK(wheel.Cancel(&task));
+                pending.erase({ task.deadline, task.id });
+                continue;
+            }
+
+            pending.erase({ task.deadline, task.id });
+            // a rescheduled task may land before what already ran
+            task.deadline = now + Delay(&rng) % (uint64_t(1) << 32);
+            wheel.Schedule(nullptr, &task, task.deadline);
+            pending.insert({ task.deadline, task.id });
+            last_tick = (std::min)(last_tick, Tick(task.deadline));
+        }
+
+        now += Delay(&rng) % 3000000;
+        TEST_CHECK(PopDue(&wheel, &pending, now, &last_tick) == 0);
+    }
+
+    std::vector<TaskInterface *> left;
+    wheel.TakeAll(&left);
+    TEST_CHECK(left.size() == pending.size());
+    TEST_CHECK(wheel.empty());
+    return 0;
+}
+}
+
+int main() {
+    TEST_RUN(CheckNextDelay);
+    TEST_RUN(CheckChurn);
+    return 0;
+}
@@ -0,0 +1,175 @@
+// messages over 255 fragments: with XFRAG on both ends they come out
+// whole through ikcp_recv_fragments under loss, a remote without it gets
+// the short messages only, and a referenced long send is cut as the
+// window moves so only the segments in flight hold the buffer
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "kcp_link.h"
+#include "test_util.h"
+
+namespace {
+std::string Message(int seq, size_t size) {
+    std::string m(size, 0);
+    for (size_t i = 0; i < m.size(); ++i) {
+        m[i] = static_cast<char>(seq * 17 + i / 7);
+    }
+    return m;
+}
+
+// the next message read by fragments, empty until its last one is in
+struct Reassembly {
+    std::string message;
+
+    bool Read(ikcpcb *kcp, std::string *out) {
+        IQUEUEHEAD list;
+        int more = 0;
+        iqueue_init(&list);
+        while (ikcp_recv_fragments(kcp, &list, &more) >= 0) {
+            for (IQUEUEHEAD *p = list.next; p != &list; p = p->next) {
+                IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
+                message.append(IKCP_SEG_DATA(seg), seg->len);
+            }
+            ikcp_free_segments(kcp, &list);
+            if (!more) {
+                out->swap(message);
+                message.clear();
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+// long and short messages a to b under 5% loss, rcv_wnd far below the
+// fragments of one message
+int CheckLongMessages() {
+    KCPLink link(1, 5);
+    link.ab.loss = link.ba.loss = 0.05;
+    ikcp_setcaps(link.a, IKCP_CAP_XFRAG);
+    ikcp_setcaps(link.b, IKCP_CAP_XFRAG);
+    ikcp_wndsize(link.a, 64, 64);
+    ikcp_wndsize(link.b, 64, 64);
+
+    const std::vector<size_t> sizes = {
+        300 * link.a->mss + 5, 1, 256 * link.a->mss, 700 * link.a->mss - 3, 2000,
+    };
+    for (size_t i = 0; i < sizes.size(); ++i) {
+        std::string m = Message(static_cast<int>(i), sizes[i]);
+        TEST_CHECK(ikcp_send(link.a, m.data(), static_cast<int>(m.size())) == 0);
+    }
+
+    size_t got = 0;
+    Reassembly rs;
+    bool ok = link.RunUntil([&] {
+        std::string m;
+        while (got < sizes.size() && rs.Read(link.b, &m)) {
+            if (m != Message(static_cast<int>(got), sizes[got])) {
+                return true;
+            }
+            ++got;
+        }
+        return got == sizes.size();
+    }, 300000);
+
+    TEST_CHECK(ok);
+    TEST_CHECK(got == sizes.size());
+    TEST_CHECK(link.a->snd_dropped == 0);
+    return 0;
+}
+
+// a long message queued before the remote's caps are known is dropped
+// once they show no XFRAG, the ones around it still arrive
+int CheckPeerWithoutXFrag() {
+    KCPLink link(1, 5);
+    ikcp_setcaps(link.a, IKCP_CAP_XFRAG);
+    ikcp_wndsize(link.a, 64, 64);
+    ikcp_wndsize(link.b, 64, 64);
+
+    std::string small = Message(1, 3000), large = Message(2, 300 * link.a->mss);
+    TEST_CHECK(ikcp_send(link.a, large.data(), static_cast<int>(large.size())) == 0);
+    TEST_CHECK(ikcp_send(link.a, small.data(), static_cast<int>(small.size())) == 0);
+
+    int got = 0;
+    std::vector<char> buf(1 << 16);
+    bool ok = link.RunUntil([&] {
+        int len;
+        while ((len = ikcp_recv(link.b, buf.data(), static_cast<int>(buf.size()))) > 0) {
+            if (std::string(buf.data(), len) != small) {
+                return true;
+            }
+            ++got;
+        }
+        return got == 1 && ikcp_waitsnd(link.a) == 0;
+    }, 10000);
+
+    TEST_CHECK(ok);
+    TEST_CHECK(got == 1);
+    TEST_CHECK(link.a->snd_dropped == 1);
+    // refused up front once the caps are known
+    TEST_CHECK(ikcp_send(link.a, large.data(), static_cast<int>(large.size())) < 0);
+    return 0;
+}
+
+struct RefCount {
+    int retained = 0;
+    int released = 0;
+    int live_max = 0;
+};
+
+void Retain(void *ref, ikcpcb *, void *) {
+    RefCount *rc = static_cast<RefCount *>(ref);
+    ++rc->retained;
+    rc->live_max = std::max(rc->live_max, rc->retained - rc->released);
+}
+
+void Release(void *ref, ikcpcb *, void *) {
+    ++static_cast<RefCount *>(ref)->released;
+}
+
+// one ikcp_send_ref of 400 segments holds at most the window plus the
+// queued remainder, and every reference is given back
+int CheckReferencedCut() {
+    KCPLink link(1, 9);
+    link.ab.loss = link.ba.loss = 0.05;
+    ikcp_setcaps(link.a, IKCP_CAP_XFRAG);
+    ikcp_setcaps(link.b, IKCP_CAP_XFRAG);
+    ikcp_wndsize(link.a, 32, 32);
+    ikcp_wndsize(link.b, 32, 32);
+    link.a->ref_retain = &Retain;
+    link.a->ref_release = &Release;
+
+    RefCount rc;
+    std::string large = Message(3, 400 * link.a->mss - 11);
+    TEST_CHECK(ikcp_send_ref(link.a, large.data(), static_cast<int>(large.size()), &rc) == 0);
+    TEST_CHECK(rc.retained == 1);
+    TEST_CHECK(ikcp_waitsnd(link.a) == 400);
+
+    bool got = false;
+    Reassembly rs;
+    bool ok = link.RunUntil([&] {
+        std::string m;
+        if (!got && rs.Read(link.b, &m)) {
+            if (m != large) {
+                return true;
+            }
+            got = true;
+        }
+        return got && ikcp_waitsnd(link.a) == 0;
+    }, 300000);
+
+    TEST_CHECK(ok);
+    TEST_CHECK(got);
+    TEST_CHECK(rc.retained == rc.released);
+    TEST_CHECK(rc.live_max <= 32 + 1);
+    return 0;
+}
+}
+
+int main() {
+    TEST_RUN(CheckLongMessages);
+    TEST_RUN(CheckPeerWithoutXFrag);
+    TEST_RUN(CheckReferencedCut);
+    return 0;
+}